@@ -0,0 +1,106 @@
+// dcd-compile-graph.cc
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// Compile a search Fst into the mapped search graph format read by dcd-recog
+
+#include <iostream>
+#include <string>
+
+#include <fst/vector-fst.h>
+
+#include <dcd/cascade.h>
+#include <dcd/config.h>
+#include <dcd/generic-transition-model.h>
+#include <dcd/hmm-transition-model.h>
+#include <dcd/log.h>
+#include <dcd/search-graph-cache.h>
+#include <dcd/search-opts.h>
+
+using namespace std;
+using namespace dcd;
+using namespace fst;
+
+string tm_type = "hmm";
+
+template<class TransModel>
+int CompileGraphMain(ParseOptions &po, const SearchOptions &opts) {
+  string trans_model_rs = po.GetArg(1);
+  string fst_rs = po.GetArg(2);
+  string graph_out = po.GetArg(3);
+  Logger logger("dcd-compile-graph", std::cerr, opts.colorize);
+
+  logger(INFO) << "Attempting to read transition model " << trans_model_rs;
+  TransModel* trans_model = TransModel::ReadFsts(trans_model_rs,
+                                                 opts.trans_scale);
+  if (!trans_model)
+    logger(FATAL) << "Failed to read transition model";
+
+  logger(INFO) << "Attempting to read fst " << fst_rs;
+  Cascade<StdArc>* cascade = Cascade<StdArc>::Read(fst_rs);
+  if (!cascade)
+    logger(FATAL) << "Failed to load fst from file : " << fst_rs;
+  const StdFst* fst = cascade->Rebuild();
+  if (!fst)
+    logger(FATAL) << "Cascade build failed";
+  if (fst->Start() == kNoStateId)
+    logger(FATAL) << "Fst does not have a valid start state";
+  // The records are indexed by state id, a lazy cascade is expanded first
+  StdVectorFst* expanded = 0;
+  if (!fst->Properties(kExpanded, false)) {
+    logger(INFO) << "Expanding the cascade";
+    expanded = new StdVectorFst(*fst);
+    fst = expanded;
+  }
+
+  logger(INFO) << "Compiling search graph";
+  SearchGraphCache<StdFst, TransModel> graph(*fst, *trans_model, opts);
+  if (!graph.Write(graph_out))
+    logger(FATAL) << "Failed to write compiled search graph : " << graph_out;
+  logger(INFO) << "Wrote " << graph.NumStates() << " states ("
+               << graph.Size() / kMegaByte << " MB) to " << graph_out;
+
+  if (expanded)
+    delete expanded;
+  delete cascade;
+  delete trans_model;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *usage = "Compile a search Fst for memory mapped decoding\n"
+        "Usage: dcd-compile-graph [options] trans-model-in fst-in graph-out";
+  ParseOptions po(usage);
+  SearchOptions opts;
+  po.Register("trans_model_type", &tm_type, "Type of transition model, "
+              "hmm or generic");
+  opts.Register(&po);
+  po.Read(argc, argv);
+
+  if (po.NumArgs() != 3) {
+    po.PrintUsage();
+    exit(1);
+  }
+  opts.Check();
+
+  // Only the topology of the transition model is used, the acoustic front
+  // end type is irrelevant
+  if (tm_type == "hmm")
+    return CompileGraphMain<HMMTransitionModel<Decodable> >(po, opts);
+  if (tm_type == "generic")
+    return CompileGraphMain<GenericTransitionModel<Decodable> >(po, opts);
+  LOG(FATAL) << "Unknown transition model type : " << tm_type;
+  return 1;
+}
@@ -0,0 +1,60 @@
+// dcd-compile-trans-model.cc
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// Convert the arc types of an HMM transition model into the binary format
+// that dcd-recog maps at start up
+
+#include <iostream>
+#include <string>
+
+#include <dcd/config.h>
+#include <dcd/constants.h>
+#include <dcd/hmm-transition-model.h>
+#include <dcd/log.h>
+
+using namespace std;
+using namespace dcd;
+
+float trans_scale = kDefaultTranScale;
+
+int main(int argc, char *argv[]) {
+  const char *usage = "Convert arc types to a binary transition model\n"
+        "Usage: dcd-compile-trans-model [options] arcs-in model-out";
+  ParseOptions po(usage);
+  po.Register("trans_scale", &trans_scale, "Scale applied to the "
+              "transition weights, must match the dcd-recog trans_scale");
+  po.Read(argc, argv);
+
+  if (po.NumArgs() != 2) {
+    po.PrintUsage();
+    exit(1);
+  }
+  string arcs_rs = po.GetArg(1);
+  string model_out = po.GetArg(2);
+  Logger logger("dcd-compile-trans-model", std::cerr, true);
+
+  typedef HMMTransitionModel<Decodable> TransModel;
+  logger(INFO) << "Attempting to read transition model " << arcs_rs;
+  TransModel* trans_model = TransModel::ReadFsts(arcs_rs, trans_scale);
+  if (!trans_model)
+    logger(FATAL) << "Failed to read transition model";
+  trans_model->DumpInfo(logger);
+  if (!trans_model->Write(model_out))
+    logger(FATAL) << "Failed to write transition model : " << model_out;
+  logger(INFO) << "Wrote binary transition model to " << model_out;
+  delete trans_model;
+  return 0;
+}
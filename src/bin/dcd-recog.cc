@@ -16,14 +16,18 @@
 // \file
 // Main decoding command
 
+#include <cmath>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <string>
 
 #include <fst/extensions/far/far.h>
 
 #include <dcd/clevel-decoder.h>
 #include <dcd/cascade.h>
+#include <dcd/compiled-search-graph.h>
 #include <dcd/config.h>
 #include <dcd/cpu-stats.h>
 #include <dcd/generic-transition-model.h>
@@ -31,8 +35,12 @@
 #include <dcd/kaldi-lattice-arc.h>
 #include <dcd/lattice.h>
 #include <dcd/simple-lattice.h>
+#include <dcd/lm-rescorer.h>
 #include <dcd/log.h>
 #include <dcd/memdebug.h>
+#include <dcd/search-statistics.h>
+#include <dcd/search-trace.h>
+#include <dcd/thread-pool.h>
 #include <dcd/utils.h>
 
 
@@ -42,7 +50,15 @@ using namespace fst;
 
 string tm_type = "hmm_lattice";
 string word_symbols_file;
+string rescore_lm_file;
+string rescore_small_lm_file;
 string logfile = "/dev/stderr";
+string search_trace_file;
+string search_trace_format = "csv";
+string search_profile_file;
+string lookahead_groups_file;
+int num_threads = 1;
+int streaming_chunk = 0;
 
 //Simple table writer for Kaldi FST tables
 template <class A>
@@ -75,13 +91,227 @@ class TableWriter {
 
 
 
+// Build the recognition string for the best path and log the per utterance
+// decoding summary
+template<class B>
+void LogUtteranceResult(const string& key, const VectorFst<B>& ofst,
+                        float cost, double elapsed, int frame_count,
+                        const SymbolTable* wordsyms, CPUStats* cpustats,
+                        Logger* logger) {
+  stringstream ss;
+  int numwords = 0;
+  for (StateIterator<Fst<B> > siter(ofst); !siter.Done(); siter.Next()) {
+    ArcIterator<Fst<B> > aiter(ofst, siter.Value());
+    if (!aiter.Done()) {
+      const B &arc = aiter.Value();
+      if (arc.olabel) {
+        if (wordsyms) {
+          ++numwords;
+          const string &word = wordsyms->Find(arc.olabel);
+          if (word.empty()) {
+            (*logger)(WARN) << "Missing word sym : " << arc.olabel;
+            ss << "MISSING_WORD_SYM ";
+          } else {
+            ss << word << " ";
+          }
+        }
+      }
+    }
+  }
+  string recogstring = ss.str();
+  ss.str("");
+
+  ss << "Finished decoding : " << endl
+     << "\t\t  Best cost : " << cost << endl
+     << "\t\t  Average log-likelihood per frame : "
+     << cost / frame_count << endl
+     << "\t\t  Decoding time : " << elapsed << endl
+     << "\t\t  RTF : " << (elapsed * 100.0 / frame_count) << endl
+     << "\t\t  Number of words : " << numwords << endl
+     << "\t\t  Recog result : (" << key << ") "
+     << recogstring << endl
+     << "\t\t  Process CPU load : "
+     << cpustats->GetCurrentProcessCPULoad() << endl
+     << "\t\t  System CPU load : "
+     << cpustats->GetSystemCPULoad() << endl
+     << "\t\t  Peak memory usage : "
+     << GetPeakRSS() / (1024 * 1024) << " MB" << endl
+     << "\t\t  Current memory usage : "
+     << GetCurrentRSS() / (1024 * 1024) << " MB" << endl;
+  if (g_dcd_memdebug_enabled)
+    ss << "\t\t  Memory allocated after decoding : "
+       <<  g_dcd_current_num_allocated / kMegaByte << " MB" << endl;
+  (*logger)(INFO) << ss.str();
+}
+
+// Per-thread state when decoding utterances in parallel. Each worker owns a
+// decoder (and therefore a lattice) and a thread-safe copy of the search Fst,
+// the transition model is shared by all the workers
+template<class Decoder>
+struct DecodeWorker {
+  DecodeWorker() : fst(0), decoder(0), num_decoded(0) { }
+
+  StdFst* fst;
+  Decoder* decoder;
+  int num_decoded;
+  // Statistics of the decoders the worker has already deleted
+  typename Decoder::SearchStatistics stats;
+};
+
+// A single utterance travelling through the worker pool. The FAR writer
+// runs on the main thread and consumes the results in input order
+template<class B>
+struct UtteranceTask {
+  UtteranceTask(int num, const string& key, Matrix<float>* features)
+      : num(num), key(key), features(features), frame_count(0),
+        cost(kMaxCost), elapsed(0.0), done(false) { }
+
+  int num;
+  string key;
+  Matrix<float>* features;
+  int frame_count;
+  VectorFst<B> ofst;
+  VectorFst<B> lattice;
+  float cost;
+  double elapsed;
+  bool done;  // Guarded by the mutex shared with the writer
+};
+
+// Decodes the features of one utterance with the front end F of the
+// decoder, the whole utterance is available at once
+template<class F>
+struct UtteranceDecoder {
+  template<class D, class B>
+  static float Decode(D* decoder, const Matrix<float>& features,
+                      const SearchOptions& opts, VectorFst<B>* ofst,
+                      VectorFst<B>* lattice) {
+    if (streaming_chunk > 0)
+      logger(FATAL) << "--streaming_chunk needs the hmm_streaming decoder";
+    F frontend(features, 1.0f);
+    return decoder->Decode(&frontend, opts, ofst, lattice);
+  }
+};
+
+#ifndef HAVE_KALDI
+// Feeds the features streaming_chunk frames at a time, as they would arrive
+// from a live input, and advances the search over each chunk. The input is
+// only finished after the last chunk, so every call leaves the newest frame
+// for the next one
+template<>
+struct UtteranceDecoder<StreamingDecodable> {
+  template<class D, class B>
+  static float Decode(D* decoder, const Matrix<float>& features,
+                      const SearchOptions& opts, VectorFst<B>* ofst,
+                      VectorFst<B>* lattice) {
+    int num_frames = features.NumRows();
+    int chunk = streaming_chunk > 0 ? streaming_chunk : num_frames;
+    StreamingDecodable frontend(features.NumCols());
+    decoder->InitDecoding(&frontend);
+    for (int i = 0; i < num_frames; i += chunk) {
+      for (int j = i; j != min(i + chunk, num_frames); ++j)
+        frontend.AcceptFrame(features.Row(j));
+      decoder->AdvanceDecoding();
+      VLOG(1) << "Decoded " << decoder->NumFramesDecoded() << " of "
+              << frontend.NumFramesReady() << " frames received";
+    }
+    frontend.InputFinished();
+    decoder->AdvanceDecoding();
+    return decoder->FinalizeDecoding(ofst, lattice);
+  }
+};
+#endif
+
+// Functor scheduled on the pool, decodes one utterance with the decoder
+// belonging to the worker it runs on
+template<class TransModel, class L, class B, class S>
+struct DecodeUtteranceFunctor {
+  typedef typename TransModel::FrontEnd FrontEnd;
+  typedef CLevelDecoder<StdFst, TransModel, L, TokenTpl, S> Decoder;
+  typedef typename Decoder::SearchGraph SearchGraph;
+
+  DecodeUtteranceFunctor(UtteranceTask<B>* task,
+                         vector<DecodeWorker<Decoder> >* workers,
+                         const StdFst* fst, const TransModel* trans_model,
+                         const SearchOptions* opts, SearchGraph* graph,
+                         SearchTrace* trace, const vector<int>* groups,
+                         std::mutex* mutex)
+      : task_(task), workers_(workers), fst_(fst),
+        trans_model_(trans_model), opts_(opts), graph_(graph),
+        trace_(trace), groups_(groups), mutex_(mutex) { }
+
+  void operator()(int id) {
+    DecodeWorker<Decoder>& worker = (*workers_)[id];
+    bool reset = opts_->fst_reset_period > 0 &&
+      worker.num_decoded % opts_->fst_reset_period == 0;
+    if (!worker.decoder || reset) {
+      if (worker.decoder) {
+        worker.stats.Push(worker.decoder->GetStatistics());
+        delete worker.decoder;
+      }
+      {
+        // Fst copies touch the reference counts of the shared
+        // implementation, so serialize them
+        std::lock_guard<std::mutex> lock(*mutex_);
+        if (worker.fst)
+          delete worker.fst;
+        worker.fst = fst_ ? fst_->Copy(true) : 0;
+      }
+      worker.decoder = new Decoder(worker.fst, trans_model_, *opts_,
+                                   &std::cerr, 0, graph_);
+      worker.decoder->SetLookaheadGroups(*groups_);
+    }
+    ++worker.num_decoded;
+    worker.decoder->SetSource(task_->key);
+    worker.decoder->SetTrace(trace_, task_->key, id);
+    Timer timer;
+    task_->cost = UtteranceDecoder<FrontEnd>::Decode(worker.decoder,
+        *task_->features, *opts_, &task_->ofst,
+        opts_->gen_lattice ? &task_->lattice : 0);
+    task_->elapsed = timer.Elapsed();
+    task_->frame_count = task_->features->NumRows();
+    delete task_->features;
+    task_->features = 0;
+    std::lock_guard<std::mutex> lock(*mutex_);
+    task_->done = true;
+  }
+
+  UtteranceTask<B>* task_;
+  vector<DecodeWorker<Decoder> >* workers_;
+  const StdFst* fst_;  // Null when decoding with a compiled graph
+  const TransModel* trans_model_;
+  const SearchOptions* opts_;
+  SearchGraph* graph_;  // Shared by the workers, null for lazy Fsts
+  SearchTrace* trace_;  // Shared by the workers, null when not tracing
+  const vector<int>* groups_;  // Lookahead groups, empty for one per pdf
+  std::mutex* mutex_;
+};
+
+// Bytes the composition cache of a lazy cascade may use
+inline size_t ComposeCacheLimit(const SearchOptions& opts) {
+  return static_cast<size_t>(max(opts.compose_cache_size, 0)) * kMegaByte;
+}
+
+// Read the acoustic lookahead group of each zero based pdf, whitespace
+// separated in pdf order. The decoder checks the map against the decodable
+bool ReadLookaheadGroups(const string& filename, vector<int>* groups) {
+  ifstream ifs(filename.c_str());
+  if (!ifs.is_open())
+    return false;
+  groups->clear();
+  int group;
+  while (ifs >> group)
+    groups->push_back(group);
+  return ifs.eof() && !groups->empty();
+}
+
 //L is the decoder lattice type
 //B is the output lattice semiring
-template<class TransModel, class L, class B>
+//S is the search statistics collected for the profile
+template<class TransModel, class L, class B, class S>
 int CLevelDecoderMain(ParseOptions &po, SearchOptions *opts, 
     const string &word_symbols_file) {
   typedef typename TransModel::FrontEnd FrontEnd;
-  typedef CLevelDecoder<StdFst, TransModel, L> Decoder;
+  typedef CLevelDecoder<StdFst, TransModel, L, TokenTpl, S> Decoder;
   PROFILE_BEGIN(ModelLoad);
   string trans_model_rs = po.GetArg(1);
   string fst_rs = po.GetArg(2);
@@ -98,21 +328,37 @@ int CLevelDecoderMain(ParseOptions &po, SearchOptions *opts,
   cerr << endl;
 
   Cascade<StdArc>* cascade = 0;
+  CompiledSearchGraph* compiled = 0;
   TransModel* trans_model = 0;
   SymbolTable* wordsyms  = 0;
-
-  logger(INFO) << "Attempting to read fst " << fst_rs;
-  cascade = Cascade<StdArc>::Read(fst_rs);
-  if (!cascade) 
-    logger(FATAL) << "Failed to load fst from file : " << fst_rs;
+  RescoringLm* rescoring_lm = 0;
+  SearchTrace* trace = 0;
+  vector<int> lookahead_groups;
+  S stats;  // Merged from every decoder as it is deleted
+
+  // A graph from dcd-compile-graph can be given in place of the fst, it is
+  // mapped instead of read and never rebuilt
+  if (CompiledSearchGraph::IsCompiledSearchGraph(fst_rs)) {
+    logger(INFO) << "Attempting to map compiled search graph " << fst_rs;
+    compiled = CompiledSearchGraph::Read(fst_rs);
+    if (!compiled)
+      logger(FATAL) << "Failed to map search graph from file : " << fst_rs;
+    logger(INFO) << "Compiled search graph has " << compiled->NumStates()
+                 << " states and " << compiled->NumArcs() << " arcs";
+  } else {
+    logger(INFO) << "Attempting to read fst " << fst_rs;
+    cascade = Cascade<StdArc>::Read(fst_rs);
+    if (!cascade)
+      logger(FATAL) << "Failed to load fst from file : " << fst_rs;
+  }
   cerr << endl;
 
   logger(INFO) << "Attempting to read transition model " <<  trans_model_rs;
   trans_model = TransModel::ReadFsts(trans_model_rs,
                                                  opts->trans_scale);
-  trans_model->DumpInfo(logger);
   if (!trans_model)
     logger(FATAL) << "Failed to read transition model";
+  trans_model->DumpInfo(logger);
   wordsyms = 0;
   if (!word_symbols_file.empty()) {
     logger(INFO) << "Attempting to read word symbols from : " 
@@ -123,6 +369,37 @@ int CLevelDecoderMain(ParseOptions &po, SearchOptions *opts,
         << word_symbols_file;
     opts->wordsyms = wordsyms;
   }
+  // The options would be silently ignored by the simpler lattices
+  if (!rescore_lm_file.empty() && !L::CanRescore())
+    logger(FATAL) << "Decoder type " << Decoder::Type() << " can't rescore, "
+      << "--rescore_lm needs a lattice decoder";
+  if (opts->incremental_lattice && !L::CanSettle())
+    logger(FATAL) << "Decoder type " << Decoder::Type() << " can't settle "
+      << "the lattice, --incremental_lattice needs a lattice decoder";
+  if (!rescore_lm_file.empty()) {
+    logger(INFO) << "Attempting to read rescoring LM from : "
+      << rescore_lm_file;
+    rescoring_lm = RescoringLm::Read(rescore_lm_file, rescore_small_lm_file);
+    if (!rescoring_lm)
+      logger(FATAL) << "Failed to read rescoring LM";
+    opts->rescoring_lm = rescoring_lm;
+  }
+  if (!search_trace_file.empty()) {
+#ifndef HAVE_SEARCH_TRACE
+    logger(WARN) << "Built without HAVE_SEARCH_TRACE, the search trace "
+      << "will be empty";
+#endif
+    trace = SearchTrace::Open(search_trace_file, search_trace_format);
+    if (!trace)
+      logger(FATAL) << "Failed to open search trace : " << search_trace_file;
+  }
+  if (!lookahead_groups_file.empty()) {
+    logger(INFO) << "Attempting to read lookahead groups from : "
+      << lookahead_groups_file;
+    if (!ReadLookaheadGroups(lookahead_groups_file, &lookahead_groups))
+      logger(FATAL) << "Failed to read lookahead groups from : "
+        << lookahead_groups_file;
+  }
   PROFILE_END();
 
   logger(INFO) << "Attempting to read features from " << feat_rs;
@@ -142,84 +419,123 @@ int CLevelDecoderMain(ParseOptions &po, SearchOptions *opts,
   cpustats.GetSystemCPULoad();
   StdFst *fst = 0;
   Decoder *decoder = 0;
+  typename Decoder::SearchGraph* graph = 0;
+  if (compiled)
+    graph = new typename Decoder::SearchGraph(*compiled, *trans_model, *opts);
   int num = 0;
+  if (num_threads > 1) {
+    // Utterance parallel mode, the cascade and the transition model are
+    // loaded once and shared by all the workers
+    logger(INFO) << "Decoding with " << num_threads << " threads";
+    typedef UtteranceTask<B> Task;
+    if (!compiled) {
+      fst = cascade->Rebuild(ComposeCacheLimit(*opts));
+      if (!fst)
+        logger(FATAL) << "Cascade build failed";
+      if (fst->Start() == kNoStateId)
+        logger(FATAL) << "Fst does not have a valid start state";
+      // The static part of the search states is compiled once for all the
+      // workers, the worker Fst copies share the state ids of an expanded Fst
+      if (fst->Properties(kExpanded, false))
+        graph = new typename Decoder::SearchGraph(*fst, *trans_model, *opts);
+    }
+    vector<DecodeWorker<Decoder> > workers(num_threads);
+    std::mutex mutex;
+    std::deque<Task*> pending;  // Utterances in input order
+    ThreadPool pool(num_threads);
+    for (;;) {
+      bool more = !feature_reader.Done();
+      if (more) {
+        const string& key = feature_reader.Key();
+        const Matrix<float>& features = feature_reader.Value();
+        logger(INFO) << "Decoding features : " << key << ", # frames "
+                     << features.NumRows();
+        Task* task = new Task(num++, key, new Matrix<float>(features));
+        pending.push_back(task);
+        pool.Schedule(DecodeUtteranceFunctor<TransModel, L, B, S>(task,
+              &workers, fst, trans_model, opts, graph, trace,
+              &lookahead_groups, &mutex));
+        feature_reader.FreeCurrent();
+        feature_reader.Next();
+        // Limit the number of utterances held in memory
+        pool.WaitUntilPending(2 * num_threads);
+      } else {
+        pool.Wait();
+      }
+      // Write out the finished utterances keeping the input order
+      while (!pending.empty()) {
+        Task* task = pending.front();
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!task->done)
+            break;
+        }
+        pending.pop_front();
+        stringstream farkey;
+        farkey << setfill('0') << setw(5) << task->num << "_" << task->key;
+        farwriter->Add(farkey.str(),
+                       opts->gen_lattice ? task->lattice : task->ofst);
+        LogUtteranceResult(task->key, task->ofst, task->cost, task->elapsed,
+                           task->frame_count, wordsyms, &cpustats, &logger);
+        total_time += task->elapsed;
+        total_num_frames += task->frame_count;
+        delete task;
+      }
+      if (!more)
+        break;
+    }
+    for (int i = 0; i != workers.size(); ++i) {
+      stats.Push(workers[i].stats);
+      if (workers[i].decoder) {
+        stats.Push(workers[i].decoder->GetStatistics());
+        delete workers[i].decoder;
+      }
+      if (workers[i].fst)
+        delete workers[i].fst;
+    }
+  }
   for (; !feature_reader.Done(); feature_reader.Next(), ++num) {
-    if (num % opts->fst_reset_period == 0) {
+    if (compiled) {
+      if (!decoder) {
+        decoder = new Decoder(0, trans_model, *opts, &std::cerr, 0, graph);
+        decoder->SetLookaheadGroups(lookahead_groups);
+      }
+    } else if (!decoder || (opts->fst_reset_period > 0 &&
+                            num % opts->fst_reset_period == 0)) {
       logger(INFO) << "Rebuilding cascade and decoder at utterance : " << num;
       if (decoder) {
+        cascade->DumpStats(logger);
+        stats.Push(decoder->GetStatistics());
         delete decoder;
         decoder = 0;
       }
-      fst = cascade->Rebuild();
+      fst = cascade->Rebuild(ComposeCacheLimit(*opts));
       if (!fst)
         logger(FATAL) << "Cascade build failed";
       if (fst->Start() == kNoStateId) 
         logger(FATAL) << "Fst does not have a valid start state";
       decoder = new Decoder(fst, trans_model, *opts);
+      decoder->SetLookaheadGroups(lookahead_groups);
     }
     const string& key = feature_reader.Key();
-    opts->source = key;
+    decoder->SetSource(key);
+    decoder->SetTrace(trace, key, 0);
     const Matrix<float>& features = feature_reader.Value();
     int frame_count = features.NumRows();
     logger(INFO) << "Decoding features : " << key << ", # frames " 
                  << frame_count;
 
-    FrontEnd* frontend = new FrontEnd(features, 1.0f);
     VectorFst<B> ofst;
     VectorFst<B> lattice;
-    trans_model->SetInput(frontend, *opts);
     timer.Reset();
-    float cost = decoder->Decode(trans_model, *opts, &ofst, 
-        opts->gen_lattice ? &lattice : 0);
-    delete frontend;
+    float cost = UtteranceDecoder<FrontEnd>::Decode(decoder, features, *opts,
+        &ofst, opts->gen_lattice ? &lattice : 0);
     double elapsed = timer.Elapsed();
     stringstream farkey;
     farkey << setfill('0') << setw(5) << num << "_" << key;
     farwriter->Add(farkey.str(), opts->gen_lattice ? lattice : ofst);
-    stringstream ss;
-    int numwords = 0;
-    for (StateIterator<Fst<B> > siter(ofst); !siter.Done(); siter.Next()) {
-      ArcIterator<Fst<B> > aiter(ofst, siter.Value()); 
-      if (!aiter.Done()) {
-        const B &arc = aiter.Value();
-        if (arc.olabel) {
-          if (wordsyms) {
-            ++numwords;
-            const string &word = wordsyms->Find(arc.olabel);
-            if (word.empty()) {
-              logger(WARN) << "Missing word sym : " << arc.olabel;
-              ss << "MISSING_WORD_SYM ";
-            } else {
-              ss << word << " ";
-            }
-          }
-        }
-      }
-    }
-    string recogstring = ss.str();
-    ss.str("");
-
-    ss << "Finished decoding : " << endl
-       << "\t\t  Best cost : " << cost << endl 
-       << "\t\t  Average log-likelihood per frame : " 
-       << cost / frame_count << endl
-       << "\t\t  Decoding time : " << elapsed << endl
-       << "\t\t  RTF : " << (elapsed * 100.0 / frame_count) << endl
-       << "\t\t  Number of words : " << numwords << endl
-       << "\t\t  Recog result : (" << key << ") " 
-       << recogstring << endl
-       << "\t\t  Process CPU load : " 
-       << cpustats.GetCurrentProcessCPULoad() << endl
-       << "\t\t  System CPU load : " 
-       << cpustats.GetSystemCPULoad() << endl
-       << "\t\t  Peak memory usage : " 
-       << GetPeakRSS() / (1024 * 1024) << " MB" << endl
-       << "\t\t  Current memory usage : " 
-       << GetCurrentRSS() / (1024 * 1024) << " MB" << endl;
-    if (g_dcd_memdebug_enabled)
-      ss << "\t\t  Memory allocated after decoding : " 
-         <<  g_dcd_current_num_allocated / kMegaByte << " MB" << endl;
-    logger(INFO) << ss.str();
+    LogUtteranceResult(key, ofst, cost, elapsed, frame_count, wordsyms,
+                       &cpustats, &logger);
     total_time += elapsed;
     total_num_frames += frame_count;
     feature_reader.FreeCurrent();
@@ -232,18 +548,41 @@ int CLevelDecoderMain(ParseOptions &po, SearchOptions *opts,
     << "\t\t  Total # of utterances : " << num << endl
     << "\t\t  Total # of frames : " << total_num_frames << endl
     << "\t\t  Total decoding time : " << total_time << endl;
+  // The decoding threads compose private copies of the cascade
+  if (cascade && num_threads <= 1)
+    cascade->DumpStats(logger);
+  if (!search_profile_file.empty()) {
+    if (decoder)
+      stats.Push(decoder->GetStatistics());
+    if (!stats.Write(search_profile_file))
+      logger(FATAL) << "Failed to write search profile : "
+        << search_profile_file;
+    const RunnningStatistic& arcs = stats.GetStatistic(kNumActiveArcs);
+    logger(INFO) << "Wrote search profile to " << search_profile_file
+      << endl << "\t\t  Active arcs per frame : mean " << arcs.Ave()
+      << " sd " << sqrt(arcs.Variance()) << " min " << arcs.Min()
+      << " max " << arcs.Max();
+  }
 
   PROFILE_BEGIN(ModelCleanup);
   if (farwriter)
     delete farwriter;
   if (decoder)
     delete decoder;
+  if (graph)
+    delete graph;
+  if (compiled)
+    delete compiled;
   if (cascade)
     delete cascade;
   if (trans_model)
     delete trans_model;
   if (wordsyms)
     delete wordsyms;
+  if (rescoring_lm)
+    delete rescoring_lm;
+  if (trace)
+    delete trace;
   PROFILE_END();
   return 0;
 }
@@ -280,7 +619,13 @@ struct DecodeMainEntry : public DecodeMainEntryBase {
 
   virtual int Run(ParseOptions &po, SearchOptions *opts, 
                   const string &word_symbols_file) {
-    return CLevelDecoderMain<T, L, B>(po, opts, word_symbols_file);
+    // Collecting the statistics slows the search, so only the profiling
+    // decoders are built with them
+    if (!search_profile_file.empty())
+      return CLevelDecoderMain<T, L, B, SimpleStatistics>(po, opts,
+                                                          word_symbols_file);
+    return CLevelDecoderMain<T, L, B, NullStatistics>(po, opts,
+                                                      word_symbols_file);
   }
 };
 
@@ -340,6 +685,12 @@ REGISTER_DECODER_MAIN("hmm_simple", HMMTransitionModel,
 REGISTER_DECODER_MAIN("generic_lattice", GenericTransitionModel,
     Decodable, StdArc, Lattice);
 
+#ifndef HAVE_KALDI
+// Decodes from a StreamingDecodable, see --streaming_chunk
+REGISTER_DECODER_MAIN("hmm_streaming", HMMTransitionModel,
+    StreamingDecodable, StdArc, Lattice);
+#endif
+
 //REGISTER_DECODER_MAIN("hmm_hitstats", HMMTransitionModel, 
 //  SimpleDecodableHitStats, StdArc);
 
@@ -360,10 +711,13 @@ REGISTER_DECODER_MAIN("gmm_lattice", HMMTransitionModel,
 
 int main(int argc, char *argv[]) {
   PROFILE_FUNC();
-  g_dcd_global_allocated = g_dcd_current_num_allocated;
+  g_dcd_global_allocated = g_dcd_current_num_allocated.load();
   const char *usage = "Decode some speech\n"
         "Usage: dcd-recog [options] trans-model-in (fst-in|fsts-rspecifier) "
-        "features-rspecifier far-wspecifier";
+        "features-rspecifier far-wspecifier\n"
+        "A cascade is given as fst-in as comma separated components, each "
+        "optionally\nwith the filter of its composition stage, "
+        "path[:auto|lookahead|sequence|alt_sequence|match]";
   
   PrintVersionInfo();
   cerr << endl;
@@ -374,7 +728,31 @@ int main(int argc, char *argv[]) {
   SearchOptions opts;
   po.Register("decoder_type", &tm_type, "Type of decoder to use");
   po.Register("word_symbols_table", &word_symbols_file, "");
+  po.Register("rescore_lm", &rescore_lm_file, "Big LM Fst the words are "
+              "rescored with on the fly");
+  po.Register("rescore_small_lm", &rescore_small_lm_file, "Small LM Fst "
+              "of the search graph, without it rescore_lm holds the "
+              "differences");
   po.Register("logfile", &logfile, "/dev/stderr");
+  po.Register("num_threads", &num_threads, "Number of utterances to decode "
+              "in parallel, all the threads share one copy of the models");
+  po.Register("search_trace", &search_trace_file, "Write the search "
+              "counters and phase times of every frame to this file, needs "
+              "a build with HAVE_SEARCH_TRACE");
+  po.Register("search_trace_format", &search_trace_format, "Format of the "
+              "search trace, csv, jsonl or chrome");
+  po.Register("search_profile", &search_profile_file, "Write the expansion "
+              "counts of the Fst states and input labels and the per-frame "
+              "search statistics of all the utterances to this file. The "
+              "state ids are only stable for an expanded Fst or a compiled "
+              "graph");
+  po.Register("streaming_chunk", &streaming_chunk, "Feed the features of "
+              "each utterance to the decoder this many frames at a time, as "
+              "from a live input. Needs the hmm_streaming decoder type");
+  po.Register("lookahead_groups", &lookahead_groups_file, "Text file with "
+              "the acoustic lookahead group of each pdf in pdf order, for "
+              "example its context independent phone. Without it every pdf "
+              "is its own group");
   /*po.Register("wfst");
   po.Register("trans_model");
   po.Register("input");
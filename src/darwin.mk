@@ -12,3 +12,6 @@ CXXFLAGS+=-I../include/ \
 					-Wno-deprecated-writable-strings -DOS_MACOSX -O2 -std=c++11 -g
 CXXFLAGS+=-DMEMDEBUG 
 
+
+#Uncomment to collect the per-frame search trace written with --search_trace
+#CXXFLAGS+=-DHAVE_SEARCH_TRACE
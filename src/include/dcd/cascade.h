@@ -16,6 +16,18 @@
 // \file
 // Helper class to construct the recongnition cascade
 // from individual transducers
+//
+// The fst argument is a comma separated list of components, each optionally
+// followed by the composition filter of its stage, path[:filter]. The
+// components are composed on demand from the right, c0 o (c1 o (c2 o ...)),
+// so the left operand of every stage is a component read from disk and can
+// be a lookahead Fst. The filters are
+//   auto          lookahead filters when the left component supports them,
+//                 otherwise the sequence filter
+//   lookahead     as auto but an error if the left component is not a
+//                 lookahead Fst
+//   sequence, alt_sequence, match
+//                 the OpenFst filters of the same name
 
 #ifndef DCD_CASCADE_H__
 #define DCD_CASCADE_H__
@@ -24,12 +36,85 @@
 #include <vector>
 
 #include <fst/compose.h>
+#include <fst/lookahead-filter.h>
 
 namespace dcd {
+
+enum ComposeFilterType {
+  COMPOSE_AUTO,
+  COMPOSE_LOOKAHEAD,
+  COMPOSE_SEQUENCE,
+  COMPOSE_ALT_SEQUENCE,
+  COMPOSE_MATCH
+};
+
+// Returns false if the name is not a known filter
+inline bool GetComposeFilterType(const string& name, ComposeFilterType* type) {
+  if (name == "auto")
+    *type = COMPOSE_AUTO;
+  else if (name == "lookahead")
+    *type = COMPOSE_LOOKAHEAD;
+  else if (name == "sequence")
+    *type = COMPOSE_SEQUENCE;
+  else if (name == "alt_sequence")
+    *type = COMPOSE_ALT_SEQUENCE;
+  else if (name == "match")
+    *type = COMPOSE_MATCH;
+  else
+    return false;
+  return true;
+}
+
+inline const char* ComposeFilterName(ComposeFilterType type) {
+  switch (type) {
+    case COMPOSE_LOOKAHEAD:
+      return "lookahead";
+    case COMPOSE_SEQUENCE:
+      return "sequence";
+    case COMPOSE_ALT_SEQUENCE:
+      return "alt_sequence";
+    case COMPOSE_MATCH:
+      return "match";
+    default:
+      return "auto";
+  }
+}
+
+// One stage of the cascade. The Fst copies made by the composition of the
+// next stage share the implementation, so the states counted here include
+// the ones the later stages and the decoder discovered through the copies.
+// Copies made with safe = true, as by the decoding threads, have their own
+// cache and are not counted.
+template<class Arc>
+class ComposeStage : public ComposeFst<Arc> {
+ public:
+  ComposeStage(const Fst<Arc>& fst1, const Fst<Arc>& fst2,
+               const CacheOptions& opts)
+      : ComposeFst<Arc>(fst1, fst2, opts) { }
+
+  template<class M, class F>
+  ComposeStage(const Fst<Arc>& fst1, const Fst<Arc>& fst2,
+               const ComposeFstOptions<Arc, M, F>& opts)
+      : ComposeFst<Arc>(fst1, fst2, opts) { }
+
+  // States of the composition discovered so far
+  int NumKnownStates() const {
+    return ImplToFst<Impl>::GetImpl()->NumKnownStates();
+  }
+
+ private:
+  // ComposeFst hides GetImpl, use the protected one of its base
+  typedef typename ComposeFst<Arc>::Impl Impl;
+};
+
 template<class Arc>
 class Cascade {
  public:
   typedef Fst<Arc> FST;
+  typedef Matcher<FST> M;
+
+  Cascade() : cascade_(0) { }
+
   ~Cascade() {
     DestroyFsts(&tmp_fsts_);
     DestroyFsts(&fsts_);
@@ -43,15 +128,30 @@ class Cascade {
     SplitToVector(str, ",", &paths, true);
     Cascade* cascade  = new Cascade;
     for (int i = 0; i != paths.size(); ++i) {
-      logger(INFO) << "Reading fst from : " << paths[i];
-      Fst<Arc>* fst = Fst<Arc>::Read(paths[i]);
+      string name = paths[i];
+      ComposeFilterType filter = COMPOSE_AUTO;
+      // A suffix after the last ':' that is not part of a directory is the
+      // filter of the stage
+      size_t colon = name.rfind(':');
+      if (colon != string::npos &&
+          name.find('/', colon) == string::npos) {
+        if (!GetComposeFilterType(name.substr(colon + 1), &filter))
+          LOG(FATAL) << "Unknown composition filter : " << paths[i];
+        name.erase(colon);
+      }
+      if (i + 1 == paths.size() && filter != COMPOSE_AUTO)
+        LOG(WARNING) << "Ignoring the composition filter of the last "
+                     << "component : " << paths[i];
+      logger(INFO) << "Reading fst from : " << name;
+      Fst<Arc>* fst = Fst<Arc>::Read(name);
       if (!fst)
-        LOG(FATAL) << "Failed to read fst from : " << paths[i];
+        LOG(FATAL) << "Failed to read fst from : " << name;
       logger(INFO) << "Fst type = " << fst->Type() <<
         ", # of states = " << CountStates(*fst);
       cascade->fsts_.push_back(fst);
+      cascade->filters_.push_back(filter);
     }
-    delete str;
+    delete[] str;
     return cascade;
   }
 
@@ -69,22 +169,22 @@ class Cascade {
       return 0;
     Cascade* cascade  = new Cascade;
     cascade->fsts_ = fsts;
+    cascade->filters_.resize(fsts.size(), COMPOSE_AUTO);
     return cascade;
   }
 
-  FST* Rebuild() {
-    if (fsts_.size() == 1) {
-      return fsts_[0];
-    } else if (fsts_.size() == 2) {
-      if (tmp_fsts_.size())
-        DestroyFsts(&tmp_fsts_);
-      CacheOptions opts;
-      opts.gc = false;
-      Fst<Arc> *fst = new ComposeFst<Arc>(*fsts_[0], *fsts_[1], opts);
-      tmp_fsts_.push_back(fst);
-      return fst;
-    }
-    return 0;
+  // Composes the cascade on demand. With a cache_limit in bytes each stage
+  // garbage collects the arcs of the states it has not used recently once
+  // its cache is over the limit, 0 keeps every state. Returns null if a
+  // stage can't be built.
+  FST* Rebuild(size_t cache_limit = 0) {
+    if (tmp_fsts_.size())
+      DestroyFsts(&tmp_fsts_);
+    CacheOptions opts;
+    opts.gc = cache_limit > 0;
+    opts.gc_limit = cache_limit;
+    cascade_ = BuildCascade(fsts_, opts, &tmp_fsts_);
+    return cascade_;
   }
 
   void DestroyFsts(vector<Fst<Arc>*>* fsts) {
@@ -101,9 +201,12 @@ class Cascade {
     cascade_ = 0;
     LOG(INFO) << "Finished Destroy Fsts";
   }
+
   // Build the recognition cascade storing the individual compose fsts in the
-  // cacade vector - we will need these when we delete the cascade later on
+  // cacade vector - we will need these when we delete the cascade later on.
+  // The stage of component i composes it with the stages to its right.
   Fst<Arc>* BuildCascade(const vector<Fst<Arc>*>& fsts,
+                         const CacheOptions& opts,
                          vector<Fst<Arc>*>* cascade) {
     if (fsts.size() == 0)
       return 0;
@@ -111,14 +214,14 @@ class Cascade {
       return fsts.back();
     Fst<Arc>* last = fsts.back();
     for (int i = fsts.size() - 2; i >= 0; --i) {
-      Fst<Arc>* composed = new ComposeFst<Arc>(*fsts[i], *last);
+      Fst<Arc>* composed = Compose(*fsts[i], *last, filters_[i], opts);
       if (!composed) {
-        LOG(ERROR) << "Failed to construct composition Fst";
-      } else {
-        cascade->push_back(composed);
-        last = composed;
+        LOG(ERROR) << "Failed to construct composition Fst of stage " << i;
+        return 0;
       }
-     }
+      cascade->push_back(composed);
+      last = composed;
+    }
     return last;
   }
 
@@ -133,12 +236,52 @@ class Cascade {
       LOG(INFO) << tmp_fsts_[i]->Type();
   }
 
+  // States discovered by each stage since the last rebuild, stage 0 is the
+  // outermost composition the decoder searches
+  void DumpStats(Logger& logger = dcd::logger) const {
+    int num_stages = tmp_fsts_.size();
+    for (int i = 0; i != num_stages; ++i) {
+      // The stages are built from the right, the last one built is stage 0
+      const ComposeStage<Arc>* stage =
+        static_cast<const ComposeStage<Arc>*>(tmp_fsts_[num_stages - 1 - i]);
+      logger(INFO) << "Composition stage " << i << " ("
+                   << ComposeFilterName(filters_[i]) << " filter) : "
+                   << stage->NumKnownStates() << " states";
+    }
+  }
+
   int NumFsts() const { return fsts_.size(); }
 
  private:
+  Fst<Arc>* Compose(const Fst<Arc>& fst1, const Fst<Arc>& fst2,
+                    ComposeFilterType filter, const CacheOptions& opts) {
+    switch (filter) {
+      case COMPOSE_LOOKAHEAD:
+        if (LookAheadMatchType(fst1, fst2) == MATCH_NONE) {
+          LOG(ERROR) << "Lookahead filter needs a lookahead Fst, not an Fst"
+                     << " of type " << fst1.Type();
+          return 0;
+        }
+        // ComposeFst selects the lookahead matchers and filters itself
+        return new ComposeStage<Arc>(fst1, fst2, opts);
+      case COMPOSE_SEQUENCE:
+        return new ComposeStage<Arc>(fst1, fst2,
+            ComposeFstOptions<Arc, M, SequenceComposeFilter<M> >(opts));
+      case COMPOSE_ALT_SEQUENCE:
+        return new ComposeStage<Arc>(fst1, fst2,
+            ComposeFstOptions<Arc, M, AltSequenceComposeFilter<M> >(opts));
+      case COMPOSE_MATCH:
+        return new ComposeStage<Arc>(fst1, fst2,
+            ComposeFstOptions<Arc, M, MatchComposeFilter<M> >(opts));
+      default:
+        return new ComposeStage<Arc>(fst1, fst2, opts);
+    }
+  }
+
   vector<FST*> fsts_;  // Component Fsts fread from disk
+  vector<ComposeFilterType> filters_;  // Filter of the stage of each Fst
   vector<FST*> tmp_fsts_;  // Intemediate Fsts there are constructed as part of
-                           // the cascade
+                           // the cascade, the stages from the right
   FST* cascade_;
 };
 }  // namespace dcd
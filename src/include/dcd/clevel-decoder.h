@@ -27,12 +27,16 @@
 #include <algorithm>
 #include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <limits>
+#include <map>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <fst/expanded-fst.h>
 #include <fst/fst.h>
 #include <fst/mutable-fst.h>
 #include <fst/project.h>
@@ -42,11 +46,20 @@
 
 #include <dcd/config.h>
 #include <dcd/constants.h>
+#include <dcd/cost-histogram.h>
+#include <dcd/expand-batch.h>
 #include <dcd/lattice.h>
 #include <dcd/log.h>
+#include <dcd/partial-result.h>
+#include <dcd/search-graph-cache.h>
+#include <dcd/search-state-arena.h>
+#include <dcd/search-state-table.h>
 #include <dcd/search-statistics.h>
+#include <dcd/search-trace.h>
 #include <dcd/stl.h>
+#include <dcd/thread-pool.h>
 #include <dcd/token.h>
+#include <dcd/token-pool.h>
 #include <dcd/utils.h>
 #include <dcd/search-opts.h>
 
@@ -65,6 +78,18 @@ using fst::kNoStateId;
 using fst::PROJECT_OUTPUT;
 using fst::AutoQueue;
 
+// The tokens are copied by value throughout the arc expansion, with the
+// index based Lattice a token is its 32-bit state index and the cost
+static_assert(sizeof(Lattice::LatticeState) == sizeof(int32),
+              "Lattice states must be 32-bit indices");
+static_assert(sizeof(TokenTpl<Lattice>) == 8,
+              "Tokens of the index based lattice must be 8 bytes");
+
+// Orders of the active arcs during the expansion, selected with --arc_order
+const int kActivationArcOrder = 0;  // Order the arcs were activated in
+const int kILabelArcOrder = 1;  // Arcs sharing an HMM are expanded together
+const int kAddressArcOrder = 2;  // Arcs in the order of the search states
+
 //  Forward declations for the various decoder classes
 //  these classes need to know the names of the other types
 template<class FST, class TransModel,
@@ -73,28 +98,18 @@ template<class FST, class TransModel,
          class Statistics>
 class CLevelDecoder;
 
-// Function to convert a weight to scale value sot the decoder is able
-// to operate on any weight semiring, optional time paramter allow certain
-// weigths and arcs to be controlled at specific times.
-template<class Weight>
-inline float Value(const Weight& w, int time = -1) {
-  return w.Value();
-}
-
-inline float Value(const KaldiLatticeWeight& w, int time = -1) {
-  return w.Value1() + w.Value2();
-}
 
-
-template<class T, class L>
+// C is the per-utterance decodable cursor of the transition model
+template<class T, class L, class C>
 struct ArcExpandOptions {
   ArcExpandOptions(float best, float threshold, float lbest,
                    float lthreshold, T* tokens, T* scratch,
-                   const SearchOptions& opts, L* lattice)
+                   const SearchOptions& opts, L* lattice, C* cursor)
       : best_(best), threshold_(threshold), lbest_(lbest),
         lthreshold_(lthreshold), tokens_(tokens), scratch_(scratch),
-        opts_(opts), lattice_(lattice) { }
+        opts_(opts), lattice_(lattice), cursor_(cursor) { }
   typedef T Token;
+  typedef C Cursor;
   float best_;
   float threshold_;
   float lbest_;
@@ -103,6 +118,7 @@ struct ArcExpandOptions {
   Token* scratch_;  // temporary buffer
   const SearchOptions& opts_;
   L* lattice_;
+  Cursor* cursor_;
 };
 
 
@@ -118,47 +134,75 @@ class CLevelDecoder {
   class SearchState;
   typedef T<L> Token;
   typedef typename L::LatticeState LatticeState;
+  typedef typename TransModel::FrontEnd FrontEnd;
+  typedef typename TransModel::Cursor Cursor;
+  typedef ArcExpandOptions<Token, L, Cursor> ExpandOptions;
+  typedef Statistics SearchStatistics;
+  typedef TokenPool<Token> TokenPoolType;
   //typedef TokenTpl<LatticeState> Token;
   typedef Pair<float, float> FloatPair;
 
-  typedef typename HashMapHelper<int, SearchState*>::HashMap SearchHash;
+  typedef SearchStateTable<SearchState*> SearchHash;
+  typedef SearchGraphCache<FST, TransModel> SearchGraph;
+  typedef SearchStateArena<SearchState, SearchArc> SearchArena;
   typedef typename VectorHelper<SearchState*>::Vector ActiveStateVector;
   typedef typename VectorHelper<SearchArc*>::Vector ActiveArcVector;
   typedef typename VectorHelper<SearchArc>::Vector ArcVector;
   typedef deque<SearchState*> EpsQueue;
 
+  // Fast match pruning of the arcs entered from the active states. An arc
+  // is only activated if its entry cost plus the lookahead of its HMM is
+  // within beam of the best seen so far in the frame
+  struct EntryLookahead {
+    EntryLookahead(const TransModel* trans_model, const Cursor* cursor,
+                   float beam)
+        : trans_model(trans_model), cursor(cursor), beam(beam),
+          threshold(kMaxCost), num_pruned(0) { }
+
+    const TransModel* trans_model;
+    const Cursor* cursor;
+    float beam;
+    float threshold;
+    int num_pruned;
+  };
+
   class SearchArc {
    public:
-    SearchArc(int ilabel, int olabel, float weight, int nextstate,
-              float exit_weight, int num_states)
-        : dest_(0), ilabel_(ilabel), olabel_(olabel), weight_(weight),
-          nextstate_(nextstate), exit_weight_(exit_weight),
-          num_states_(num_states), num_expansions_(0), time_(-1) {
-          // tokens_.resize(num_states + 1);
-          // ClearTokens();
-      }
+    explicit SearchArc(const SearchArcInfo* info)
+        : tokens_(0), dest_(0), info_(info), num_expansions_(0),
+          time_(-1) { }
 
     //  If cost to set the first token is less
-    //  returns the costs associated with the first token in the arc
+    //  returns the costs associated with the first token in the arc.
+    //  Activating the arc attaches NumStates() + 1 tokens from the pool
     float SetEntryToken(const Token& token, float threshold, int time,
-                        ActiveArcVector* active_arcs,
+                        ActiveArcVector* active_arcs, TokenPoolType* pool,
                         const SearchOptions& opts) {
-      if (token.Cost() + weight_ < threshold) {
+      if (token.Cost() + info_->weight < threshold) {
         // The first token may not be a place holder
         // so we should call the weighted combine
-        if (active_arcs && time_ == -1) {
-          ClearTokens();
+        if (time_ == -1) {
+          tokens_ = pool->Alloc(info_->num_states + 1);
           num_expansions_ = 0;
           time_ = time;
           active_arcs->push_back(this);
         }
-        float cost = tokens_[0].Combine(token, weight_);
+        float cost = tokens_[0].Combine(token, info_->weight);
         return cost;
       }
       //  Should be kMaxCost if nothing was activated
       return kMaxCost;
     }
 
+    //  Epsilon arcs have no emitting states and are never in the active
+    //  arc list, so compute the exit token directly without attaching any
+    //  token storage to the arc
+    Token GetEpsilonExitToken(const Token& token, float threshold) const {
+      if (token.Cost() + info_->weight < threshold)
+        return token.Expand(info_->weight).Expand(info_->exit_weight);
+      return Token();
+    }
+
     // Active arcs have a position in the list
     bool Active() const {
       return time_ != -1;
@@ -166,12 +210,12 @@ class CLevelDecoder {
 
     //  Cost to leave the arc
     float GetExitCost() const {
-      return tokens_[num_states_].Cost() + exit_weight_;
+      return tokens_[info_->num_states].Cost() + info_->exit_weight;
     }
 
     //  Last token to leave the arc
     Token GetExitToken() const {
-      return tokens_[num_states_].Expand(exit_weight_);
+      return tokens_[info_->num_states].Expand(info_->exit_weight);
     }
 
     const Token& GetToken(int i) const {
@@ -184,23 +228,41 @@ class CLevelDecoder {
       //Shouldn't need to check if the token is active
       //because a non active token should return kMaxCost
       float best = tokens_[0].Cost();
-      for (int i = 1; i <= num_states_; ++i)
+      for (int i = 1; i <= info_->num_states; ++i)
         best = min(best, tokens_[i].Cost());
       return best;
     }
 
     // Advance the tokens in the arc by one frame
     // and return the best token cost;
-    inline pair<float, float> Expand(TransModel* transmodel,
-                                     ArcExpandOptions<Token, L>* opts) {
+    inline pair<float, float> Expand(const TransModel* transmodel,
+                                     ExpandOptions* opts) {
       PROFILE_FUNC();
       ++num_expansions_;
-      opts->tokens_ = &tokens_[0];
-      return transmodel->Expand(ilabel_, opts);
+      opts->tokens_ = tokens_;
+      return transmodel->Expand(info_->ilabel, opts);
+    }
+
+    // Start loading the first and last tokens and the transition model data
+    // the next Expand of the arc reads
+    inline void Prefetch(const TransModel* transmodel) const {
+      DCD_PREFETCH(tokens_);
+      DCD_PREFETCH(tokens_ + info_->num_states);
+      transmodel->Prefetch(info_->ilabel);
+    }
+
+    // Queue the arc for a batched expansion, see ExpandBatch in the
+    // transition models
+    inline void AddToBatch(ArcBatch<Token>* batch) {
+      ++num_expansions_;
+      batch->Add(info_->ilabel, tokens_);
     }
 
-    float AcousticLookahead(TransModel* transmodel, int time) {
-      return transmodel->AcousticLookahead(ilabel_, time);
+    // Cost of entering the arc with token plus the fast match lookahead
+    float EntryLookaheadCost(const Token& token,
+                             const EntryLookahead& lookahead) const {
+      return token.Cost() + info_->weight +
+        lookahead.trans_model->Lookahead(*lookahead.cursor, info_->ilabel);
     }
 
     float ExpandEpsilons(const TransModel& transmodel) {
@@ -212,7 +274,7 @@ class CLevelDecoder {
     // insertion penalty or duration penally, or get better due
     // on-the-fly rescoring
     float ExpandToFollowingState(CLevelDecoder* decoder) {
-      if (!tokens_[num_states_].Active())
+      if (!tokens_[info_->num_states].Active())
         return kMaxCost;
       SearchState* ss = FindNextState(*decoder);
       return kMaxCost;
@@ -220,11 +282,13 @@ class CLevelDecoder {
 
     // Get the last token associated with the Arc
     const Token& GetLastToken() const {
-      return tokens_[num_states_];
+      return tokens_[info_->num_states];
     }
 
     bool HasActiveTokens() const {
-      for (int i = 0; i <= num_states_; ++i)
+      if (!tokens_)
+        return false;
+      for (int i = 0; i <= info_->num_states; ++i)
         if (tokens_[i].Active())
           return true;
       return false;
@@ -234,7 +298,9 @@ class CLevelDecoder {
     // threshold would usually be best_cost + beam
     bool Prune(float threshold) {
       bool active = false;
-      for (int i = 0; i <= num_states_; ++i)
+      if (!tokens_)
+        return active;
+      for (int i = 0; i <= info_->num_states; ++i)
         if (tokens_[i].Cost() + threshold)
           tokens_[i].Clear();
         else
@@ -246,73 +312,68 @@ class CLevelDecoder {
     //for the decoders type
     SearchState* FindNextState(CLevelDecoder* decoder) {
       if (!dest_)
-        dest_ = decoder->FindSearchState(nextstate_);
+        dest_ = decoder->FindSearchState(info_->nextstate);
       return dest_;
     }
 
-    //Clear all the arc information. Used the when
+    //Clear the dynamic arc information. Used the when
     //the arc is permanently deactivated or
     void Clear() {
-      for (int i = 0; i < kMaxTokensPerArc; ++i)
-        tokens_[i].Clear();
+      tokens_ = 0;
       dest_ = 0;
-      num_states_ = 0;
-      nextstate_ = kNoStateId;
-      weight_ = kMaxCost;
       time_ = -1;
       num_expansions_ = 0;
     }
 
     void ClearTokens() {
-      for (int i = 0; i < kMaxTokensPerArc; ++i)
+      if (!tokens_)
+        return;
+      for (int i = 0; i <= info_->num_states; ++i)
         tokens_[i].Clear();
     }
 
-    int Deactivate(ActiveArcVector* active_arcs, int time) {
+    //  Return the tokens to the pool
+    int Deactivate(TokenPoolType* pool) {
       PROFILE_FUNC();
       time_ = -1;
-      ClearTokens();
+      pool->Free(tokens_, info_->num_states + 1);
+      tokens_ = 0;
       return num_expansions_;
     }
 
-    void GcMark() {
-      for (int i = 0; i <= num_states_; ++i)
+    void GcMark(L* lattice) {
+      for (int i = 0; i <= info_->num_states; ++i)
         if (tokens_[i].Active())
-          tokens_[i].GcMark();
+          tokens_[i].GcMark(lattice);
     }
 
     //Accessors for the arc fields, useful to have a
     //function for collecting access stats
-    inline int ILabel() const { return ilabel_; }
+    inline int ILabel() const { return info_->ilabel; }
 
-    inline int OLabel() const { return olabel_; }
+    inline int OLabel() const { return info_->olabel; }
 
-    inline float Weight() const { return weight_; }
+    inline float Weight() const { return info_->weight; }
 
-    inline int NextState() const { return nextstate_; }
+    inline int NextState() const { return info_->nextstate; }
 
-    inline int NumStates() const { return num_states_; }
+    inline int NumStates() const { return info_->num_states; }
 
-    inline const Token* Tokens() const { return &tokens_[0]; }
+    inline const Token* Tokens() const { return tokens_; }
 
     string ToString() const {
       stringstream ss;
-      ss << ilabel_ << " " << olabel_ << " " << weight_ << " " << nextstate_;
+      ss << info_->ilabel << " " << info_->olabel << " " << info_->weight
+        << " " << info_->nextstate;
       return ss.str();
     }
 
    protected:
-    //  Extra token for entry token e.g. Token tokens_[kTokensPerArc + 1];
-    //  TODO allow for various token containers such as vectors
-    Token tokens_[kMaxTokensPerArc];
+    //  NumStates() + 1 tokens, the extra one is the entry token. Only set
+    //  while the arc is active
+    Token* tokens_;
     SearchState* dest_;  // Store a pointer to the next state
-    int ilabel_;  // input label of the search transducer
-    int olabel_;  // output label of the search transducer
-    float weight_;  // The weight from the Fst, potentially scaled
-    int nextstate_;  // next state of the search transducer
-    float exit_weight_;  // Weight for the final transition in the
-                         // HMM and/or insertion  penalty
-    int num_states_;  // number of states in the underlying transition model
+    const SearchArcInfo* info_;  // Labels and weights, shared read-only
     int num_expansions_;
     int time_;  // time the arc was activated/deactivated
   };
@@ -336,76 +397,64 @@ class CLevelDecoder {
     }
   };
 
+  // The arcs of a search state are contiguous in the arena
+  struct SearchArcAddressCompare {
+    bool operator ()(const SearchArc* a, const SearchArc* b) {
+      return std::less<const SearchArc*>()(a, b);
+    }
+  };
+
   class SearchState {
    public:
     SearchState()
-        : last_activated_(-1), ref_count_(0), index_(-1),
-          state_id_(-1), num_activations_(0), in_eps_queue_(false) { }
-    //  Initializea new search state wtht FST type F, Transmodel T
-    template<class F, class TM>
-    bool Init(const F& fst, int state, const TM& trans_model,
-              const SearchOptions& opts) {
+        : arcs_(0), eps_arcs_(0), num_arcs_(0), num_eps_arcs_(0),
+          last_activated_(-1), ref_count_(0), index_(-1),
+          state_id_(-1), num_activations_(0), num_closed_eps_arcs_(0),
+          in_eps_queue_(false) { }
+
+    //  Initialize a new search state for the Fst state from its compiled
+    //  record. The arcs are constructed in arcs, which must have room for
+    //  the emitting arcs followed by the epsilon arcs of the record
+    void Init(int state, const SearchStateInfo* info, SearchArc* arcs) {
       PROFILE_FUNC();
-      typedef typename F::Arc Arc;
       state_id_ = state;
-      eps_arcs_.clear();
-      arcs_.clear();
+      arcs_ = arcs;
+      eps_arcs_ = arcs + info->num_arcs;
+      num_arcs_ = info->num_arcs;
+      num_eps_arcs_ = info->num_eps_arcs;
+      num_closed_eps_arcs_ = info->num_closed_eps_arcs;
+      final_cost_ = info->final_cost;
       token_.Clear();
       last_activated_ = -1;
       num_activations_ = 0;
       ref_count_ = -1;
       index_ = -1;
-      PROFILE_BEGIN(UnderlyingFstStateExpansion);
-      //  Might not be correct due to disam symbols
-      int num_eps_arcs = fst.NumInputEpsilons(state);
-      int num_arcs = fst.NumArcs(state) - num_eps_arcs;
-      final_cost_ = Value(fst.Final(state));
-      PROFILE_END();
-      eps_arcs_.reserve(num_eps_arcs);
-      arcs_.reserve(num_arcs);
-      for (ArcIterator<F> aiter(fst, state); !aiter.Done(); aiter.Next()) {
-        const Arc& arc = aiter.Value();
-        //  There are three cases
-        //  label > 0 standard transition arc
-        //  label = 0 epsilon arc
-        //  label < 0 disambiguation symbol to be treats
-        //  the same as an epsilon transition
-
-        //  verify the transition label is valid, can crash
-        //  if aux symbols are left in the CLG, or logical to
-        //  physical mapping is forgotten
-        if (!trans_model.IsValidILabel(arc.ilabel))
-          return false;
-
-        bool iseps = trans_model.IsNonEmitting(arc.ilabel);
-        //  TODO what about emitting negative costs loops
-        if (iseps && state == arc.nextstate && Value(arc.weight) < 0) {
-          logger(FATAL) << "Negative epsilon cycle detected!";
-          return false;
-        }
-        //  TODO is there any reason to allow epsilon transition to have
-        //  more than one token state?
-        int num_states = iseps ? 0 : trans_model.NumStates(arc.ilabel);
-        ArcVector& arcs = iseps ? eps_arcs_ : arcs_;
-        //  Idea: If we always have to add the cost of the last transition
-        //  of the HMM then add it to the arc weight and prune with it before
-        //  we enter the state. Answer: Doesn't seem to work well
-        float exit_weight = trans_model.GetExitWeight(arc.ilabel);
-        arcs.push_back(SearchArc(arc.ilabel, arc.olabel,
-                                 Value(arc.weight) + opts.insertion_penalty,
-                                 arc.nextstate, exit_weight, num_states));
-      }
-      return true;
+      const SearchArcInfo* infos = info->Arcs();
+      for (int i = 0; i != info->NumArcSlots(); ++i)
+        new (&arcs[i]) SearchArc(&infos[i]);
     }
 
     //  Expand state in active arcs if the state cost plus the arc
-    //  cost is less than the pruning threshold
-    float ExpandIntoArcs(ActiveArcVector* active_arcs, float threshold,
-                         int time, const SearchOptions& opts) {
+    //  cost is less than the pruning threshold, and with a lookahead if the
+    //  cost plus the lookahead is within the lookahead beam
+    float ExpandIntoArcs(ActiveArcVector* active_arcs, TokenPoolType* pool,
+                         float threshold, int time,
+                         const SearchOptions& opts,
+                         EntryLookahead* lookahead = 0) {
       float best = kMaxCost;
-      for (int i = 0; i != arcs_.size(); ++i)
+      for (int i = 0; i != num_arcs_; ++i) {
+        if (lookahead) {
+          float cost = arcs_[i].EntryLookaheadCost(token_, *lookahead);
+          if (cost > lookahead->threshold) {
+            ++lookahead->num_pruned;
+            continue;
+          }
+          lookahead->threshold = min(lookahead->threshold,
+                                     cost + lookahead->beam);
+        }
         best = min(best, arcs_[i].SetEntryToken(token_, threshold, time,
-                                                active_arcs, opts));
+                                                active_arcs, pool, opts));
+      }
       return best;
     }
 
@@ -421,28 +470,25 @@ class CLevelDecoder {
                             const SearchOptions& opts) {
       float best = kMaxCost;
       int num_activated = 0;
-      for (int i = 0; i != eps_arcs_.size(); ++i) {
+      for (int i = 0; i != num_eps_arcs_; ++i) {
         SearchArc* sa = &eps_arcs_[i];
-        //  Pass null pointer as epsilons are never in the active arcs lists
-        sa->SetEntryToken(token_, threshold, -1, 0, opts);
-        Token token = sa->GetExitToken();
+        Token token = sa->GetEpsilonExitToken(token_, threshold);
         //  TODO maybe not prune until adding a rescoring cost in the state 
         //  expansion
         if (token.Cost() < threshold) {
           pair<SearchState*, float> p =
-              decoder->ExpandToFollowingState(sa, threshold);
+              decoder->ExpandToFollowingState(sa, token, threshold);
           SearchState* ss = p.first;
           if (ss) {
             ++num_activated;
-            if (ss->NumEpsilons() && !ss->InEpsQueue()) {
+            if (i >= num_closed_eps_arcs_ && ss->NumEpsilons() &&
+                !ss->InEpsQueue()) {
               ss->AddToEpsQueue();
               q->push_back(ss);
             }
           }
           best = min(best, p.second);
         }
-        sa->ClearTokens();
-        assert(!sa->HasActiveTokens());
       }
       return best;
     }
@@ -451,10 +497,13 @@ class CLevelDecoder {
     bool Active() const { return token_.Active(); }
 
     //  Returns the number of epsilon like transitions associated with the state
-    int NumEpsilons() const { return eps_arcs_.size(); }
+    int NumEpsilons() const { return num_eps_arcs_; }
 
     //  Returns the number of emitting transitions leaving the state
-    int NumEmitting() const { return arcs_.size(); }
+    int NumEmitting() const { return num_arcs_; }
+
+    //  Number of arcs stored after the state in the arena
+    int NumArcSlots() const { return num_arcs_ + num_eps_arcs_; }
 
     //  The State Id from the underlying
     int StateId() const { return state_id_; }
@@ -484,10 +533,10 @@ class CLevelDecoder {
 
     //  TODO template the state on the lattice type?
     //  template<class L>
-    pair<float, float> SetToken(const SearchArc& arc, int time, float threshold,
+    pair<float, float> SetToken(const SearchArc& arc, const Token& token,
+                                int time, float threshold,
                                 ActiveStateVector* active_states, L* lattice,
                                 const SearchOptions& opts) {
-      Token token = arc.GetExitToken();
       pair<float, float> cost(kMaxCost, kMaxCost);
       if (token.Cost() < threshold) {
         cost = token_.Combine(token, arc, lattice, time, threshold, opts);
@@ -503,8 +552,11 @@ class CLevelDecoder {
     //  Resets the search state back to the default uninitialized state. Called 
     //  before returning the search state back to a memory pool
     void Clear() {
-      arcs_.clear();
-      eps_arcs_.clear();
+      arcs_ = 0;
+      eps_arcs_ = 0;
+      num_arcs_ = 0;
+      num_eps_arcs_ = 0;
+      num_closed_eps_arcs_ = 0;
       final_cost_ = kMaxCost;
       in_eps_queue_ = false;
       index_ = - 1;
@@ -553,7 +605,7 @@ class CLevelDecoder {
     }
 
     bool HasActiveArcs() const {
-      for (int i = 0; i != arcs_.size(); ++i)
+      for (int i = 0; i != num_arcs_; ++i)
         if (arcs_[i].HasActiveTokens())
           return true;
       //  Maybe cache if the arc is active when expanding
@@ -564,9 +616,9 @@ class CLevelDecoder {
 
     //  Returns the single best path through the lattice
     template<class Arc>
-      void GetBestSequence(VectorFst<Arc>* best) const {
+      void GetBestSequence(VectorFst<Arc>* best, const L& lattice) const {
         best->DeleteStates();
-        int s = token_.GetBestSequence(best);
+        int s = token_.GetBestSequence(best, lattice);
         best->SetFinal(s, Arc::Weight::One());
       }
 
@@ -605,15 +657,19 @@ class CLevelDecoder {
     void DumpInfo(Logger* logger) const {
       (*logger)(DEBUG)
         << "SearchState : " << state_id_ << endl
-        << "\t# emitting arcs " << arcs_.size() << endl
-        << "\t# epsilon arcs " << eps_arcs_.size() << endl
+        << "\t# emitting arcs " << num_arcs_ << endl
+        << "\t# epsilon arcs " << num_eps_arcs_ << endl
         << "\tIndex " << index_ << " last activated " << last_activated_;
     }
 
     bool InEpsQueue() const { return in_eps_queue_; }
 
-    typename VectorHelper<SearchArc>::Vector arcs_;
-    typename VectorHelper<SearchArc>::Vector eps_arcs_;
+    //  Emitting arcs followed by the epsilon arcs, stored in the arena
+    //  directly after the state
+    SearchArc* arcs_;
+    SearchArc* eps_arcs_;
+    int num_arcs_;
+    int num_eps_arcs_;
     // Best token associated with this state
     Token token_;
     // Time to indicate when the state was last activated
@@ -622,6 +678,8 @@ class CLevelDecoder {
     int index_;  // Where the state is stored in the active state list
     int state_id_;
     int num_activations_;
+    int num_closed_eps_arcs_;  // Leading epsilon closure arcs, these lead to
+                               // states whose closure is already included
     float final_cost_;
     // Epsilon expansion uses a generic SSSP algorithm
     // This flag is used to indicate if the state is already
@@ -633,14 +691,24 @@ class CLevelDecoder {
   };
 
  public:
-  CLevelDecoder(FST* fst, TransModel* trans_model, const SearchOptions& opts,
-                ostream* logstream = &std::cerr, L* lattice = 0)
+  // The transition model is only read during search and can be shared
+  // between several decoders running in different threads, as can a search
+  // graph cache built over an expanded Fst or a compiled graph. Without a
+  // cache the decoder builds its own, it is kept across utterances. The Fst
+  // is only read through the cache and can be null when one is given
+  CLevelDecoder(FST* fst, const TransModel* trans_model,
+                const SearchOptions& opts,
+                ostream* logstream = &std::cerr, L* lattice = 0,
+                SearchGraph* graph = 0)
       : fst_(fst), trans_model_(trans_model), search_opts_(opts),
         lattice_(0), logger_("dcd-recog", *logstream, opts.colorize),
-        time_(-1), debug_(true), num_search_state_allocs_(0),
-        num_search_state_frees_(0) {
+        time_(-1), debug_(true), arc_pool_(0), num_search_state_allocs_(0),
+        num_search_state_frees_(0), source_(opts.source), trace_(0),
+        trace_thread_(0) {
       active_arcs_.reserve(kDefaultActiveListSize);
       active_states_.reserve(kDefaultActiveListSize);
+      if (opts.arc_threads > 1)
+        arc_pool_ = new ThreadPool(opts.arc_threads);
       if (lattice) {
         lattice_ = lattice;
         owns_lattice_ = false;
@@ -648,6 +716,15 @@ class CLevelDecoder {
         lattice_ = new L(opts, logstream);
         owns_lattice_ = true;
       }
+      if (graph) {
+        graph_ = graph;
+        owns_graph_ = false;
+      } else {
+        graph_ = new SearchGraph(*fst, *trans_model, opts);
+        owns_graph_ = true;
+      }
+      // Lazy or composed Fsts don't know their size and use a hashed table
+      search_hash_.Init(graph_->NumGraphStates());
     }
 
   virtual ~CLevelDecoder() {
@@ -655,7 +732,11 @@ class CLevelDecoder {
     if (owns_lattice_)
       delete lattice_;
     ClearSearchHash();
-    ClearSearchPool();
+    search_arena_.Release();
+    if (owns_graph_)
+      delete graph_;
+    if (arc_pool_)
+      delete arc_pool_;
   }
 
   //Pretty terrible!
@@ -683,6 +764,76 @@ class CLevelDecoder {
     }
   }
 
+  // Name of the following utterances in the traceback dumps. The options
+  // are shared by the decoding threads, so each decoder keeps its own
+  void SetSource(const string& source) { source_ = source; }
+
+  // Write the counters of every frame of the following utterances to the
+  // trace, labelled with the utterance and the decoding thread. Only used
+  // when built with HAVE_SEARCH_TRACE
+  void SetTrace(SearchTrace* trace, const string& utterance, int thread) {
+    trace_ = trace;
+    trace_utterance_ = utterance;
+    trace_thread_ = thread;
+  }
+
+#ifdef HAVE_SEARCH_TRACE
+  // Write the frame just decoded to the trace
+  void TraceFrame() {
+    if (!trace_)
+      return;
+    FrameTrace frame = FrameTrace();
+    frame.frame = time_;
+    frame.active_arcs = num_active_arcs_;
+    frame.arcs_pruned = num_arcs_pruned_;
+    frame.arcs_histogram_pruned = total_num_arcs_hisogram_pruned_;
+    frame.active_arcs_after_prune = num_active_arcs_after_prune_;
+    frame.best_arc_cost = best_arc_cost_;
+    frame.worst_arc_cost = worst_arc_cost_;
+    frame.threshold = threshold_;
+    frame.beam = beam_;
+    frame.states_expanded = total_num_states_expanded_;
+    frame.states_pruned = total_num_states_pruned_;
+    frame.active_states = num_active_states_;
+    frame.epsilon_states_activated = num_epsilons_activated_;
+    frame.epsilon_cycles = num_epsilon_cycles_;
+    frame.best_state_cost = best_state_cost_;
+    frame.worst_state_cost = worst_state_cost_;
+    frame.search_state_requests = num_search_state_requests_;
+    frame.search_state_hits = num_search_state_hits_;
+    frame.search_state_misses = num_search_state_misses_;
+    frame.lattice_states = lattice_->NumStates();
+    frame.rss = GetCurrentRSS();
+    frame.expand_states_time = timer_expand_search_states_;
+    frame.gc_time = timer_gc_;
+    frame.expand_arcs_time = timer_expand_search_arcs_;
+    frame.expand_eps_time = timer_expand_eps_arcs_;
+    frame.next_frame_time = timer_next_frame_;
+    FrameTrace totals = frame;
+    frame.SubtractTotals(trace_totals_);
+    trace_totals_ = totals;
+    trace_->Write(trace_utterance_, trace_thread_, frame);
+  }
+#endif
+
+  // The search statistics of every utterance decoded so far
+  const Statistics& GetStatistics() const { return search_stats_; }
+
+  // Add the sizes and costs of the frame just decoded to the statistics,
+  // frames where nothing survived have no costs
+  void PushFrameStatistics() {
+    search_stats_.PushStatistic(kNumActiveArcs, num_active_arcs_);
+    search_stats_.PushStatistic(kNumActiveStates, num_active_states_);
+    search_stats_.PushStatistic(kNumArcsPruned, num_arcs_pruned_);
+    search_stats_.PushStatistic(kNumArcsHistogramPruned,
+                                num_arcs_surviving_ -
+                                num_active_arcs_after_prune_);
+    if (best_arc_cost_ < kMaxCost)
+      search_stats_.PushStatistic(kActiveArcCosts, best_arc_cost_);
+    if (best_state_cost_ < kMaxCost)
+      search_stats_.PushStatistic(kActiveStateCosts, best_state_cost_);
+  }
+
   void ClearSearchStats() {
     num_active_arcs_ = 0;
     num_unique_ilabels_ = 0;
@@ -714,44 +865,85 @@ class CLevelDecoder {
     num_exit_tokens_pruned_ = 0;
   }
 
-  // Write the output to ofst and optionally lattice to fst
+  // Decode the frames from frontend. Write the output to ofst and optionally
+  // lattice to fst
   template<class ARC>
-  float Decode(TransModel* trans_model, const SearchOptions& opts,
+  float Decode(FrontEnd* frontend, const SearchOptions& opts,
                VectorFst<ARC>* ofst, VectorFst<ARC>* lfst = 0) {
     PROFILE_FUNC();
+    InitDecoding(frontend);
+    AdvanceDecoding();
+    return FinalizeDecoding(ofst, lfst);
+  }
+
+  // Group the pdfs for the fast match lookahead, groups[i] is the group of
+  // the zero based decodable index i. By default every pdf is its own group
+  void SetLookaheadGroups(const vector<int>& groups) {
+    cursor_.SetLookaheadGroups(groups);
+  }
+
+  // Streaming interface, Decode is InitDecoding, AdvanceDecoding and
+  // FinalizeDecoding in turn. With a decodable that is still receiving
+  // frames AdvanceDecoding can be called each time new frames arrive and
+  // GetPartialBestPath gives the current best hypothesis in between. With
+  // the early_mission option GetCommittedWords returns the words that are
+  // final
+
+  // Prepare the search for the input from frontend and activate the start
+  // state
+  void InitDecoding(FrontEnd* frontend) {
+    PROFILE_FUNC();
     ClearSearchStats();
     logger_(INFO) << "Pool usage :" << endl
-      << "\t\t  # in search hash " << search_hash_.size()
+      << "\t\t  # in search hash " << search_hash_.Size()
       << " # active arcs " << active_arcs_.size()
       << " # active states " << active_states_.size()
       << " # of lattice states in pool "
       << lattice_->FreeListSize()
       << " # of allocs " << num_search_state_allocs_
       << " # of frees " << num_search_state_frees_
-      << " # search states in pool "
-      << search_state_pool_.size();
+      << " # MB in search arena "
+      << search_arena_.Size() / kMegaByte;
 
-    trans_model_ = trans_model;
+    cursor_.SetInput(frontend, search_opts_);
+    committed_words_.clear();
+
+    beam_ = search_opts_.beam;
 
     timer_.Reset();
-    double timer_begin_decode_ = 0;
-    double timer_expand_search_states_ = 0;
-    double timer_expand_search_arcs_ = 0;
-    double timer_expand_eps_arcs_ = 0;
-    double timer_gc_ = 0;
-    double timer_end_decode_ = 0;
-    double timer_other_ = 0;
-    double timer_next_frame_ = 0;
-    double start_time = timer_.Elapsed();
+    timer_begin_decode_ = 0;
+    timer_expand_search_states_ = 0;
+    timer_expand_search_arcs_ = 0;
+    timer_expand_eps_arcs_ = 0;
+    timer_gc_ = 0;
+    timer_end_decode_ = 0;
+    timer_next_frame_ = 0;
     double time = timer_.Elapsed();
 
     if (!BeginDecode())
       logger_(FATAL) << "BeginDecode failed to activate any search states";
     timer_begin_decode_ = timer_.Elapsed() - time;
     PrintFrameUsage();
-    for (; !trans_model->Done();) {
+#ifdef HAVE_SEARCH_TRACE
+    trace_totals_ = FrameTrace();
+#endif
+  }
+
+  // Decode the frames that have arrived, or at most the first
+  // num_frames_available frames of the input if that is not negative. A frame
+  // is only decoded once the decodable knows it isn't the last one, which
+  // is the frame the batch search stops at. Returns the number of frames
+  // decoded by this call
+  int AdvanceDecoding(int num_frames_available = -1) {
+    PROFILE_FUNC();
+    int num_frames = cursor_.NumFramesReady();
+    if (num_frames_available >= 0)
+      num_frames = min(num_frames, num_frames_available);
+    int num_decoded = 0;
+    while (!cursor_.Done() && cursor_.Index() + 1 < num_frames) {
       ++time_;
-      time = timer_.Elapsed();
+      cursor_.PrepareFrame();
+      double time = timer_.Elapsed();
       ExpandActiveStates();
       timer_expand_search_states_ += timer_.Elapsed() - time;
       if (search_opts_.gc_period > 0 &&
@@ -769,22 +961,68 @@ class CLevelDecoder {
       ExpandEpsilonArcs();
       timer_expand_eps_arcs_ += timer_.Elapsed() - time;
 
+      PushFrameStatistics();
       PrintFrameUsage();
 
       time = timer_.Elapsed();
-      trans_model_->Next();
+      cursor_.Next();
       timer_next_frame_ += timer_.Elapsed() - time;
+#ifdef HAVE_SEARCH_TRACE
+      TraceFrame();
+#endif
+      ++num_decoded;
     }
-    time = timer_.Elapsed();
+    return num_decoded;
+  }
+
+  // Number of frames decoded so far
+  int NumFramesDecoded() const { return time_ + 1; }
+
+  // Write the best partial hypothesis ending in any active state to ofst,
+  // final weights are ignored. Returns false if no state is active
+  template<class ARC>
+  bool GetPartialBestPath(VectorFst<ARC>* ofst) const {
+    PROFILE_FUNC();
+    const SearchState* best_state = 0;
+    for (int i = 0; i != active_states_.size(); ++i) {
+      const SearchState* ss = active_states_[i];
+      if (ss && (!best_state || ss->Cost() < best_state->Cost()))
+        best_state = ss;
+    }
+    if (!best_state)
+      return false;
+    best_state->GetBestSequence(ofst, *lattice_);
+    return true;
+  }
+
+  // Move the words committed by the early mission since the previous call
+  // to words, in order. Returns the number of words
+  int GetCommittedWords(vector<CommittedWord>* words) {
+    words->insert(words->end(), committed_words_.begin(),
+                  committed_words_.end());
+    int num_words = committed_words_.size();
+    committed_words_.clear();
+    return num_words;
+  }
+
+  // Write the best path to ofst and optionally the lattice to lfst, then
+  // release the search for the next utterance. Returns the best cost
+  template<class ARC>
+  float FinalizeDecoding(VectorFst<ARC>* ofst, VectorFst<ARC>* lfst = 0) {
+    PROFILE_FUNC();
+    double time = timer_.Elapsed();
     float best_cost = EndDecode(ofst, lfst, search_opts_.nbest);
     timer_end_decode_ = timer_.Elapsed() - time;
     VLOG(1) << "End decode found best cost " << best_cost;
+    search_stats_.UtteranceDone(NumFramesDecoded());
     // This slows things here if we destroy the decoder after each utterance
     CleanUp();
-    double end_time = timer_.Elapsed() - start_time;
-    timer_other_ = end_time - timer_end_decode_ - timer_expand_eps_arcs_ -
-      timer_expand_search_arcs_ - timer_expand_search_states_ - timer_gc_
-      - timer_begin_decode_;
+    // No search state is left, any record of a bounded graph cache can go
+    graph_->Trim(SearchStateInUse(search_hash_));
+    double end_time = timer_.Elapsed();
+    double timer_other = end_time - timer_end_decode_ -
+      timer_expand_eps_arcs_ - timer_expand_search_arcs_ -
+      timer_expand_search_states_ - timer_gc_ - timer_begin_decode_;
 
     lattice_->DumpInfo();
     logger_(INFO) << "Search usage summary :" << endl
@@ -809,11 +1047,18 @@ class CLevelDecoder {
       << "\t\t  # of epsilons expanded "
       << total_num_epsilson_states_relaxed_ << endl
       << "\t\t  # of search state misses "
-      << num_search_state_misses_;
+      << num_search_state_misses_
+      << " # of states in search graph cache "
+      << graph_->NumStates() << " ("
+      << graph_->Size() / kMegaByte << " MB)" << endl
+      << "\t\t  Search graph cache hits " << graph_->NumHits()
+      << " misses " << graph_->NumMisses()
+      << " evictions " << graph_->NumEvictions()
+      << " pinned " << graph_->NumPinned();
 
     double timer_sum = timer_expand_search_arcs_ + timer_expand_search_states_ +
       timer_expand_eps_arcs_ + timer_gc_  + timer_end_decode_  +
-      timer_next_frame_ + timer_begin_decode_ + timer_other_;
+      timer_next_frame_ + timer_begin_decode_ + timer_other;
 
     logger_(INFO) << "Search profile : " << endl
       << "\t\t  Arcs " <<  timer_expand_search_arcs_ / end_time
@@ -822,17 +1067,23 @@ class CLevelDecoder {
       << ", GC " << timer_gc_ / end_time
       << ", End " << timer_end_decode_ / end_time
       << ", Decodable " << timer_next_frame_ / end_time
-      << ", Other " << (timer_begin_decode_ + timer_other_)  / end_time
+      << ", Other " << (timer_begin_decode_ + timer_other)  / end_time
       << " (Sum " << timer_sum / end_time << ")";
     return best_cost;
   }
 
+  // Every cached state is reclaimed at once by resetting the arena
   void ClearSearchHash() {
     PROFILE_FUNC();
-    for (typename SearchHash::iterator it = search_hash_.begin();
-        it != search_hash_.end(); ++it)
-      FreeSearchState(it->second);
-    search_hash_.clear();
+    if (search_arena_.NumAllocated() != search_hash_.Size())
+      logger_(FATAL) << "Search arena holds " << search_arena_.NumAllocated()
+        << " states but " << search_hash_.Size() << " are cached";
+    num_search_state_frees_ += search_hash_.Size();
+    search_hash_.Clear();
+    if (search_opts_.use_search_pool)
+      search_arena_.Reset();
+    else
+      search_arena_.Release();
     if (num_search_state_allocs_ != num_search_state_frees_)
       logger_(FATAL) << "Search state allocation mismatch detected : "
         << " # Allocs : " << num_search_state_allocs_
@@ -844,6 +1095,7 @@ class CLevelDecoder {
     lattice_->Clear();
     ClearSearchHash();
     ClearSearch();
+    token_pool_.Reset();
     time_ = -1;
   }
 
@@ -857,30 +1109,39 @@ class CLevelDecoder {
     return ofst.Write(path);
   }
 
+  // Collect the lattice states that are no longer reachable from the tokens
+  // of the active arcs. Only every gc_full_period-th collection scans the
+  // whole lattice, the early mission always needs a full collection
   int Gc() {
     PROFILE_FUNC();
     if (search_opts_.dump_traceback) {
       stringstream ss;
-      ss << FLAGS_tmpdir << time_ <<  "_" << search_opts_.source
+      ss << FLAGS_tmpdir << time_ <<  "_" << source_
         << "_pre.fst";
       DumpTraceBackToFst(ss.str());
     }
 
-    lattice_->GcClearMarks();
+    int gc_index = (time_ + 1) / max(search_opts_.gc_period, 1);
+    bool full = search_opts_.early_mission ||
+      search_opts_.gc_full_period <= 1 ||
+      gc_index % search_opts_.gc_full_period == 0;
+    lattice_->GcClearMarks(full);
     for (int i = 0; i != active_arcs_.size(); ++i) {
       SearchArc* search_arc = active_arcs_[i];
-      search_arc->GcMark();
+      search_arc->GcMark(lattice_);
     }
-    vector<int> early_mission;
+    vector<CommittedWord> early_mission;
     int lattice_num_reclaimed =
       lattice_->GcSweep(search_opts_.early_mission ?  &early_mission : 0);
+    committed_words_.insert(committed_words_.end(), early_mission.begin(),
+                            early_mission.end());
 
     if (early_mission.size() && search_opts_.wordsyms) {
       if (early_mission.size()) {
         stringstream ss;
         ss << "Partial : ";
         for (int i = 0; i != early_mission.size(); ++i) {
-          ss << search_opts_.wordsyms->Find(early_mission[i]);
+          ss << search_opts_.wordsyms->Find(early_mission[i].olabel);
           if (i < early_mission.size() - 1)
             ss << " ";
         }
@@ -890,7 +1151,7 @@ class CLevelDecoder {
 
     if (search_opts_.dump_traceback) {
       stringstream ss;
-      ss << FLAGS_tmpdir << time_ <<  "_" << search_opts_.source
+      ss << FLAGS_tmpdir << time_ <<  "_" << source_
         << "_post.fst";
       DumpTraceBackToFst(ss.str());
     }
@@ -898,6 +1159,9 @@ class CLevelDecoder {
     if (search_opts_.gc_check)
       GcCheck();
 
+    // Keep a bounded cache of a lazy search graph within its limit
+    graph_->Trim(SearchStateInUse(search_hash_));
+
     return lattice_num_reclaimed;
   }
 
@@ -920,23 +1184,35 @@ class CLevelDecoder {
     return true;
   }
 
-  int SearchGc() {
-    int num_reclaimed = 0;
-    for (typename SearchHash::iterator it = search_hash_.begin();
-         it != search_hash_.end();) {
-      SearchState* ss = it->second;
-      if (!ss->RefCount()) {
-        FreeSearchState(ss);
-        ++num_reclaimed;
-        typename SearchHash::iterator jt = it++;
-        search_hash_.erase(jt);
-      } else {
-        ++it;
-      }
+  // Frees the unreferenced search states removed by SearchGc
+  struct SearchStateReclaimer {
+    explicit SearchStateReclaimer(CLevelDecoder* decoder)
+        : decoder_(decoder) { }
+
+    bool operator()(SearchState* ss) const {
+      if (ss->RefCount())
+        return false;
+      decoder_->FreeSearchState(ss);
+      return true;
     }
-    return num_reclaimed;
+
+    CLevelDecoder* decoder_;
+  };
+
+  int SearchGc() {
+    return search_hash_.EraseIf(SearchStateReclaimer(this));
   }
 
+  // The search graph records of the cached search states are in use
+  struct SearchStateInUse {
+    explicit SearchStateInUse(const SearchHash& search_hash)
+        : search_hash_(search_hash) { }
+
+    bool operator()(int state) const { return search_hash_.Find(state) != 0; }
+
+    const SearchHash& search_hash_;
+  };
+
   void DumpInfo() {
     return;
     if (!debug_) return;
@@ -944,7 +1220,7 @@ class CLevelDecoder {
       << "\tCurrent time " << time_ << endl
       << "\t# Active states " << active_states_.size() << endl
       << "\t# Active arcs " << active_arcs_.size() << endl
-      << "\t# Cached search states " << search_hash_.size();
+      << "\t# Cached search states " << search_hash_.Size();
     lattice_->DumpInfo();
   }
 
@@ -953,7 +1229,7 @@ class CLevelDecoder {
   // active state list is empty
   bool BeginDecode() {
     PROFILE_FUNC();
-    int s = fst_->Start();
+    int s = graph_->Start();
     if (s == kNoStateId)
       return false;
     LatticeState ls = lattice_->CreateStartState(s);
@@ -965,40 +1241,51 @@ class CLevelDecoder {
     return !active_states_.empty();
   }
 
-  SearchState* FindBestState(int finalmode = kBackoff) {
+  // The costs include the end of sentence cost of the rescoring LM, the
+  // cost of the best state is returned in cost when given
+  SearchState* FindBestState(int finalmode = kBackoff, float* cost = 0) {
     SearchState* best_state = 0;
     float best_cost = kMaxCost;
     if (finalmode != kAnyFinal) {
       for (int i = 0; i != active_states_.size(); ++i) {
         SearchState* ss = active_states_[i];
-        if (ss->AcceptCost() < best_cost) {
-          best_cost = ss->AcceptCost();
+        float c = ss->AcceptCost() +
+          lattice_->FinalCost(ss->GetToken().GetLatticeState());
+        if (c < best_cost) {
+          best_cost = c;
           best_state = ss;
         }
       }
-      // Found a final state or we didn't but non-final aren't allowed
-      if (best_state || finalmode == kRequireFinal)
-        return best_state;
     }
-    for (int i = 0; i != active_states_.size(); ++i) {
-      SearchState* ss = active_states_[i];
-      if (ss->Cost() < best_cost) {
-        best_cost = ss->AcceptCost();
-        best_state = ss;
+    // Use any state if none is final, unless non-final aren't allowed
+    if (!best_state && finalmode != kRequireFinal) {
+      for (int i = 0; i != active_states_.size(); ++i) {
+        SearchState* ss = active_states_[i];
+        float c = ss->Cost() +
+          lattice_->FinalCost(ss->GetToken().GetLatticeState());
+        if (c < best_cost) {
+          best_cost = c;
+          best_state = ss;
+        }
       }
     }
+    if (cost)
+      *cost = best_cost;
     return best_state;
   }
 
   // Here ARC is the templated on the underlying semiring of the output lattice
-  // which in most case will be different to the semiring of the search Fst
+  // which in most case will be different to the semiring of the search Fst.
+  // Returns the cost of the best state the lattice ends in, including the
+  // final cost of the rescoring LM the lattice carries as its final weight
   template<class ARC>
   float EndDecode(VectorFst<ARC>* ofst, fst::MutableFst<ARC>* lattice = 0,
                   int n = 0) {
     PROFILE_FUNC();
-    SearchState* ss = FindBestState();
+    float best_cost = kMaxCost;
+    SearchState* ss = FindBestState(kBackoff, &best_cost);
     if (ss) {
-      ss->GetBestSequence(ofst);
+      ss->GetBestSequence(ofst, *lattice_);
       // optionally generate the lattice arcs
       if (lattice) {
         int numarcs =
@@ -1025,23 +1312,7 @@ class CLevelDecoder {
           *lattice = nbest;
         }
       }
-      return ss->Cost();
-    }
-    return kMaxCost;
-  }
-
-  float ComputeBand() {
-    PROFILE_FUNC();
-    vector<float> costs;
-    for (int i = 0; i != active_arcs_.size(); ++i) {
-      SearchArc* search_arc = active_arcs_[i];
-      if (search_arc && search_arc->Active())
-        costs.push_back(search_arc->GetBestCost());
-    }
-    if (costs.size() > search_opts_.band) {
-      std::nth_element(costs.begin(), costs.begin() + search_opts_.band,
-          costs.end());
-      return costs[search_opts_.band];
+      return best_cost;
     }
     return kMaxCost;
   }
@@ -1059,6 +1330,21 @@ class CLevelDecoder {
           threshold(kMaxCost), best_arc_index(-1), num_expanded(0),
           num_pruned(0), best_lookahead_cost(kMaxCost),
           lookahead_threshold(kMaxCost), num_lookahead_pruned(0) { }
+
+    // Reset the costs and counts but keep the buffers for the next frame
+    void Reset() {
+      best_arc_cost = kMaxCost;
+      worst_arc_cost = kMinCost;
+      threshold = kMaxCost;
+      best_arc_index = -1;
+      num_expanded = 0;
+      num_pruned = 0;
+      best_lookahead_cost = kMaxCost;
+      lookahead_threshold = kMaxCost;
+      num_lookahead_pruned = 0;
+      deactivated.clear();
+    }
+
     float best_arc_cost;
     float worst_arc_cost;
     float threshold;
@@ -1068,24 +1354,50 @@ class CLevelDecoder {
     float best_lookahead_cost;
     float lookahead_threshold;
     int num_lookahead_pruned;
+    vector<SearchArc*> deactivated;  // Pruned arcs still holding tokens
+    ArcBatch<Token> batch;  // Arcs of the range for batched expansion
   };
 
 
   typedef Triple<float, float, int> ArcExpandResults;
 
-  ArcExpandResults ExpandActiveArcs_ArcExpansion(int begin, int end) {
+  // Prefetch the arc search_opts_.arc_prefetch places ahead of i in the
+  // active list, so its tokens and weights arrive before it is expanded
+  inline void PrefetchArc(int i, int end) const {
+    int j = i + search_opts_.arc_prefetch;
+    if (j < end && active_arcs_[j])
+      active_arcs_[j]->Prefetch(trans_model_);
+  }
+
+  // Advance the tokens of the arcs in [begin, end) of the active list. Each
+  // range keeps its own best cost and thresholds and only writes to its own
+  // arcs and slots in active_arcs_ and arc_costs_, so disjoint ranges can be
+  // expanded concurrently. Nothing is propagated to the search states here
+  // and the pruned arcs are handed back to the token pool after the merge
+  void ExpandArcRange(int begin, int end, ArcExpandResults2* results) {
     PROFILE_FUNC();
-    float best_arc_cost = kMaxCost;
-    float best_lookahead_cost = kMaxCost;
-    float lookahead_threshold = kMaxCost;
-    float worst_arc_cost = -kMaxCost;
-    int best_index = -1;
-    total_num_arc_expanded_ += active_arcs_.size();
     Token scratch[kMaxTokensPerArc];
-    ArcExpandOptions<Token, L> opts(kMaxCost, kMaxCost, kMaxCost, kMaxCost, 0,
-                                    scratch, search_opts_, lattice_);
+    ExpandOptions opts(kMaxCost, kMaxCost, kMaxCost, kMaxCost, 0, scratch,
+                       search_opts_, lattice_, &cursor_);
+
+    // In batch mode all the arcs of the range are advanced by the
+    // transition model in one call and then pruned in list order below
+    ArcBatch<Token>& batch = results->batch;
+    int batch_index = 0;
+    if (search_opts_.batch_expand) {
+      batch.Clear();
+      for (int i = begin; i != end; ++i) {
+        if (search_opts_.arc_prefetch)
+          PrefetchArc(i, end);
+        if (active_arcs_[i])
+          active_arcs_[i]->AddToBatch(&batch);
+      }
+      trans_model_->ExpandBatch(&batch, &opts);
+    }
 
     for (int i = begin; i != end; ++i) {
+      if (search_opts_.arc_prefetch && !search_opts_.batch_expand)
+        PrefetchArc(i, end);
       SearchArc* search_arc = active_arcs_[i];
       if (!search_arc) {
         continue;
@@ -1093,58 +1405,161 @@ class CLevelDecoder {
 
       //Expansion returns the cost of the best
       //scoring token in the arc
-      pair<float, float> arc_cost_lookahead =
-        search_arc->Expand(trans_model_, &opts);
+      pair<float, float> arc_cost_lookahead = search_opts_.batch_expand ?
+        batch.costs[batch_index++] : search_arc->Expand(trans_model_, &opts);
       float arc_cost = arc_cost_lookahead.first;
+      ++results->num_expanded;
 
-      if (arc_cost >= threshold_) {
-        search_arc->Deactivate(&active_arcs_, time_);
+      if (arc_cost >= results->threshold) {
+        results->deactivated.push_back(search_arc);
         active_arcs_[i] = 0;
-        ++num_arcs_pruned_;
-        ++total_num_arcs_pruned_;
+        ++results->num_pruned;
         continue;
       }
 
 
-      if (search_opts_.acoustic_lookahead > kDelta) {
+      if (cursor_.HasLookahead()) {
         float lookahead_cost =  arc_cost_lookahead.second;
-        if (lookahead_cost > lookahead_threshold) {
-          search_arc->Deactivate(&active_arcs_, time_);
+        if (lookahead_cost > results->lookahead_threshold) {
+          results->deactivated.push_back(search_arc);
           active_arcs_[i] = 0;
-          ++num_arcs_pruned_;
-          ++total_num_arcs_lookahead_pruned_;
+          ++results->num_lookahead_pruned;
           continue;
         }
 
-        if (lookahead_cost < best_lookahead_cost) {
-          best_lookahead_cost = lookahead_cost;
-          lookahead_threshold = best_lookahead_cost + search_opts_.beam;
-          opts.lbest_ = best_lookahead_cost;
-          opts.lthreshold_ = lookahead_threshold;
+        if (lookahead_cost < results->best_lookahead_cost) {
+          results->best_lookahead_cost = lookahead_cost;
+          results->lookahead_threshold = lookahead_cost +
+            search_opts_.lookahead_beam;
+          opts.lbest_ = results->best_lookahead_cost;
+          opts.lthreshold_ = results->lookahead_threshold;
         }
       }
 
       // Move the best arc to the front of the list
       // TODO how close is the best arc in the next round
       // TODO what do the arc best cost trajectories look like during decoding
-      if (arc_cost < best_arc_cost) {
-        best_arc_cost = arc_cost;
-        threshold_ = best_arc_cost + search_opts_.beam;
-        opts.threshold_ = threshold_;
-        best_index = i;
+      if (arc_cost < results->best_arc_cost) {
+        results->best_arc_cost = arc_cost;
+        results->threshold = arc_cost + beam_;
+        opts.threshold_ = results->threshold;
+        results->best_arc_index = i;
       }
       arc_costs_[i] = arc_cost;
-      worst_arc_cost = max(worst_arc_cost, arc_cost);
+      results->worst_arc_cost = max(results->worst_arc_cost, arc_cost);
     }
-    return ArcExpandResults(best_arc_cost, worst_arc_cost, best_index);
   }
 
-  void ExpandActiveArcs_BandPruning() {
+  // Task run on the arc pool, expands one range of the active arcs
+  struct ArcRangeTask {
+    ArcRangeTask(CLevelDecoder* decoder, int begin, int end,
+                 ArcExpandResults2* results)
+        : decoder_(decoder), begin_(begin), end_(end), results_(results) { }
+
+    void operator()(int id) {
+      decoder_->ExpandArcRange(begin_, end_, results_);
+    }
+
+    CLevelDecoder* decoder_;
+    int begin_;
+    int end_;
+    ArcExpandResults2* results_;
+  };
+
+  // Expand the active arcs in [begin, end). When an arc pool is available
+  // and the range is large enough, the range is split into one chunk per
+  // thread. The per chunk results are merged in list order so the best
+  // arc, the threshold and the counts don't depend on the scheduling
+  ArcExpandResults ExpandActiveArcs_ArcExpansion(int begin, int end) {
     PROFILE_FUNC();
-    if (arc_costs_.size() > search_opts_.band) {
-      float band = ComputeBand();
-      threshold_ = band;
+    total_num_arc_expanded_ += active_arcs_.size();
+    int num_chunks = 1;
+    if (arc_pool_)
+      num_chunks = min(arc_pool_->NumThreads(),
+                       (end - begin) / max(search_opts_.min_arcs_per_thread,
+                                           1));
+    if (num_chunks <= 1) {
+      num_chunks = 1;
+      arc_results_.resize(1);
+      arc_results_[0].Reset();
+      ExpandArcRange(begin, end, &arc_results_[0]);
+    } else {
+      arc_results_.resize(num_chunks);
+      int n = end - begin;
+      for (int i = 0; i != num_chunks; ++i) {
+        arc_results_[i].Reset();
+        arc_pool_->Schedule(ArcRangeTask(this,
+                                         begin + i * n / num_chunks,
+                                         begin + (i + 1) * n / num_chunks,
+                                         &arc_results_[i]));
+      }
+      arc_pool_->Wait();
     }
+
+    ArcExpandResults2 merged;
+    for (int i = 0; i != num_chunks; ++i) {
+      ArcExpandResults2& r = arc_results_[i];
+      // Strict comparison keeps the earliest arc on ties, the same arc the
+      // sequential expansion would choose
+      if (r.best_arc_cost < merged.best_arc_cost) {
+        merged.best_arc_cost = r.best_arc_cost;
+        merged.best_arc_index = r.best_arc_index;
+      }
+      merged.worst_arc_cost = max(merged.worst_arc_cost, r.worst_arc_cost);
+      merged.num_expanded += r.num_expanded;
+      merged.num_pruned += r.num_pruned;
+      merged.num_lookahead_pruned += r.num_lookahead_pruned;
+      for (int j = 0; j != r.deactivated.size(); ++j)
+        r.deactivated[j]->Deactivate(&token_pool_);
+    }
+    if (merged.best_arc_cost < kMaxCost)
+      threshold_ = merged.best_arc_cost + beam_;
+    num_arcs_surviving_ = merged.num_expanded - merged.num_pruned -
+      merged.num_lookahead_pruned;
+    if (num_arcs_surviving_ > search_opts_.band || search_opts_.min_band > 0) {
+      // The best cost of the range is only known after the merge, so the
+      // costs are binned in a pass over the survivors here
+      histogram_.Reset(merged.best_arc_cost, merged.worst_arc_cost);
+      for (int i = begin; i != end; ++i)
+        if (active_arcs_[i])
+          histogram_.Add(arc_costs_[i]);
+    }
+    num_arcs_pruned_ += merged.num_pruned + merged.num_lookahead_pruned;
+    total_num_arcs_pruned_ += merged.num_pruned;
+    total_num_arcs_lookahead_pruned_ += merged.num_lookahead_pruned;
+    return ArcExpandResults(merged.best_arc_cost, merged.worst_arc_cost,
+                            merged.best_arc_index);
+  }
+
+  // Adaptive beam in the style of Kaldi. When more than max_arcs arcs
+  // survived the expansion the cutoff is taken from the histogram. The beam
+  // implied by the cutoff plus beam_delta is used for the next frame, so the
+  // active set stays near the target instead of oscillating. The arcs
+  // outside beam_ were already dropped by the expansion, so with fewer than
+  // min_arcs arcs all of them are kept and the beam of the next frame is
+  // widened by beam_delta, frame after frame until enough arcs survive
+  void ExpandActiveArcs_BandPruning() {
+    PROFILE_FUNC();
+    float best = best_arc_cost_;
+    if (best >= kMaxCost)
+      return;
+    float beam_cutoff = best + search_opts_.beam;
+    float cutoff = beam_cutoff;
+    if (num_arcs_surviving_ > search_opts_.band) {
+      cutoff = min(cutoff, histogram_.LowerCutoff(search_opts_.band));
+    } else if (num_arcs_surviving_ < search_opts_.min_band) {
+      threshold_ = max(cutoff, worst_arc_cost_);
+      beam_ = max(beam_, threshold_ - best) + search_opts_.beam_delta;
+      return;
+    } else if (search_opts_.min_band > 0) {
+      cutoff = max(cutoff, min(histogram_.UpperCutoff(search_opts_.min_band),
+                               worst_arc_cost_));
+    }
+    if (cutoff != beam_cutoff)
+      beam_ = cutoff - best + search_opts_.beam_delta;
+    else
+      beam_ = search_opts_.beam;
+    threshold_ = cutoff;
   }
 
   void ExpandActiveArcs_ListCompaction() {
@@ -1163,11 +1578,11 @@ class CLevelDecoder {
             // Return a pointer the next state and the cost arriving via
             // active_arcs[i] not the best cost of the state
             pair<SearchState*, float> statecost =
-                ExpandToFollowingState(arc, threshold_);
+                ExpandToFollowingState(arc, arc->GetExitToken(), threshold_);
             // Some lookahead or re-scoring might actually give us a even better
             // threshold than the band pruning
-            if (statecost.second + search_opts_.beam < threshold_) {
-              threshold_ = statecost.second + search_opts_.beam;
+            if (statecost.second + beam_ < threshold_) {
+              threshold_ = statecost.second + beam_;
               //Could use a branchless min once we know
               //this actually helps out
             }
@@ -1177,7 +1592,7 @@ class CLevelDecoder {
         }
       } else {
         ++total_num_arcs_hisogram_pruned_;
-        active_arcs_[i]->Deactivate(&active_arcs_, time_);
+        active_arcs_[i]->Deactivate(&token_pool_);
         active_arcs_[i] = 0;
       }
     }
@@ -1186,8 +1601,31 @@ class CLevelDecoder {
     num_active_arcs_after_prune_ = active_arcs_.size();
   }
 
+  // Sort the active arcs every arc_order_period frames. The list keeps its
+  // order through the compaction and new arcs are appended, so in between
+  // sorts it is mostly ordered. The best arc of the previous frame stays at
+  // the front to set a tight threshold early
+  void ExpandActiveArcs_Ordering() {
+    PROFILE_FUNC();
+    if (search_opts_.arc_order == kActivationArcOrder ||
+        active_arcs_.size() < 2 ||
+        time_ % max(search_opts_.arc_order_period, 1) != 0)
+      return;
+    if (search_opts_.arc_order == kILabelArcOrder)
+      std::sort(active_arcs_.begin() + 1, active_arcs_.end(),
+                SearchArcILabelCompare());
+    else if (search_opts_.arc_order == kAddressArcOrder)
+      std::sort(active_arcs_.begin() + 1, active_arcs_.end(),
+                SearchArcAddressCompare());
+  }
+
   void ExpandActiveArcs() {
     PROFILE_FUNC();
+    ExpandActiveArcs_Ordering();
+    num_active_arcs_ = active_arcs_.size();
+    // The arc threads don't touch the statistics, count the arcs here
+    for (int i = 0; i != active_arcs_.size(); ++i)
+      search_stats_.ArcExpanded(active_arcs_[i]->ILabel());
     num_arcs_pruned_ = 0;
     best_arc_cost_ = kMaxCost;
     worst_arc_cost_ = -kMaxCost;
@@ -1202,16 +1640,20 @@ class CLevelDecoder {
     ExpandActiveArcs_BandPruning();
     ExpandActiveArcs_ListCompaction();
     arc_costs_.clear();
-    num_active_arcs_ = active_arcs_.size();
     num_unique_ilabels_ = 0;
   }
 
+  // Exit tokens are always propagated on the calling thread from
+  // ExpandActiveArcs_ListCompaction in active list order, this keeps the
+  // updates to the shared search states and the lattice free of conflicts
+  // and the result independent of the number of arc threads.
   // Returns a pair, pointer to the destination search state
   // and the cost of the arc arriving in the state, may be bigger than
   // SearchState's cost in lattice generation mode but lower(or higher)
   // than the arc's exit cost in on-the-fly rescoring mode of if some other
   // heuristic is added returns null, kMaxCost if no state was activated
   pair<SearchState*, float> ExpandToFollowingState(SearchArc* arc,
+                                                   const Token& token,
                                                    float threshold) {
     PROFILE_FUNC();
     /* Token token = arc->GetExitToken();
@@ -1223,7 +1665,7 @@ class CLevelDecoder {
        }
     */
     SearchState* ss = arc->FindNextState(this);
-    pair<float, float> costs = ss->SetToken(*arc, time_, threshold,
+    pair<float, float> costs = ss->SetToken(*arc, token, time_, threshold,
                                             &active_states_, lattice_,
                                             search_opts_);
     return pair<SearchState*, float>(ss, costs.first);
@@ -1231,8 +1673,12 @@ class CLevelDecoder {
 
   void ExpandActiveStates() {
     PROFILE_FUNC();
-    float threshold = best_state_cost_ + search_opts_.beam;
+    float threshold = best_state_cost_ + beam_;
     max_active_states_ = max(max_active_states_, int(active_states_.size()));
+    EntryLookahead lookahead(trans_model_, &cursor_,
+                             search_opts_.lookahead_beam);
+    EntryLookahead* entry_lookahead =
+      cursor_.HasLookahead() ? &lookahead : 0;
     for (int i = 0; i != active_states_.size(); ++i ) {
       SearchState* ss = active_states_[i];
       if (ss->NumEmitting()) {
@@ -1240,15 +1686,18 @@ class CLevelDecoder {
           ++total_num_states_pruned_;
         } else {
           ++total_num_states_expanded_;
-          float cost = ss->ExpandIntoArcs(&active_arcs_, threshold, time_,
-              search_opts_);
+          search_stats_.StateExpanded(ss->StateId());
+          float cost = ss->ExpandIntoArcs(&active_arcs_, &token_pool_,
+                                          threshold, time_, search_opts_,
+                                          entry_lookahead);
           // Update the pruning threshold
-          threshold = min(threshold, cost + search_opts_.beam);
+          threshold = min(threshold, cost + beam_);
         }
       }
       ss->Deactivate(&active_states_);
     }
     active_states_.clear();
+    total_num_arcs_lookahead_pruned_ += lookahead.num_pruned;
   }
 
   // Expand the epsilon like transitions using  a generic single
@@ -1293,11 +1742,11 @@ class CLevelDecoder {
       if (ss->Cost() <  threshold) {
         search_stats_.EpsilonExpanded(ss->StateId());
         float f = ss->ExpandEpsilonArcs(&active_states_, &q, this,
-            search_opts_.prune_eps ? best + search_opts_.beam : kMaxCost,
+            search_opts_.prune_eps ? best + beam_ : kMaxCost,
             search_opts_);
         if (f < best) {
           best = f;
-          threshold = best + search_opts_.beam;
+          threshold = best + beam_;
         }
         ++num_epsilon_cycles_;
       } else {
@@ -1343,11 +1792,11 @@ class CLevelDecoder {
       if (ss->Cost() <  threshold) {
         search_stats_.EpsilonExpanded(ss->StateId());
         float f = ss->ExpandEpsilonArcs(&active_states_, &q, this,
-            search_opts_.prune_eps ? best + search_opts_.beam : kMaxCost,
+            search_opts_.prune_eps ? best + beam_ : kMaxCost,
             search_opts_);
         if (f < best) {
           best = f;
-          threshold = best + search_opts_.beam;
+          threshold = best + beam_;
         }
         ++num_epsilon_cycles_;
       } else {
@@ -1369,11 +1818,7 @@ class CLevelDecoder {
   void ClearSearch() {
     active_states_.clear();
     active_arcs_.clear();
-    for (typename SearchHash::iterator it = search_hash_.begin();
-        it != search_hash_.end(); ++it) {
-      FreeSearchState(it->second);
-    }
-    search_hash_.clear();
+    ClearSearchHash();
   }
 
   void Clear() {
@@ -1384,27 +1829,14 @@ class CLevelDecoder {
 
   void FreeSearchState(SearchState* searchstate) {
     assert(searchstate);
-    if (search_opts_.use_search_pool)
-      search_state_pool_.push_back(searchstate);
-    else
-      delete searchstate;
+    search_arena_.Free(searchstate, searchstate->NumArcSlots());
     ++num_search_state_frees_;
   }
 
-  SearchState* AllocSearchState() {
+  // Returns a state from the arena with room for num_arcs arcs after it
+  SearchState* AllocSearchState(int num_arcs) {
     ++num_search_state_allocs_;
-    if (search_state_pool_.empty())
-      return new SearchState;
-    SearchState* ss = search_state_pool_.back();
-    search_state_pool_.pop_back();
-    return ss;
-  }
-
-  void ClearSearchPool() {
-    for (typename vector<SearchState*>::iterator it =
-         search_state_pool_.begin(); it != search_state_pool_.end(); ++it)
-      delete *it;
-    search_state_pool_.clear();
+    return search_arena_.Alloc(num_arcs);
   }
 
   // If each state is pair based on the state in the WFST
@@ -1414,17 +1846,19 @@ class CLevelDecoder {
   virtual SearchState* FindSearchState(int state) {
     PROFILE_FUNC();
     ++num_search_state_requests_;
-    if (search_hash_.find(state) == search_hash_.end()) {
+    SearchState*& ss = search_hash_.FindOrInsert(state);
+    if (!ss) {
       ++num_search_state_misses_;
-      // Todo possible create a memory pool to store the states
-      SearchState* ss = AllocSearchState();
-      ss->Init(*fst_, state, *trans_model_, search_opts_);
-      search_hash_[state] = ss;
-      return ss;
+      const SearchStateInfo* info = graph_->Find(state);
+      if (!info)
+        logger_(FATAL) << "Invalid input label on an arc leaving state "
+          << state << ", aux symbols left in the Fst?";
+      ss = AllocSearchState(info->NumArcSlots());
+      ss->Init(state, info, SearchArena::Arcs(ss));
     } else {
       ++num_search_state_hits_;
     }
-    return search_hash_[state];
+    return ss;
   }
 
   static const string &Type() {
@@ -1434,7 +1868,8 @@ class CLevelDecoder {
 
  private:
   FST* fst_;
-  TransModel* trans_model_;
+  const TransModel* trans_model_;
+  Cursor cursor_;  // Position in the decodable of the current utterance
   ActiveArcVector active_arcs_;
   ActiveStateVector active_states_;
   mutable SearchHash search_hash_;
@@ -1445,8 +1880,17 @@ class CLevelDecoder {
   int time_;
   bool debug_;
   vector<float> arc_costs_;
-  vector<SearchState*> search_state_pool_;
+  SearchGraph* graph_;  // Static part of the search states
+  bool owns_graph_;
+  TokenPoolType token_pool_;  // Token storage for the active arcs
+  ThreadPool* arc_pool_;  // Optional pool for expanding the active arcs
+  vector<ArcExpandResults2> arc_results_;  // Per chunk expansion results
+  SearchArena search_arena_;  // Storage for the states and their arcs
   float threshold_;
+  float beam_;  // Adaptive beam, search_opts_.beam unless the number of
+                // active arcs is outside [min_arcs, max_arcs]
+  CostHistogram histogram_;  // Costs of the arcs surviving the expansion
+  int num_arcs_surviving_;  // Arcs left after the expansion of the frame
   float best_arc_cost_;  // Best arc after token expansion
   float worst_arc_cost_;  // Worst surviing arc after token expansion and
                           // pruning and on-the-fly rescoring
@@ -1488,7 +1932,23 @@ class CLevelDecoder {
   int max_active_states_;
 
   Statistics search_stats_;
-  Timer timer_;
+  vector<CommittedWord> committed_words_;  // Not yet collected by the caller
+  Timer timer_;  // Reset when an utterance starts
+  // Time spent in each step of the current utterance
+  double timer_begin_decode_;
+  double timer_expand_search_states_;
+  double timer_expand_search_arcs_;
+  double timer_expand_eps_arcs_;
+  double timer_gc_;
+  double timer_end_decode_;
+  double timer_next_frame_;
+  string source_;  // Utterance being decoded
+  SearchTrace* trace_;  // Not owned, null when not tracing
+  string trace_utterance_;
+  int trace_thread_;
+#ifdef HAVE_SEARCH_TRACE
+  FrameTrace trace_totals_;  // Totals after the previous frame
+#endif
   DISALLOW_COPY_AND_ASSIGN(CLevelDecoder);
 };
 
@@ -0,0 +1,195 @@
+// compiled-search-graph.h
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// Read-only search graph file. dcd-compile-graph writes the SearchStateInfo
+// record of every state of an expanded search Fst, the decoders then map the
+// file instead of loading the Fst. Finding the record of a state is an offset
+// into the mapping and the pages are shared by every process decoding with
+// the same graph.
+//
+// The layout is in host byte order
+//   CompiledSearchGraphHeader
+//   int64 offsets[num_states], byte offset of each record in the records
+//   records, each a SearchStateInfo directly followed by its SearchArcInfo
+//
+// The insertion penalty, the epsilon closures and the exit weights and
+// state counts of the transition model are part of the records. A graph is
+// only valid with the transition model and the options it was compiled
+// with, the header keeps a checksum of the model to enforce this.
+
+#ifndef DCD_COMPILED_SEARCH_GRAPH_H__
+#define DCD_COMPILED_SEARCH_GRAPH_H__
+
+#include <string>
+
+#include <fst/compat.h>
+
+#include <dcd/constants.h>
+#include <dcd/log.h>
+#include <dcd/mapped-file.h>
+#include <dcd/search-opts.h>
+
+namespace dcd {
+
+struct SearchStateInfo;
+
+struct CompiledSearchGraphHeader {
+  int32 magic;
+  int32 version;
+  int32 num_states;
+  int32 start;
+  int64 num_arcs;  // Arcs in all the records
+  int64 records_size;  // Bytes in all the records
+  float insertion_penalty;
+  float trans_scale;
+  int32 eps_closure;
+  int32 num_hmms;  // Labels of the transition model
+  uint32 trans_model_checksum;  // See TransModelChecksum
+  int32 reserved;
+};
+
+// Checksum of the transition model data compiled into the records, the
+// number of states and the exit weight of every label. The state counts
+// size the token buffers of the arcs, so a graph must never be used with a
+// model that disagrees on them
+template<class TM>
+uint32 TransModelChecksum(const TM& trans_model) {
+  uint32 hash = Checksum(0, 0);  // Hash of nothing
+  for (int i = 0; i != trans_model.NumHmms(); ++i) {
+    int32 num_states = trans_model.IsNonEmitting(i) ? 0 :
+      trans_model.NumStates(i);
+    float exit_weight = trans_model.GetExitWeight(i);
+    hash = Checksum(reinterpret_cast<const char*>(&num_states),
+                    sizeof(num_states), hash);
+    hash = Checksum(reinterpret_cast<const char*>(&exit_weight),
+                    sizeof(exit_weight), hash);
+  }
+  return hash;
+}
+
+class CompiledSearchGraph {
+ public:
+  ~CompiledSearchGraph() { delete file_; }
+
+  // Maps a graph written by SearchGraphCache::Write, returns null if the file
+  // can't be mapped or is not a compiled search graph
+  static CompiledSearchGraph* Read(const std::string& filename) {
+    MappedFile* file =
+      MappedFile::Map(filename, sizeof(CompiledSearchGraphHeader));
+    if (!file)
+      return 0;
+    CompiledSearchGraph* graph = new CompiledSearchGraph(file);
+    if (!graph->Verify(filename)) {
+      delete graph;
+      return 0;
+    }
+    return graph;
+  }
+
+  // True if the file starts with the magic number of a compiled graph, used
+  // to tell a compiled graph from an Fst given in its place
+  static bool IsCompiledSearchGraph(const std::string& filename) {
+    return HasMagicNumber(filename, kCompiledSearchGraphMagic);
+  }
+
+  // Returns false and logs the difference if the graph was compiled with
+  // options or a transition model that change the records
+  template<class TM>
+  bool Compatible(const SearchOptions& opts, const TM& trans_model) const {
+    bool compatible = true;
+    if (header_->num_hmms != trans_model.NumHmms() ||
+        header_->trans_model_checksum != TransModelChecksum(trans_model)) {
+      LOG(ERROR) << "Search graph was compiled with a different transition "
+                 << "model of " << header_->num_hmms << " HMMs";
+      compatible = false;
+    }
+    if (header_->insertion_penalty != opts.insertion_penalty) {
+      LOG(ERROR) << "Search graph was compiled with insertion_penalty = "
+                 << header_->insertion_penalty;
+      compatible = false;
+    }
+    if (header_->trans_scale != opts.trans_scale) {
+      LOG(ERROR) << "Search graph was compiled with trans_scale = "
+                 << header_->trans_scale;
+      compatible = false;
+    }
+    if ((header_->eps_closure != 0) != opts.eps_closure) {
+      LOG(ERROR) << "Search graph was compiled with eps_closure = "
+                 << (header_->eps_closure != 0);
+      compatible = false;
+    }
+    return compatible;
+  }
+
+  inline const SearchStateInfo* State(int state) const {
+    return reinterpret_cast<const SearchStateInfo*>(records_ +
+                                                    offsets_[state]);
+  }
+
+  int Start() const { return header_->start; }
+
+  int NumStates() const { return header_->num_states; }
+
+  int64 NumArcs() const { return header_->num_arcs; }
+
+  // Size of the mapping in bytes
+  size_t Size() const { return file_->Size(); }
+
+ private:
+  explicit CompiledSearchGraph(MappedFile* file) : file_(file) {
+    const char* data = file->Data();
+    header_ = reinterpret_cast<const CompiledSearchGraphHeader*>(data);
+    offsets_ = reinterpret_cast<const int64*>(header_ + 1);
+    records_ = reinterpret_cast<const char*>(offsets_ + header_->num_states);
+  }
+
+  // Only the header and the overall size are checked, the offsets are
+  // trusted so mapping the graph does not touch every page
+  bool Verify(const std::string& filename) const {
+    if (header_->magic != kCompiledSearchGraphMagic) {
+      LOG(ERROR) << "Not a compiled search graph : " << filename;
+      return false;
+    }
+    if (header_->version != kCompiledSearchGraphVersion) {
+      LOG(ERROR) << "Compiled search graph version " << header_->version
+                 << " is not supported, expected version "
+                 << kCompiledSearchGraphVersion << " : " << filename;
+      return false;
+    }
+    if (header_->num_states < 0 || header_->records_size < 0 ||
+        file_->Size() != sizeof(CompiledSearchGraphHeader) +
+        header_->num_states * sizeof(int64) + header_->records_size) {
+      LOG(ERROR) << "Compiled search graph is corrupt : " << filename;
+      return false;
+    }
+    if (header_->start < 0 || header_->start >= header_->num_states) {
+      LOG(ERROR) << "Compiled search graph has no valid start state : "
+                 << filename;
+      return false;
+    }
+    return true;
+  }
+
+  MappedFile* file_;
+  const CompiledSearchGraphHeader* header_;
+  const int64* offsets_;  // Indexed by state id
+  const char* records_;
+  DISALLOW_COPY_AND_ASSIGN(CompiledSearchGraph);
+};
+
+}  // namespace dcd
+
+#endif  // DCD_COMPILED_SEARCH_GRAPH_H__
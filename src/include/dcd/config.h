@@ -38,6 +38,13 @@
   #define PROFILE_BEGIN(Param);
 #endif
 
+// Hint that the cache line holding addr will be read soon
+#if defined(__GNUC__)
+  #define DCD_PREFETCH(addr) __builtin_prefetch((addr))
+#else
+  #define DCD_PREFETCH(addr)
+#endif
+
 
 
 
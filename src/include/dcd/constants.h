@@ -28,14 +28,44 @@ const float kMaxCost = std::numeric_limits<int>::max();
 const float kMinCost = std::numeric_limits<int>::min();
 const float kDefaultBeam = kMaxCost;
 const int kMaxArcs = std::numeric_limits<int>::max();
+const float kDefaultBeamDelta = 0.5;
+const int kDefaultHistogramBins = 512;
+const int kDefaultLookaheadFrames = 3;
 const float kDefaultAcousticScale = 0.1;
 const float kDefaultTranScale = 0.1;
 const int kDefaultGcPeriod = 25;
+const int kDefaultGcFullPeriod = 8;
 const int kDefaultActiveListSize = 10000;
+const int kDefaultMinArcsPerThread = 2000;
+const int kDefaultArcOrderPeriod = 10;
+const int kMaxEpsilonClosureSize = 1024;
+const int kMaxDirectSearchStates = 1 << 24;
+const int kDefaultSearchTableSize = 1 << 14;
+const int kDefaultComposeCacheSize = 128;  // MB
+const int kDefaultGraphCacheSize = 512;  // MB
+const int kDefaultRescoreCacheSize = 64;  // MB
+const float kGraphCacheLowWater = 0.9;  // Fraction of the limit after a trim
 
 const int kMegaByte = 1024 * 1024;
 const int kKiloByte = 1024;
 
+const int kDefaultSearchArenaSlabSize = kMegaByte;
+const int kSearchArenaAlignment = 16;
+const int kLatticeChunkBits = 12;  // 4096 lattice states or arcs per chunk
+
+// Compiled search graph files, see compiled-search-graph.h
+const int kCompiledSearchGraphMagic = 0x67646364;  // "dcdg"
+const int kCompiledSearchGraphVersion = 2;
+
+// Binary transition model files, see hmm-transition-model.h
+const int kTransModelMagic = 0x6d686364;  // "dchm"
+const int kTransModelVersion = 1;
+const int kTransModelAlignment = 64;
+
+// Search profiles written by SimpleStatistics, see search-statistics.h
+const int kSearchProfileMagic = 0x70736364;  // "dcsp"
+const int kSearchProfileVersion = 1;
+
 // Flags for final state mode. After decoding we can require final states,
 // backoff to non-final final or always allow non-final
 const int kRequireFinal = 1;
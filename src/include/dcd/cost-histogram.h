@@ -0,0 +1,105 @@
+// cost-histogram.h
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// Fixed size histogram of the costs of the active arcs. The pruning cutoffs
+// for a target number of active arcs are read from the cumulative counts in
+// O(bins) instead of partially sorting the costs of every frame. A cutoff is
+// only as accurate as the bin width, (max - min) / bins.
+
+#ifndef DCD_COST_HISTOGRAM_H__
+#define DCD_COST_HISTOGRAM_H__
+
+#include <algorithm>
+#include <vector>
+
+#include <fst/compat.h>
+
+#include <dcd/constants.h>
+
+namespace dcd {
+
+class CostHistogram {
+ public:
+  explicit CostHistogram(int num_bins = kDefaultHistogramBins)
+      : counts_(std::max(num_bins, 1), 0), min_cost_(0), width_(0),
+        scale_(0), num_costs_(0) { }
+
+  // Empty the histogram and spread the bins over [min_cost, max_cost],
+  // costs outside the range are counted in the first or last bin
+  void Reset(float min_cost, float max_cost) {
+    std::fill(counts_.begin(), counts_.end(), 0);
+    num_costs_ = 0;
+    min_cost_ = min_cost;
+    width_ = max_cost > min_cost ? (max_cost - min_cost) / counts_.size() : 0;
+    scale_ = width_ > 0 ? 1.0f / width_ : 0;
+  }
+
+  inline void Add(float cost) {
+    int bin = static_cast<int>((cost - min_cost_) * scale_);
+    bin = std::max(0, std::min(bin, static_cast<int>(counts_.size()) - 1));
+    ++counts_[bin];
+    ++num_costs_;
+  }
+
+  // Cutoff for keeping about n of the costs, kMaxCost when there are no
+  // more than n costs. The bin holding the n-th cost is kept whole, so at
+  // least n and at most n plus the count of that bin are at or below it
+  float LowerCutoff(int n) const {
+    if (num_costs_ <= n)
+      return kMaxCost;
+    int count = 0;
+    int i = 0;
+    for (; i != counts_.size(); ++i) {
+      count += counts_[i];
+      if (count > n)
+        break;
+    }
+    // The last bin also holds the costs above the range
+    if (i + 1 == counts_.size())
+      return kMaxCost;
+    return min_cost_ + (i + 1) * width_;
+  }
+
+  // Cutoff that keeps at least n of the costs below it, kMaxCost when there
+  // are fewer than n costs
+  float UpperCutoff(int n) const {
+    if (num_costs_ < n)
+      return kMaxCost;
+    int count = 0;
+    for (int i = 0; i != counts_.size() - 1; ++i) {
+      count += counts_[i];
+      if (count >= n)
+        return min_cost_ + (i + 1) * width_;
+    }
+    return kMaxCost;
+  }
+
+  int NumCosts() const { return num_costs_; }
+
+  int NumBins() const { return counts_.size(); }
+
+ private:
+  std::vector<int> counts_;
+  float min_cost_;  // Lower edge of the first bin
+  float width_;  // Width of a bin
+  float scale_;  // Inverse of the bin width
+  int num_costs_;
+  DISALLOW_COPY_AND_ASSIGN(CostHistogram);
+};
+
+}  // namespace dcd
+
+#endif  // DCD_COST_HISTOGRAM_H__
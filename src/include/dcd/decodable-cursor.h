@@ -0,0 +1,210 @@
+// decodable-cursor.h
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// Per-utterance position in a decodable. The transition models only hold
+// read-only tables, everything that changes while an utterance is decoded
+// lives in the cursor so one model can be shared between several decoders.
+// The cursor can optionally cache the scaled acoustic scores of the current
+// frame, so arcs sharing a pdf only pay for one LogLikelihood call.
+// Decodables fed from a live stream report the frames received so far with
+// NumFramesReady and only return true from IsLastFrame once the input ends.
+// With acoustic_lookahead the cursor also keeps a fast match table, for each
+// pdf group the sum of the best scaled score of the group over the next
+// lookahead_frames frames. The minimum of every frame is computed once and
+// kept in a ring of lookahead_frames rows.
+
+#ifndef DCD_DECODABLE_CURSOR_H__
+#define DCD_DECODABLE_CURSOR_H__
+
+#include <algorithm>
+#include <vector>
+
+#include <fst/compat.h>
+
+#include <dcd/constants.h>
+#include <dcd/search-opts.h>
+
+namespace dcd {
+
+// Acoustic score cache modes, selected with --score_cache
+const int kNoScoreCache = 0;  // Call the decodable for every score
+const int kDenseScoreCache = 1;  // Prescale the whole frame on Next()
+const int kLazyScoreCache = 2;  // Fill the frame on demand
+
+template<class D>
+class DecodableCursor {
+ public:
+  typedef D Decodable;
+
+  DecodableCursor()
+      : decodable_(0), index_(0), filled_(-1), acoustic_scale_(0.0f),
+        cache_mode_(kNoScoreCache), lookahead_frames_(0),
+        lookahead_scale_(0.0f), lookahead_index_(-1), num_groups_(0) { }
+
+  // Map the zero based decodable indexes to lookahead groups, for example
+  // the context independent phone of each pdf. Without a map every pdf is
+  // its own group. The map is checked against the decodable in SetInput
+  void SetLookaheadGroups(const std::vector<int>& groups) {
+    groups_ = groups;
+  }
+
+  // Attach the cursor to the first frame of a new input
+  void SetInput(Decodable* decodable, const SearchOptions& opts) {
+    decodable_ = decodable;
+    index_ = 0;
+    filled_ = -1;
+    acoustic_scale_ = opts.acoustic_scale;
+    cache_mode_ = opts.score_cache;
+    // The lazy cache is written from Score() so it can't be used while
+    // several threads are expanding arcs of the same frame
+    if (cache_mode_ == kLazyScoreCache && opts.arc_threads > 1)
+      cache_mode_ = kDenseScoreCache;
+    if (cache_mode_ != kNoScoreCache)
+      scores_.resize(decodable_->NumIndices());
+    if (cache_mode_ == kLazyScoreCache)
+      stamps_.assign(scores_.size(), -1);
+    if (cache_mode_ == kDenseScoreCache && NumFramesReady() > 0)
+      FillFrame();
+    lookahead_frames_ = opts.acoustic_lookahead > 0.0f ?
+      std::max(opts.lookahead_frames, 1) : 0;
+    lookahead_scale_ = opts.acoustic_lookahead;
+    lookahead_index_ = -1;
+    if (lookahead_frames_) {
+      num_groups_ = decodable_->NumIndices();
+      if (!groups_.empty()) {
+        // Every decodable index is looked up in the map
+        if (groups_.size() < num_groups_)
+          LOG(FATAL) << "Lookahead groups cover " << groups_.size()
+                     << " pdfs but the decodable has " << num_groups_;
+        if (*std::min_element(groups_.begin(), groups_.end()) < 0)
+          LOG(FATAL) << "Lookahead groups must not be negative";
+        num_groups_ = *std::max_element(groups_.begin(), groups_.end()) + 1;
+      }
+      lookahead_.assign(num_groups_, 0.0f);
+      lookahead_rows_.resize(lookahead_frames_ * num_groups_);
+      lookahead_row_frames_.assign(lookahead_frames_, -1);
+    }
+  }
+
+  int Next() {
+    ++index_;
+    if (cache_mode_ == kDenseScoreCache && !Done() &&
+        index_ < NumFramesReady())
+      FillFrame();
+    return index_;
+  }
+
+  // Fill the dense cache if the current frame had not arrived yet when the
+  // cursor moved to it
+  void PrepareFrame() {
+    if (cache_mode_ == kDenseScoreCache && filled_ != index_)
+      FillFrame();
+    if (lookahead_frames_ && lookahead_index_ != index_)
+      FillLookahead();
+  }
+
+  bool Done() const { return decodable_->IsLastFrame(index_); }
+
+  // Number of frames received so far, can grow while decoding a stream
+  int NumFramesReady() const { return decodable_->NumFramesReady(); }
+
+  // Returns the scaled acoustic cost of slabel in the current frame
+  // State labels are one based and the decodable indexes are zero based
+  inline float Score(int slabel) const {
+    switch (cache_mode_) {
+      case kDenseScoreCache:
+        return scores_[slabel - 1];
+      case kLazyScoreCache:
+        if (stamps_[slabel - 1] != index_) {
+          scores_[slabel - 1] = -decodable_->LogLikelihood(index_, slabel - 1)
+              * acoustic_scale_;
+          stamps_[slabel - 1] = index_;
+        }
+        return scores_[slabel - 1];
+    }
+    return -decodable_->LogLikelihood(index_, slabel - 1) * acoustic_scale_;
+  }
+
+  inline float Score(int index, int slabel) const {
+    return -decodable_->LogLikelihood(index, slabel - 1) * acoustic_scale_;
+  }
+
+  bool HasLookahead() const { return lookahead_frames_ != 0; }
+
+  // Weighted best cost of the group of slabel over the frames following the
+  // current one, only valid after PrepareFrame
+  inline float Lookahead(int slabel) const {
+    return lookahead_[groups_.empty() ? slabel - 1 : groups_[slabel - 1]];
+  }
+
+  int Index() const { return index_; }
+
+  float AcousticScale() const { return acoustic_scale_; }
+
+  Decodable* GetDecodable() const { return decodable_; }
+
+ private:
+  // Score the whole of the current frame
+  void FillFrame() {
+    for (int i = 0; i != scores_.size(); ++i)
+      scores_[i] = -decodable_->LogLikelihood(index_, i) * acoustic_scale_;
+    filled_ = index_;
+  }
+
+  // Sum the per group minimum of the frames after the current one, the
+  // frames that haven't arrived yet are left out
+  void FillLookahead() {
+    int end = std::min(index_ + lookahead_frames_, NumFramesReady() - 1);
+    std::fill(lookahead_.begin(), lookahead_.end(), 0.0f);
+    for (int f = index_ + 1; f <= end; ++f) {
+      int r = f % lookahead_frames_;
+      float* row = &lookahead_rows_[r * num_groups_];
+      if (lookahead_row_frames_[r] != f) {
+        std::fill(row, row + num_groups_, kMaxCost);
+        int num_indices = decodable_->NumIndices();
+        for (int i = 0; i != num_indices; ++i) {
+          int g = groups_.empty() ? i : groups_[i];
+          row[g] = std::min(row[g], -decodable_->LogLikelihood(f, i) *
+                            acoustic_scale_);
+        }
+        lookahead_row_frames_[r] = f;
+      }
+      for (int g = 0; g != num_groups_; ++g)
+        lookahead_[g] += row[g] * lookahead_scale_;
+    }
+    lookahead_index_ = index_;
+  }
+
+  Decodable* decodable_;
+  int index_;  // Current frame number
+  int filled_;  // Frame held in the dense cache
+  float acoustic_scale_;
+  int cache_mode_;
+  mutable std::vector<float> scores_;  // Scaled scores of the current frame
+  mutable std::vector<int> stamps_;  // Frame each lazy score was computed
+  int lookahead_frames_;  // Frames summed by the lookahead, 0 if disabled
+  float lookahead_scale_;  // Weight of the lookahead cost
+  int lookahead_index_;  // Frame the lookahead table was filled for
+  int num_groups_;
+  std::vector<int> groups_;  // Lookahead group of each decodable index
+  std::vector<float> lookahead_;  // Weighted lookahead cost per group
+  std::vector<float> lookahead_rows_;  // Best score per group and frame
+  std::vector<int> lookahead_row_frames_;  // Frame held in each row
+};
+
+}  // namespace dcd
+
+#endif  // DCD_DECODABLE_CURSOR_H__
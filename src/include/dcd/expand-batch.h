@@ -0,0 +1,199 @@
+// expand-batch.h
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// Batched token expansion for the active arcs of a frame. The left-to-right
+// (Bakis) arcs are gathered into structure of arrays buffers and advanced
+// with a single min-plus kernel. The kernel uses AVX2 or SSE4.1 when the
+// compiler targets them (e.g. -mavx2 or -march=native) and a scalar loop
+// otherwise.
+
+#ifndef DCD_EXPAND_BATCH_H__
+#define DCD_EXPAND_BATCH_H__
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#include <dcd/constants.h>
+
+namespace dcd {
+
+// Number of emitting states in a left-to-right HMM
+const int kBakisNumStates = 3;
+
+// Structure of arrays buffers for the left-to-right arcs in a batch. Token i
+// of arc k is stored at [i][k], token 0 is the entry token
+struct BakisBatch {
+  void Resize(int n) {
+    size = n;
+    for (int i = 0; i <= kBakisNumStates; ++i) {
+      costs[i].resize(n);
+      active[i].resize(n);
+    }
+    for (int i = 1; i <= kBakisNumStates; ++i) {
+      loop_weights[i].resize(n);
+      prev_weights[i].resize(n);
+      am_costs[i].resize(n);
+      take_prev[i].resize(n);
+    }
+    best.resize(n);
+  }
+
+  int size;
+  std::vector<float> costs[kBakisNumStates + 1];
+  std::vector<int> active[kBakisNumStates + 1];  // All bits set if active
+  std::vector<float> loop_weights[kBakisNumStates + 1];
+  std::vector<float> prev_weights[kBakisNumStates + 1];
+  std::vector<float> am_costs[kBakisNumStates + 1];
+  std::vector<int> take_prev[kBakisNumStates + 1];  // Token came from i - 1
+  std::vector<float> best;  // Best token cost in each arc
+};
+
+// The active arcs handed to the transition model in one call. T is the
+// token type of the decoder
+template<class T>
+struct ArcBatch {
+  typedef T Token;
+  typedef std::pair<float, float> FloatPair;
+
+  void Clear() {
+    ilabels.clear();
+    tokens.clear();
+  }
+
+  void Add(int ilabel, Token* t) {
+    ilabels.push_back(ilabel);
+    tokens.push_back(t);
+  }
+
+  int Size() const { return ilabels.size(); }
+
+  std::vector<int> ilabels;
+  std::vector<Token*> tokens;
+  std::vector<FloatPair> costs;  // Best cost and lookahead cost per arc
+  std::vector<int> bakis;  // Positions of the left-to-right arcs
+  BakisBatch soa;
+};
+
+// Advance the tokens of every arc in the batch by one frame. For each
+// emitting state i, working from the last state backwards
+//   loop = cost[i] + loop_weight[i] + am[i]
+//   prev = cost[i - 1] + prev_weight[i] + am[i]
+// the new cost is min(loop, prev), ties go to prev like the scalar
+// expansion. States with no active token in i or i - 1 are left untouched.
+inline void ExpandBakisKernel(BakisBatch* b) {
+  int n = b->size;
+  if (!n)
+    return;
+  float* best = &b->best[0];
+  int k = 0;
+#if defined(__AVX2__)
+  for (; k + 8 <= n; k += 8)
+    _mm256_storeu_ps(best + k, _mm256_set1_ps(kMaxCost));
+  for (int i = kBakisNumStates; i > 0; --i) {
+    const float* c = &b->costs[i][0];
+    const float* cp = &b->costs[i - 1][0];
+    const int* a = &b->active[i][0];
+    const int* ap = &b->active[i - 1][0];
+    const float* wl = &b->loop_weights[i][0];
+    const float* wp = &b->prev_weights[i][0];
+    const float* am = &b->am_costs[i][0];
+    float* out = &b->costs[i][0];
+    int* tp = &b->take_prev[i][0];
+    for (int j = 0; j + 8 <= n; j += 8) {
+      __m256 cost = _mm256_loadu_ps(c + j);
+      __m256 score = _mm256_loadu_ps(am + j);
+      __m256 loop = _mm256_add_ps(_mm256_add_ps(cost,
+            _mm256_loadu_ps(wl + j)), score);
+      __m256 prev = _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(cp + j),
+            _mm256_loadu_ps(wp + j)), score);
+      __m256 act = _mm256_castsi256_ps(_mm256_or_si256(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + j)),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ap + j))));
+      __m256 lt = _mm256_cmp_ps(loop, prev, _CMP_LT_OQ);
+      // min returns the second operand on ties
+      __m256 next = _mm256_min_ps(loop, prev);
+      _mm256_storeu_ps(out + j, _mm256_blendv_ps(cost, next, act));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(tp + j),
+                          _mm256_castps_si256(_mm256_andnot_ps(lt, act)));
+      __m256 cand = _mm256_blendv_ps(_mm256_set1_ps(kMaxCost), next, act);
+      _mm256_storeu_ps(best + j, _mm256_min_ps(_mm256_loadu_ps(best + j),
+                                               cand));
+    }
+  }
+#elif defined(__SSE4_1__)
+  for (; k + 4 <= n; k += 4)
+    _mm_storeu_ps(best + k, _mm_set1_ps(kMaxCost));
+  for (int i = kBakisNumStates; i > 0; --i) {
+    const float* c = &b->costs[i][0];
+    const float* cp = &b->costs[i - 1][0];
+    const int* a = &b->active[i][0];
+    const int* ap = &b->active[i - 1][0];
+    const float* wl = &b->loop_weights[i][0];
+    const float* wp = &b->prev_weights[i][0];
+    const float* am = &b->am_costs[i][0];
+    float* out = &b->costs[i][0];
+    int* tp = &b->take_prev[i][0];
+    for (int j = 0; j + 4 <= n; j += 4) {
+      __m128 cost = _mm_loadu_ps(c + j);
+      __m128 score = _mm_loadu_ps(am + j);
+      __m128 loop = _mm_add_ps(_mm_add_ps(cost, _mm_loadu_ps(wl + j)), score);
+      __m128 prev = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(cp + j),
+            _mm_loadu_ps(wp + j)), score);
+      __m128 act = _mm_castsi128_ps(_mm_or_si128(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + j)),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(ap + j))));
+      __m128 lt = _mm_cmplt_ps(loop, prev);
+      // min returns the second operand on ties
+      __m128 next = _mm_min_ps(loop, prev);
+      _mm_storeu_ps(out + j, _mm_blendv_ps(cost, next, act));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(tp + j),
+                       _mm_castps_si128(_mm_andnot_ps(lt, act)));
+      __m128 cand = _mm_blendv_ps(_mm_set1_ps(kMaxCost), next, act);
+      _mm_storeu_ps(best + j, _mm_min_ps(_mm_loadu_ps(best + j), cand));
+    }
+  }
+#endif
+  // Scalar loop for the tail of the batch or the whole batch when no
+  // vector instructions are available
+  for (int j = k; j != n; ++j)
+    best[j] = kMaxCost;
+  for (int i = kBakisNumStates; i > 0; --i) {
+    for (int j = k; j != n; ++j) {
+      b->take_prev[i][j] = 0;
+      if (b->active[i][j] || b->active[i - 1][j]) {
+        float am = b->am_costs[i][j];
+        float loop = b->costs[i][j] + b->loop_weights[i][j] + am;
+        float prev = b->costs[i - 1][j] + b->prev_weights[i][j] + am;
+        if (loop < prev) {
+          b->costs[i][j] = loop;
+        } else {
+          b->costs[i][j] = prev;
+          b->take_prev[i][j] = -1;
+        }
+        best[j] = std::min(best[j], b->costs[i][j]);
+      }
+    }
+  }
+}
+
+}  // namespace dcd
+
+#endif  // DCD_EXPAND_BATCH_H__
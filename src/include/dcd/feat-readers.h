@@ -23,6 +23,7 @@
 #define DCD_FEAT_READERS_H__
 
 #include <algorithm>
+#include <cassert>
 #include <cstdlib>
 #include <fstream>
 #include <limits>
@@ -54,8 +55,15 @@ class Matrix {
   explicit Matrix(const std::vector<std::vector<T> >& data)
       : data_(data) { }
 
+  // Deep copy, used to hand the current utterance over to another thread
+  // before the reader moves on to the next one
+  explicit Matrix(const Matrix& other)
+      : data_(other.data_) { }
+
   int NumRows() const { return data_.size(); }
 
+  int NumCols() const { return data_.empty() ? 0 : data_[0].size(); }
+
   const std::vector<T>& Row(int i) const { return data_[i]; }
 
   void ReserveRows(int i) { data_.reserve(i); }
@@ -72,7 +80,7 @@ class Matrix {
 
  private:
   std::vector<std::vector<T> > data_;
-  DISALLOW_COPY_AND_ASSIGN(Matrix);
+  void operator=(const Matrix&);
 };
 
 
@@ -216,6 +224,10 @@ class SimpleDecodable {
 
   int NumFrames() const { return matrix_.NumRows(); }
 
+  int NumFramesReady() const { return matrix_.NumRows(); }
+
+  int NumIndices() const { return matrix_.NumCols(); }
+
   bool IsLastFrame(int frame) const { return (matrix_.NumRows() - 1 == frame); }
 
   const Matrix<float> &matrix_;
@@ -223,6 +235,51 @@ class SimpleDecodable {
   DISALLOW_COPY_AND_ASSIGN(SimpleDecodable);
 };
 
+// Decodable for a live stream, the frames are appended as they arrive and
+// the decoder can be advanced over the frames received so far. The last
+// frame is only known once InputFinished has been called. Frames must not
+// be appended while the decoder is reading from another thread. Like the
+// other decodables the scores are used as given, the acoustic scale is
+// applied by the decoder
+class StreamingDecodable {
+ public:
+  explicit StreamingDecodable(int num_indices)
+      : num_indices_(num_indices), finished_(false) { }
+
+  void AcceptFrame(const vector<float>& frame) {
+    assert(frame.size() == num_indices_);
+    matrix_.PushRow(frame);
+  }
+
+  void AcceptFrames(const Matrix<float>& frames) {
+    for (int i = 0; i != frames.NumRows(); ++i)
+      AcceptFrame(frames.Row(i));
+  }
+
+  // No more frames will arrive
+  void InputFinished() { finished_ = true; }
+
+  float LogLikelihood(int frame, int index) const {
+    return matrix_(frame, index);
+  }
+
+  int NumFrames() const { return matrix_.NumRows(); }
+
+  int NumFramesReady() const { return matrix_.NumRows(); }
+
+  int NumIndices() const { return num_indices_; }
+
+  bool IsLastFrame(int frame) const {
+    return finished_ && matrix_.NumRows() - 1 == frame;
+  }
+
+ private:
+  Matrix<float> matrix_;
+  int num_indices_;
+  bool finished_;
+  DISALLOW_COPY_AND_ASSIGN(StreamingDecodable);
+};
+
 // This class is a  decodable that will accumulate state hit statistics
 class SimpleDecodableHitStats {
  public:
@@ -271,6 +328,10 @@ class SimpleDecodableHitStats {
 
   int NumFrames() const { return matrix_.NumRows(); }
 
+  int NumFramesReady() const { return matrix_.NumRows(); }
+
+  int NumIndices() const { return matrix_.NumCols(); }
+
   bool IsLastFrame(int frame) const { return (matrix_.NumRows() - 1 == frame); }
 
   const Matrix<float>& matrix_;
@@ -24,6 +24,9 @@
 #include <iostream>
 #include <utility>
 
+#include <dcd/config.h>
+#include <dcd/decodable-cursor.h>
+#include <dcd/expand-batch.h>
 #include <dcd/lattice.h>
 #include <dcd/token.h>
 #include <dcd/utils.h>
@@ -39,11 +42,11 @@ using fst::StdFst;
 template<class F>
 class GenericTransitionModel {
  private:
-  GenericTransitionModel()
-      : acoustic_scale_(1.0f) { }
+  GenericTransitionModel() { }
 
  public:
   typedef F FrontEnd;
+  typedef DecodableCursor<F> Cursor;
   static GenericTransitionModel* ReadFsts(const std::string& path,
                                           float scale = 1.0f) {
     GenericTransitionModel *mdl = new GenericTransitionModel;
@@ -74,19 +77,6 @@ class GenericTransitionModel {
   // Test that an input label is valid
   bool IsValidILabel(int ilabel) const { return ilabel < fsts_.size(); }
 
-  void SetInput(FrontEnd* frontend,
-                const SearchOptions &opts) {
-    acoustic_scale_ = opts.acoustic_scale;
-    frontend_ = frontend;
-    index_ = 0;
-  }
-
-  int Next() {
-    return ++index_;
-  }
-
-  bool Done() { return frontend_->IsLastFrame(index_); }
-
   // Inform the decoder of an epsilon like label
   bool IsNonEmitting(int ilabel) const { return ilabel == 0; }
 
@@ -97,9 +87,11 @@ class GenericTransitionModel {
 
   int NumTypes() const { return fsts_.size(); }
 
+  int NumHmms() const { return fsts_.size(); }
+
   template<class Token>
   void GetActiveStates(int ilabel, const Token* tokens,
-                       vector<pair<int, float> >* costs) {
+                       vector<pair<int, float> >* costs) const {
   const StdFst& topo = *fsts_[ilabel];
   int numstates = num_states_[ilabel];
   for (int i = 0; i != numstates - 1; ++i) {
@@ -114,30 +106,35 @@ class GenericTransitionModel {
   }
 
 
-  // Remove this, it is too expensive to use in practise
-  float AcousticLookahead(int ilabel, int time) {
-    if (frontend_->IsLastFrame(time))
-      return 0;
-    float lookahead = 0;
+  // Fast match lookahead of a topology, the best lookahead of the labels on
+  // its arcs. The lookahead table is filled once per frame by the cursor
+  float Lookahead(const Cursor& cursor, int ilabel) const {
+    float lookahead = kMaxCost;
     const StdFst& topo = *fsts_[ilabel];
     int numstates = num_states_[ilabel];
     for (int i = 0; i != numstates - 1; ++i) {
       for (ArcIterator<StdFst> aiter(topo, i); !aiter.Done(); aiter.Next()) {
         const StdArc& arc = aiter.Value();
-        lookahead = max(lookahead, StateCost(time + 1, arc.ilabel));
+        if (arc.ilabel)
+          lookahead = min(lookahead, cursor.Lookahead(arc.ilabel));
       }
     }
-    return lookahead;
+    return lookahead < kMaxCost ? lookahead : 0.0f;
+  }
+
+  // Start loading the topology Expand walks for the ilabel
+  void Prefetch(int ilabel) const {
+    DCD_PREFETCH(fsts_[ilabel]);
   }
 
   // Expand the tokens in the arc or (sub network)
   template<class Options>
-  pair<float, float> Expand(int ilabel, Options* opts) {
+  pair<float, float> Expand(int ilabel, Options* opts) const {
     typedef typename Options::Token Token;
+    const Cursor& cursor = *opts->cursor_;
     const StdFst& topo = *fsts_[ilabel];
     int numstates = num_states_[ilabel];
     float bestcost = kMaxCost;
-    float nextbestcost = kMaxCost;
     Token *tokens = opts->tokens_;
     Token *nexttokens = opts->scratch_;
     for (int i = 0; i < numstates; ++i)
@@ -147,23 +144,16 @@ class GenericTransitionModel {
       if (tokens[i].Active()) {
         for (ArcIterator<StdFst> aiter(topo, i); !aiter.Done(); aiter.Next()) {
           const StdArc& arc = aiter.Value();
-          float extend = arc.weight.Value() + StateCost(arc.ilabel);
+          float extend = arc.weight.Value() + cursor.Score(arc.ilabel);
           //float ls =  frontend_->IsLastFrame(index_) ? kMaxCost
           //  : tokens[i].Cost() +  extend + arc.weight.Value() +
           //  StateCost(index_ + 1, arc.ilabel);
           float cost = nexttokens[arc.nextstate].Combine(tokens[i], extend);
-          float ncost = kMaxCost;  // cost + extend * opts.acoustic_lookahead;
-          //float ncost = frontend_->IsLastFrame(index_) ? 0 :
-          //StateCost(index_+ 1, arc.ilabel);
-          if (cost > opts->threshold_ || ncost > opts->lthreshold_) {
+          if (cost > opts->threshold_) {
             //Maybe this doesn't help efficiency very much
             nexttokens[arc.nextstate].Clear();
           } else {
             bestcost = min(bestcost, cost);
-            nextbestcost = max(nextbestcost, ncost);
-            //nextbestcost = min(nextbestcost, ls);
-            //nextbestcost = min(nextbestcost,
-            //cost + extend * opts.acoustic_lookahead);
           }
         }
       }
@@ -171,7 +161,22 @@ class GenericTransitionModel {
 
     for (int i = 0; i != numstates; ++i)
       tokens[i] = nexttokens[i];
-    return pair<float, float>(bestcost, nextbestcost);
+    float lookahead_cost = kMaxCost;
+    if (cursor.HasLookahead() && bestcost < kMaxCost)
+      lookahead_cost = bestcost + Lookahead(cursor, ilabel);
+    return pair<float, float>(bestcost, lookahead_cost);
+  }
+
+  // No specialised kernels for arbitrary topologies, expand the arcs in the
+  // batch one at a time
+  template<class Options>
+  void ExpandBatch(ArcBatch<typename Options::Token>* batch,
+                   Options* opts) const {
+    batch->costs.resize(batch->Size());
+    for (int k = 0; k != batch->Size(); ++k) {
+      opts->tokens_ = batch->tokens[k];
+      batch->costs[k] = Expand(batch->ilabels[k], opts);
+    }
   }
 
   static const string &Type() {
@@ -180,17 +185,6 @@ class GenericTransitionModel {
   }
 
  protected:
-  inline float StateCost(int slabel) {
-    return -frontend_->LogLikelihood(index_, slabel - 1) * acoustic_scale_;
-  }
-
-  inline float StateCost(int index, int slabel) {
-    return -frontend_->LogLikelihood(index, slabel - 1) * acoustic_scale_;
-  }
-
-  FrontEnd *frontend_;
-  int index_;
-  float acoustic_scale_;
   vector<const StdFst*> fsts_;
   vector<int> num_states_;
 };
@@ -21,6 +21,8 @@
 #define DCD_HMM_TRANSITION_MODEL_H__
 
 #include <algorithm>
+#include <cassert>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <set>
@@ -31,7 +33,10 @@
 #include <fst/extensions/far/far.h>
 
 #include <dcd/config.h>
+#include <dcd/decodable-cursor.h>
+#include <dcd/expand-batch.h>
 #include <dcd/lattice.h>
+#include <dcd/mapped-file.h>
 #include <dcd/token.h>
 #include <dcd/utils.h>
 #include <dcd/constants.h>
@@ -57,60 +62,130 @@ const int kErgodic = 3;
 // typedef TokenTpl<Lattice::LatticeState*> Token;
 // This class encapsulates the left-to-right
 // or ergodic transition model used in Kaldi's silence
+// The model is read-only once loaded, the per-utterance frame position and
+// acoustic scale are kept in a DecodableCursor owned by each decoder so a
+// single model can be shared between decoding threads.
+//
+// All the HMMs are held in flat tables indexed through the per HMM offsets.
+// The tables are either built in memory from the arc type Fsts or point
+// into a mapped binary model written by Write. The binary layout is a
+// HMMTransitionModelHeader followed by the tables in the order of
+// TableSizes, each starting on a kTransModelAlignment byte boundary.
+struct HMMTransitionModelHeader {
+  int32 magic;
+  int32 version;
+  int32 num_hmms;
+  int32 num_eps;
+  int32 num_bakis;
+  int32 num_ergodic;
+  int32 total_num_states;
+  int32 num_weights;  // Arcs of all the HMMs including the sentinels
+  int32 num_state_slots;  // States with arcs including the sentinels
+  int32 num_state_labels;
+  int32 num_eps_labels;
+  float trans_scale;  // Scale already applied to the weights
+  uint32 checksum;  // Of the tables
+  int32 reserved[3];
+};
+
 template<class Decodable>
 class HMMTransitionModel {
   typedef pair<float, float> FloatPair;
   HMMTransitionModel()
-      : num_hmms_(0), total_num_states_(0), acoustic_scale_(0.0f),
-      hmm_syms_("hmmsyms") { }
+      : num_hmms_(0), num_eps_(0), num_bakis_(0), num_ergodic_(0),
+        total_num_states_(0), num_weights_(0), num_state_slots_(0),
+        num_state_labels_(0), num_eps_labels_(0), trans_scale_(1.0f),
+        types_(0), weight_offsets_(0), state_offsets_(0), num_states_(0),
+        weights_(0), next_states_(0), state_labels_(0), arc_counts_(0),
+        tables_(0), file_(0), hmm_syms_("hmmsyms") { }
 
  public:
   typedef Decodable FrontEnd;
+  typedef DecodableCursor<Decodable> Cursor;
   virtual ~HMMTransitionModel() {
-    for (int i = 0; i != fsts_.size(); ++i)
-      delete fsts_[i];
+    if (tables_)
+      delete tables_;
+    if (file_)
+      delete file_;
   }
 
+  // Maps a binary model written by Write, the tables are used in place and
+  // shared with every other process mapping the same file
   static HMMTransitionModel* Read(const string& path) {
-    ifstream ifs(path.c_str(), ifstream::binary);
-    if (!ifs.is_open())
+    MappedFile* file = MappedFile::Map(path,
+                                       sizeof(HMMTransitionModelHeader));
+    if (!file)
       return 0;
-    return Read(&ifs);
+    HMMTransitionModel* mdl = new HMMTransitionModel;
+    mdl->file_ = file;
+    if (!mdl->SetTables(file->Data(), file->Size(), path)) {
+      delete mdl;
+      return 0;
+    }
+    return mdl;
   }
 
-  static HMMTransitionModel* Read(istream* strm) {
+  // Reads a binary model from a stream into memory
+  static HMMTransitionModel* Read(istream* strm, const string& source = "") {
+    HMMTransitionModelHeader header;
+    strm->read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!*strm || header.magic != kTransModelMagic ||
+        header.version != kTransModelVersion) {
+      LOG(ERROR) << "Not a binary transition model or unsupported version : "
+                 << source;
+      return 0;
+    }
+    // Check the counts before they size the buffer, a corrupt header must
+    // not make us allocate more than the stream holds
+    size_t size = ValidCounts(header) ? BinarySize(header) : 0;
+    std::streampos begin = strm->tellg();
+    if (size && begin != std::streampos(-1)) {
+      strm->seekg(0, std::ios_base::end);
+      std::streamoff remaining = strm->tellg() - begin;
+      strm->seekg(begin);
+      if (remaining < static_cast<std::streamoff>(size - sizeof(header)))
+        size = 0;
+    }
+    if (!size) {
+      LOG(ERROR) << "Binary transition model is truncated : " << source;
+      return 0;
+    }
     HMMTransitionModel* mdl = new HMMTransitionModel;
-    ReadType(*strm, &mdl->num_hmms_);
-    ReadType(*strm, &mdl->total_num_states_);
-    ReadType(*strm, &mdl->num_eps_);
-    ReadType(*strm, &mdl->num_bakis_);
-    ReadType(*strm, &mdl->num_ergodic_);
-    ReadType(*strm, &mdl->state_labels_);
-    ReadType(*strm, &mdl->state_offsets_);
-    ReadType(*strm, &mdl->weights_);
-    ReadType(*strm, &mdl->weight_offsets_);
-    ReadType(*strm, &mdl->next_states_);
-    ReadType(*strm, &mdl->types_);
+    mdl->buffer_.resize(sizeof(header));
+    memcpy(&mdl->buffer_[0], &header, sizeof(header));
+    // The length of a pipe isn't known, so grow the buffer with the data
+    for (size_t pos = sizeof(header); pos != size && *strm; ) {
+      size_t n = std::min(size - pos, static_cast<size_t>(kMegaByte));
+      mdl->buffer_.resize(pos + n);
+      strm->read(&mdl->buffer_[pos], n);
+      pos += n;
+    }
+    if (!*strm || !mdl->SetTables(&mdl->buffer_[0], size, source)) {
+      delete mdl;
+      return 0;
+    }
     return mdl;
   }
 
-  bool Write(ostream* strm) {
-    // TODO(Paul) add a header
-    WriteType(*strm, num_hmms_);
-    WriteType(*strm, total_num_states_);
-    WriteType(*strm, num_eps_);
-    WriteType(*strm, num_bakis_);
-    WriteType(*strm, num_ergodic_);
-    WriteType(*strm, state_labels_);
-    WriteType(*strm, state_offsets_);
-    WriteType(*strm, weights_);
-    WriteType(*strm, weight_offsets_);
-    WriteType(*strm, next_states_);
-    WriteType(*strm, types_);
-    return true;
+  bool Write(ostream* strm) const {
+    HMMTransitionModelHeader header = Header();
+    const char* tables[kNumTables];
+    size_t sizes[kNumTables];
+    GetTables(tables);
+    TableSizes(header, sizes);
+    header.checksum = TablesChecksum(tables, sizes);
+    const char padding[kTransModelAlignment] = { 0 };
+    strm->write(reinterpret_cast<const char*>(&header), sizeof(header));
+    size_t pos = sizeof(header);
+    for (int i = 0; i != kNumTables; ++i) {
+      strm->write(padding, Align(pos) - pos);
+      strm->write(tables[i], sizes[i]);
+      pos = Align(pos) + sizes[i];
+    }
+    return !strm->fail();
   }
 
-  bool Write(const string& path) {
+  bool Write(const string& path) const {
     ofstream ofs(path.c_str(), ofstream::binary);
     if (!ofs.is_open())
       return false;
@@ -136,8 +211,8 @@ class HMMTransitionModel {
   bool WriteEpsType(ostream& strm, int type) {
     int woffset = weight_offsets_[type];
     int soffset = state_offsets_[type];
-    float* weights = &weights_[woffset];
-    int* labels = &state_labels_[soffset];
+    const float* weights = &weights_[woffset];
+    const int* labels = &state_labels_[soffset];
     strm << "HMM " << type << " 0 1" << endl;
     strm << "0 1 " << labels[0] << " " << weights[0] << endl;
     return false;
@@ -146,8 +221,9 @@ class HMMTransitionModel {
   bool WriteLeftToRightType(ostream& strm, int type) {
     int woffset = weight_offsets_[type];
     int soffset = state_offsets_[type];
-    float* weights = &weights_[woffset + 1];  // Add one extra for the sentinel
-    int* labels = &state_labels_[soffset + 1];
+    // Add one extra for the sentinel
+    const float* weights = &weights_[woffset + 1];
+    const int* labels = &state_labels_[soffset + 1];
     strm << "HMM " << type << " " << 3 << endl;
     for (int j = 0; j != 3; ++j) {
       strm << j << " " << j << " " << *labels << " " << *weights++
@@ -161,9 +237,10 @@ class HMMTransitionModel {
   bool WriteErgodicType(ostream& strm, int type) {
     int woffset = weight_offsets_[type];
     int soffset = state_offsets_[type];
-    float* weights = &weights_[woffset + 1];  // Add one extra for the sentinel
-    int* labels = &state_labels_[soffset + 1];
-    int* next_states = &next_states_[woffset + 1];
+    // Add one extra for the sentinel
+    const float* weights = &weights_[woffset + 1];
+    const int* labels = &state_labels_[soffset + 1];
+    const int* next_states = &next_states_[woffset + 1];
     strm << "HMM " << type << endl;
     int j = 0;
     for (j = 0 ; j != 4; ++j)
@@ -209,172 +286,62 @@ class HMMTransitionModel {
     return model;
   }
 
+  // Reads the arc types from a file of Fsts and scales their weights, or
+  // maps a binary model written by Write. The weights of a binary model are
+  // already scaled, it is rejected if it was written with another scale
   static HMMTransitionModel* ReadFsts(const string& path, float scale) {
     typedef StdArc Arc;
+    if (HasMagicNumber(path, kTransModelMagic)) {
+      HMMTransitionModel* mdl = Read(path);
+      if (mdl && mdl->trans_scale_ != scale) {
+        LOG(ERROR) << "Binary transition model was written with "
+                   << "trans_scale = " << mdl->trans_scale_ << " : " << path;
+        delete mdl;
+        return 0;
+      }
+      return mdl;
+    }
     vector<const Fst<Arc>*> arcs;
     if (!ReadFstArcTypes(path, &arcs, scale, false)) {
       FSTERROR() << "Failed to read FSTs format arc types from : " << path;
       return 0;
     }
     HMMTransitionModel* mdl = FromFsts(arcs);
+    mdl->trans_scale_ = scale;
+    for (int i = 0; i != arcs.size(); ++i)
+      delete arcs[i];
     return mdl;
   }
 
+  // The Fsts are only read while building the tables
   template<class Arc>
   static HMMTransitionModel* FromFsts(const vector<const Fst<Arc>*>& fsts) {
-    int numstates = 0;
-    int numarcs = 0;
-    int numeps = 0;
-    int numbakis = 0;
-    int numergodic = 0;
-    int numhmms = 0;
     HMMTransitionModel* mdl = new HMMTransitionModel;
-    // We assume bakis have three states and ergodic have five states
-    for (int i = 0; i != fsts.size(); ++i) {
-      const Fst<Arc>& fst = *(fsts[i]);
-      int nstates = CountStates(fst);
-      mdl->num_states_.push_back(nstates);
-      numstates += nstates;
-      numarcs += CountArcs(fst);
-      mdl->weight_offsets_.push_back(mdl->weights_.size());
-      mdl->state_offsets_.push_back(mdl->state_labels_.size());
-      switch (nstates) {
-        case 2: ++numeps;
-                mdl->types_.push_back(kEpsilon);
-                break;
-        case 4: ++numbakis;
-                mdl->types_.push_back(kLeftToRight);
-                mdl->weights_.push_back(0.0f);  // Sentinels for token expansion
-                mdl->state_labels_.push_back(-1);
-                mdl->next_states_.push_back(0);
-                break;
-        case 6: ++numergodic;
-                mdl->types_.push_back(kErgodic);
-                mdl->weights_.push_back(0.0f);  // Sentinels for token expansion
-                mdl->state_labels_.push_back(-1);
-                mdl->next_states_.push_back(0);
-                break;
-        default: break;
-      }
-
-      for (int i = 0; i != nstates; ++i) {
-        for (ArcIterator<Fst<Arc> > aiter(fst, i); !aiter.Done();
-             aiter.Next()) {
-          const Arc& arc = aiter.Value();
-          mdl->weights_.push_back(arc.weight.Value());
-          mdl->next_states_.push_back(arc.nextstate);
-          if (aiter.Position() == 0) {
-            mdl->state_labels_.push_back(arc.ilabel);
-            if (nstates == 2)
-              mdl->eps_labels_set_.insert(arc.ilabel);
-            else
-              mdl->state_labels_set_.insert(arc.ilabel);
-          }
-        }
-      }
-    }
-
-    mdl->num_hmms_ = numhmms;
-    mdl->total_num_states_ = numstates;
-    mdl->num_eps_ = numeps;
-    mdl->num_bakis_ = numbakis;
-    mdl->num_ergodic_ = numergodic;
-    mdl->fsts_ = fsts;
-
-    // Sanity check to make sure the arrays were filled correctly
-    int num_states = mdl->num_eps_ + mdl->num_bakis_ * 4 +
-        mdl->num_ergodic_ * 6;
-    assert(num_states == mdl->state_labels_.size());
-
-    // int num_trans = mdl->num_eps_ + mdl->num_bakis_ * 7 +
-    //    mdl->num_ergodic_ * 18;
-
+    mdl->tables_ = new Tables;
+    for (int i = 0; i != fsts.size(); ++i)
+      mdl->AddHmm(*fsts[i]);
+    mdl->SetTables();
     return mdl;
   }
 
   template<class Arc>
   static HMMTransitionModel* ReadFar(FarReader<Arc>* reader) {
-    int numstates = 0;
-    int numarcs = 0;
-    int numeps = 0;
-    int numbakis = 0;
-    int numergodic = 0;
-    int numhmms = 0;
     HMMTransitionModel* mdl = new HMMTransitionModel;
-    // We assume bakis have three states and ergodic have five states
-    for (; !reader->Done(); reader->Next(), ++numhmms) {
-      const string& str = reader->GetKey();
-      mdl->hmm_syms_.AddSymbol(str);
-      const Fst<Arc>& fst = reader->GetFst();
-      int nstates = CountStates(fst);
-      numstates += nstates;
-      numarcs += CountArcs(fst);
-      mdl->weight_offsets_.push_back(mdl->weights_.size());
-      mdl->state_offsets_.push_back(mdl->state_labels_.size());
-      switch (nstates) {
-        case 2: ++numeps;
-                mdl->types_.push_back(kEpsilon);
-                break;
-        case 4: ++numbakis;
-                mdl->types_.push_back(kLeftToRight);
-                mdl->weights_.push_back(0.0f);  // Sentinels for token expansion
-                mdl->state_labels_.push_back(-1);
-                mdl->next_states_.push_back(0);
-                break;
-        case 6: ++numergodic;
-                mdl->types_.push_back(kErgodic);
-                mdl->weights_.push_back(0.0f);  // Sentinels for token expansion
-                mdl->state_labels_.push_back(-1);
-                mdl->next_states_.push_back(0);
-                break;
-        default: break;
-      }
-
-      for (int i = 0; i != nstates; ++i) {
-        for (ArcIterator<Fst<Arc> > aiter(fst, i); !aiter.Done();
-             aiter.Next()) {
-          const Arc& arc = aiter.Value();
-          mdl->weights_.push_back(arc.weight.Value());
-          mdl->next_states_.push_back(arc.nextstate);
-          if (aiter.Position() == 0) {
-            mdl->state_labels_.push_back(arc.ilabel);
-            if (nstates == 2)
-              mdl->eps_labels_set_.insert(arc.ilabel);
-            else
-              mdl->state_labels_set_.insert(arc.ilabel);
-          }
-        }
-      }
+    mdl->tables_ = new Tables;
+    for (; !reader->Done(); reader->Next()) {
+      mdl->hmm_syms_.AddSymbol(reader->GetKey());
+      mdl->AddHmm(reader->GetFst());
     }
-
-    mdl->num_hmms_ = numhmms;
-    mdl->total_num_states_ = numstates;
-    mdl->num_eps_ = numeps;
-    mdl->num_bakis_ = numbakis;
-    mdl->num_ergodic_ = numergodic;
-
-    // Sanity check to make sure the arrays were filled correctly
-    int num_states = mdl->num_eps_ + mdl->num_bakis_ * 4 +
-        mdl->num_ergodic_ * 6;
-    assert(num_states == mdl->state_labels_.size());
-
-    int num_trans = mdl->num_eps_ + mdl->num_bakis_ * 7 +
-        mdl->num_ergodic_ * 18;
-
-    LOG(INFO) << num_states << " " << mdl->state_labels_.size() << " "
-        << numstates;
-
-    LOG(INFO) << num_trans << " " << mdl->weights_.size() << " "
-        << numarcs;
-
+    mdl->SetTables();
     return mdl;
   }
 
     // Ergodic HMMs are more tricky, in this version just do
   // the simpliest way
   template<class Token>
-  inline FloatPair ExpandErgodic(int label, Token* tokens, float* weights,
-                                 int* states) {
+  inline FloatPair ExpandErgodic(int label, Token* tokens,
+                                 const float* weights,
+                                 const int* states) const {
     Token token_scratch_[kMaxTokensPerArc];
     ClearTokens(token_scratch_, kMaxTokensPerArc);
     float best_cost = kMaxCost;
@@ -405,7 +372,7 @@ class HMMTransitionModel {
   }
 
   template<class Token>
-  void ClearTokens(Token* tokens, int num) {
+  void ClearTokens(Token* tokens, int num) const {
     for (int i = 0; i != num; ++i)
       tokens[i].Clear();
   }
@@ -413,8 +380,9 @@ class HMMTransitionModel {
   // For left-to-right HMMs just work backwards down the array
   // The prefetch work in reverse
   template<class Token>
-  inline FloatPair ExpandLeftToRight(int label, Token* tokens, float* weights,
-                                     int* states) {
+  inline FloatPair ExpandLeftToRight(const Cursor& cursor, Token* tokens,
+                                     const float* weights,
+                                     const int* states) const {
     PROFILE_FUNC();
     float best_cost = kMaxCost;
     for (int i = 3; i > 0; --i) {
@@ -425,7 +393,7 @@ class HMMTransitionModel {
         //  3          |  2
         //  1          |  0
         int state = states[i];
-        float am_cost = Score(state);
+        float am_cost = cursor.Score(state);
         float loop = tokens[i].Cost() + weights[2 * i - 1] + am_cost;
         float prev = tokens[i - 1].Cost() + weights[2 * i - 2] + am_cost;
         if (loop < prev) {
@@ -442,36 +410,45 @@ class HMMTransitionModel {
     return FloatPair(best_cost, kMaxCost);
   }
 
-  // Expand the tokens in the arc or (sub network)
+  // Expand the tokens of an HMM of any topology from the flat tables. The
+  // arcs leaving a state all carry the label of the state
   template<class Options>
-  inline FloatPair ExpandGeneric(int ilabel, Options *opts) {
+  inline FloatPair ExpandGeneric(int ilabel, Options *opts) const {
     PROFILE_FUNC();
-    const StdFst& topo = *fsts_[ilabel];
     int numstates = num_states_[ilabel];
+    int sentinel = types_[ilabel] == kEpsilon ? 0 : 1;
+    const float* weights = &weights_[weight_offsets_[ilabel] + sentinel];
+    const int* next_states = &next_states_[weight_offsets_[ilabel] + sentinel];
+    const int* labels = &state_labels_[state_offsets_[ilabel] + sentinel];
+    const int* arc_counts = &arc_counts_[state_offsets_[ilabel] + sentinel];
     float bestcost = kMaxCost;
     typedef typename Options::Token Token;
     Token *tokens = opts->tokens_;
     Token *nexttokens = opts->scratch_;
     float threshold = opts->threshold_;
+    const Cursor& cursor = *opts->cursor_;
 
     for (int i = 0; i != numstates; ++i)
       nexttokens[i].Clear();
 
     for (int i = 0; i != numstates - 1; ++i) {
+      int num_arcs = arc_counts[i];
       if (tokens[i].Active()) {
-        for (ArcIterator<StdFst> aiter(topo, i); !aiter.Done(); aiter.Next()) {
-          const StdArc& arc = aiter.Value();
-          float cost = nexttokens[arc.nextstate].Combine(tokens[i],
-                                                         + arc.weight.Value()
-                                                         + Score(arc.ilabel));
+        float am_cost = cursor.Score(labels[i]);
+        for (int j = 0; j != num_arcs; ++j) {
+          float cost = nexttokens[next_states[j]].Combine(tokens[i],
+                                                          weights[j] +
+                                                          am_cost);
           if (cost > threshold) {
             // Maybe this doesn't help efficiency very much
-            nexttokens[arc.nextstate].Clear();
+            nexttokens[next_states[j]].Clear();
           } else {
             bestcost = min(bestcost, cost);
           }
         }
       }
+      weights += num_arcs;
+      next_states += num_arcs;
     }
 
     for (int i = 0; i != numstates; ++i)
@@ -479,52 +456,125 @@ class HMMTransitionModel {
 
     return FloatPair(bestcost, kMaxCost);
   }
+
+  // Fast match lookahead of an HMM, the best lookahead of its states
+  float Lookahead(const Cursor& cursor, int ilabel) const {
+    const int* states = &state_labels_[state_offsets_[ilabel]];
+    int num_states = 0;
+    switch (types_[ilabel]) {
+      case kLeftToRight: num_states = 3; break;
+      case kErgodic: num_states = 5; break;
+      default: return 0.0f;
+    }
+    // The first label is the sentinel
+    float best = kMaxCost;
+    for (int i = 1; i <= num_states; ++i)
+      best = min(best, cursor.Lookahead(states[i]));
+    return best;
+  }
+
+  // Start loading the weights and state labels Expand reads for the ilabel
+  void Prefetch(int ilabel) const {
+    DCD_PREFETCH(&weights_[weight_offsets_[ilabel]]);
+    DCD_PREFETCH(&state_labels_[state_offsets_[ilabel]]);
+  }
+
   // Expand the transition model corresponding
   // to the ilabel and return the cost from the
-  // best scoring token
+  // best scoring token and the cost plus the lookahead
   // Pass in an optional lattice pointer for state level lattice generation
   template<class Options>
-  FloatPair Expand(int ilabel, Options* opts) {
-    acoustic_scale_ = opts->opts_.acoustic_scale;
+  FloatPair Expand(int ilabel, Options* opts) const {
     int woffset = weight_offsets_[ilabel];
-    float* weights = &weights_[woffset];
-    int* states = &state_labels_[state_offsets_[ilabel]];
-    float best_cost = kMaxCost;
+    const float* weights = &weights_[woffset];
+    const int* states = &state_labels_[state_offsets_[ilabel]];
+    FloatPair costs(kMaxCost, kMaxCost);
     switch (types_[ilabel]) {
       case kEpsilon:
       case kDisambiguation:  // Should never happen
         break;
       case kLeftToRight:
-        return ExpandLeftToRight(ilabel, opts->tokens_, weights, states);
+        costs = ExpandLeftToRight(*opts->cursor_, opts->tokens_, weights,
+                                  states);
         break;
       case kErgodic:
-        return ExpandGeneric(ilabel, opts);
+        costs = ExpandGeneric(ilabel, opts);
         // return ExpandErgodic(ilabel, tokens, weights, states);
         break;
     }
-    return FloatPair(best_cost, kMaxCost);
+    if (opts->cursor_->HasLookahead() && costs.first < kMaxCost)
+      costs.second = costs.first + Lookahead(*opts->cursor_, ilabel);
+    return costs;
   }
 
-  // Returns the score with slabel
-  // Scores index are zero based
-  inline float Score(int slabel) {
-    return -decodable_->LogLikelihood(index_, slabel - 1) * acoustic_scale_;
-  }
+  // Expand every arc in the batch. The left-to-right HMMs are gathered into
+  // the structure of arrays buffers and advanced together by the min-plus
+  // kernel, the other types go through Expand one at a time
+  template<class Options>
+  void ExpandBatch(ArcBatch<typename Options::Token>* batch,
+                   Options* opts) const {
+    PROFILE_FUNC();
+    typedef typename Options::Token Token;
+    const Cursor& cursor = *opts->cursor_;
+    int n = batch->Size();
+    batch->costs.resize(n);
+    batch->bakis.clear();
+    for (int k = 0; k != n; ++k) {
+      int ilabel = batch->ilabels[k];
+      if (types_[ilabel] == kLeftToRight) {
+        batch->bakis.push_back(k);
+      } else {
+        opts->tokens_ = batch->tokens[k];
+        batch->costs[k] = Expand(ilabel, opts);
+      }
+    }
 
-  // Set the input the
-  void SetInput(Decodable *decodable,
-                const SearchOptions &opts) {
-    index_ = 0;
-    acoustic_scale_ = opts.acoustic_scale;
-    decodable_ = decodable;
-  }
+    BakisBatch& soa = batch->soa;
+    int m = batch->bakis.size();
+    soa.Resize(m);
+    for (int j = 0; j != m; ++j) {
+      int k = batch->bakis[j];
+      int ilabel = batch->ilabels[k];
+      const Token* tokens = batch->tokens[k];
+      const float* weights = &weights_[weight_offsets_[ilabel]];
+      const int* states = &state_labels_[state_offsets_[ilabel]];
+      for (int i = 0; i <= kBakisNumStates; ++i) {
+        soa.costs[i][j] = tokens[i].Cost();
+        soa.active[i][j] = tokens[i].Active() ? -1 : 0;
+      }
+      for (int i = 1; i <= kBakisNumStates; ++i) {
+        soa.loop_weights[i][j] = weights[2 * i - 1];
+        soa.prev_weights[i][j] = weights[2 * i - 2];
+        // Only score the states the scalar expansion would visit
+        soa.am_costs[i][j] = soa.active[i][j] || soa.active[i - 1][j] ?
+            cursor.Score(states[i]) : 0.0f;
+      }
+    }
 
-  int Next() {
-    return ++index_;
+    ExpandBakisKernel(&soa);
+
+    // Scatter back, working backwards so the lattice state of token i - 1
+    // is read before it is overwritten
+    for (int j = 0; j != m; ++j) {
+      int k = batch->bakis[j];
+      Token* tokens = batch->tokens[k];
+      for (int i = kBakisNumStates; i > 0; --i) {
+        if (soa.active[i][j] || soa.active[i - 1][j]) {
+          if (soa.take_prev[i][j])
+            tokens[i].SetValue(tokens[i - 1].GetLatticeState(),
+                               soa.costs[i][j]);
+          else
+            tokens[i].SetCost(soa.costs[i][j]);
+        }
+      }
+      tokens[0].Clear();
+      batch->costs[k] = FloatPair(soa.best[j], kMaxCost);
+      if (cursor.HasLookahead() && soa.best[j] < kMaxCost)
+        batch->costs[k].second = soa.best[j] +
+          Lookahead(cursor, batch->ilabels[k]);
+    }
   }
 
-  bool Done() { return decodable_->IsLastFrame(index_) ; }
-
   int NumHmms() const { return num_hmms_; }
 
   int Type(int ilabel) const { return types_[ilabel]; }
@@ -545,15 +595,19 @@ class HMMTransitionModel {
         << "\t\t  Num of Bakis " << num_bakis_ << ", Num of ergodic "
         << num_ergodic_ << endl
         << "\t\t  Total # of HMM states " << total_num_states_ << endl
-        << "\t\t  Total # of HMM arcs " << weights_.size() << endl
-        << "\t\t  # of HMM state labels " << state_labels_set_.size() << endl
-        << "\t\t  # of epsilon labels " << eps_labels_set_.size() << endl;
+        << "\t\t  Total # of HMM arcs " << num_weights_ << endl
+        << "\t\t  # of HMM state labels " << num_state_labels_ << endl
+        << "\t\t  # of epsilon labels " << num_eps_labels_ << endl
+        << "\t\t  Storage " << (file_ ? "mapped" : "in memory") << endl;
   }
 
+  // Scale applied to the weights when the model was read
+  float TransScale() const { return trans_scale_; }
+
   int NumStates(int ilabel) const {
-    if (ilabel >= num_states_.size())
+    if (ilabel >= num_hmms_)
       LOG(FATAL) << "Out of bounds arc look-up - relabelling or aux symbols? "
-          << ilabel << " " <<  num_states_.size();
+          << ilabel << " " <<  num_hmms_;
     return num_states_[ilabel] - 1;
     switch (types_[ilabel]) {
       case kEpsilon: return 0;
@@ -569,21 +623,215 @@ class HMMTransitionModel {
   }
 
  protected:
-  // Temporary tokens when expanding ergodic hmms
-  Decodable *decodable_;
-  int index_;  // Current frame number
-
-  struct TransitionModelHeader {
-    int num_hmms_;
-    int num_states_;
-    int num_arcs_;
-    bool Read() {
-      return true;
+  static const int kNumTables = 8;
+
+  // Storage of the tables for a model built in memory
+  struct Tables {
+    vector<int> types;
+    vector<int> weight_offsets;
+    vector<int> state_offsets;
+    vector<int> num_states;
+    vector<float> weights;
+    vector<int> next_states;
+    vector<int> state_labels;
+    vector<int> arc_counts;
+    set<int> state_labels_set;
+    set<int> eps_labels_set;
+  };
+
+  // Append an HMM to the tables, we assume bakis have three states and
+  // ergodic have five states
+  template<class Arc>
+  void AddHmm(const Fst<Arc>& fst) {
+    Tables& t = *tables_;
+    int nstates = CountStates(fst);
+    ++num_hmms_;
+    total_num_states_ += nstates;
+    t.num_states.push_back(nstates);
+    t.weight_offsets.push_back(t.weights.size());
+    t.state_offsets.push_back(t.state_labels.size());
+    switch (nstates) {
+      case 2: ++num_eps_;
+              t.types.push_back(kEpsilon);
+              break;
+      case 4: ++num_bakis_;
+              t.types.push_back(kLeftToRight);
+              t.weights.push_back(0.0f);  // Sentinels for token expansion
+              t.state_labels.push_back(-1);
+              t.next_states.push_back(0);
+              t.arc_counts.push_back(0);
+              break;
+      case 6: ++num_ergodic_;
+              t.types.push_back(kErgodic);
+              t.weights.push_back(0.0f);  // Sentinels for token expansion
+              t.state_labels.push_back(-1);
+              t.next_states.push_back(0);
+              t.arc_counts.push_back(0);
+              break;
+      default: t.types.push_back(kDisambiguation);
+               break;
     }
-    bool Write() {
-      return true;
+
+    for (int i = 0; i != nstates; ++i) {
+      for (ArcIterator<Fst<Arc> > aiter(fst, i); !aiter.Done();
+           aiter.Next()) {
+        const Arc& arc = aiter.Value();
+        t.weights.push_back(arc.weight.Value());
+        t.next_states.push_back(arc.nextstate);
+        if (aiter.Position() == 0) {
+          t.state_labels.push_back(arc.ilabel);
+          t.arc_counts.push_back(fst.NumArcs(i));
+          if (nstates == 2)
+            t.eps_labels_set.insert(arc.ilabel);
+          else
+            t.state_labels_set.insert(arc.ilabel);
+        }
+      }
     }
-  };
+  }
+
+  // Point the tables at the storage once every HMM has been added
+  void SetTables() {
+    Tables& t = *tables_;
+    // Sanity check to make sure the arrays were filled correctly
+    int num_states = num_eps_ + num_bakis_ * 4 + num_ergodic_ * 6;
+    assert(num_states == t.state_labels.size());
+    num_weights_ = t.weights.size();
+    num_state_slots_ = t.state_labels.size();
+    num_state_labels_ = t.state_labels_set.size();
+    num_eps_labels_ = t.eps_labels_set.size();
+    types_ = t.types.empty() ? 0 : &t.types[0];
+    weight_offsets_ = t.weight_offsets.empty() ? 0 : &t.weight_offsets[0];
+    state_offsets_ = t.state_offsets.empty() ? 0 : &t.state_offsets[0];
+    num_states_ = t.num_states.empty() ? 0 : &t.num_states[0];
+    weights_ = t.weights.empty() ? 0 : &t.weights[0];
+    next_states_ = t.next_states.empty() ? 0 : &t.next_states[0];
+    state_labels_ = t.state_labels.empty() ? 0 : &t.state_labels[0];
+    arc_counts_ = t.arc_counts.empty() ? 0 : &t.arc_counts[0];
+  }
+
+  // Point the tables into a binary model held in memory
+  bool SetTables(const char* data, size_t size, const string& source) {
+    const HMMTransitionModelHeader& header =
+      *reinterpret_cast<const HMMTransitionModelHeader*>(data);
+    if (header.magic != kTransModelMagic) {
+      LOG(ERROR) << "Not a binary transition model : " << source;
+      return false;
+    }
+    if (header.version != kTransModelVersion) {
+      LOG(ERROR) << "Binary transition model version " << header.version
+                 << " is not supported, expected version "
+                 << kTransModelVersion << " : " << source;
+      return false;
+    }
+    if (!ValidCounts(header) || size != BinarySize(header)) {
+      LOG(ERROR) << "Binary transition model is truncated : " << source;
+      return false;
+    }
+    const char* tables[kNumTables];
+    size_t sizes[kNumTables];
+    TableSizes(header, sizes);
+    size_t pos = sizeof(header);
+    for (int i = 0; i != kNumTables; ++i) {
+      tables[i] = data + Align(pos);
+      pos = Align(pos) + sizes[i];
+    }
+    if (TablesChecksum(tables, sizes) != header.checksum) {
+      LOG(ERROR) << "Binary transition model checksum mismatch : " << source;
+      return false;
+    }
+    num_hmms_ = header.num_hmms;
+    num_eps_ = header.num_eps;
+    num_bakis_ = header.num_bakis;
+    num_ergodic_ = header.num_ergodic;
+    total_num_states_ = header.total_num_states;
+    num_weights_ = header.num_weights;
+    num_state_slots_ = header.num_state_slots;
+    num_state_labels_ = header.num_state_labels;
+    num_eps_labels_ = header.num_eps_labels;
+    trans_scale_ = header.trans_scale;
+    types_ = reinterpret_cast<const int*>(tables[0]);
+    weight_offsets_ = reinterpret_cast<const int*>(tables[1]);
+    state_offsets_ = reinterpret_cast<const int*>(tables[2]);
+    num_states_ = reinterpret_cast<const int*>(tables[3]);
+    weights_ = reinterpret_cast<const float*>(tables[4]);
+    next_states_ = reinterpret_cast<const int*>(tables[5]);
+    state_labels_ = reinterpret_cast<const int*>(tables[6]);
+    arc_counts_ = reinterpret_cast<const int*>(tables[7]);
+    return true;
+  }
+
+  HMMTransitionModelHeader Header() const {
+    HMMTransitionModelHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kTransModelMagic;
+    header.version = kTransModelVersion;
+    header.num_hmms = num_hmms_;
+    header.num_eps = num_eps_;
+    header.num_bakis = num_bakis_;
+    header.num_ergodic = num_ergodic_;
+    header.total_num_states = total_num_states_;
+    header.num_weights = num_weights_;
+    header.num_state_slots = num_state_slots_;
+    header.num_state_labels = num_state_labels_;
+    header.num_eps_labels = num_eps_labels_;
+    header.trans_scale = trans_scale_;
+    return header;
+  }
+
+  // The tables in file order
+  void GetTables(const char** tables) const {
+    tables[0] = reinterpret_cast<const char*>(types_);
+    tables[1] = reinterpret_cast<const char*>(weight_offsets_);
+    tables[2] = reinterpret_cast<const char*>(state_offsets_);
+    tables[3] = reinterpret_cast<const char*>(num_states_);
+    tables[4] = reinterpret_cast<const char*>(weights_);
+    tables[5] = reinterpret_cast<const char*>(next_states_);
+    tables[6] = reinterpret_cast<const char*>(state_labels_);
+    tables[7] = reinterpret_cast<const char*>(arc_counts_);
+  }
+
+  // Bytes in each table in file order
+  static void TableSizes(const HMMTransitionModelHeader& header,
+                         size_t* sizes) {
+    sizes[0] = header.num_hmms * sizeof(int);
+    sizes[1] = header.num_hmms * sizeof(int);
+    sizes[2] = header.num_hmms * sizeof(int);
+    sizes[3] = header.num_hmms * sizeof(int);
+    sizes[4] = header.num_weights * sizeof(float);
+    sizes[5] = header.num_weights * sizeof(int);
+    sizes[6] = header.num_state_slots * sizeof(int);
+    sizes[7] = header.num_state_slots * sizeof(int);
+  }
+
+  static bool ValidCounts(const HMMTransitionModelHeader& header) {
+    return header.num_hmms >= 0 && header.num_eps >= 0 &&
+      header.num_bakis >= 0 && header.num_ergodic >= 0 &&
+      header.total_num_states >= 0 && header.num_weights >= 0 &&
+      header.num_state_slots >= 0 && header.num_state_labels >= 0 &&
+      header.num_eps_labels >= 0;
+  }
+
+  static size_t BinarySize(const HMMTransitionModelHeader& header) {
+    size_t sizes[kNumTables];
+    TableSizes(header, sizes);
+    size_t pos = sizeof(header);
+    for (int i = 0; i != kNumTables; ++i)
+      pos = Align(pos) + sizes[i];
+    return pos;
+  }
+
+  static inline size_t Align(size_t size) {
+    return (size + kTransModelAlignment - 1) &
+      ~static_cast<size_t>(kTransModelAlignment - 1);
+  }
+
+  static uint32 TablesChecksum(const char** tables, const size_t* sizes) {
+    uint32 checksum = Checksum(0, 0);
+    for (int i = 0; i != kNumTables; ++i)
+      checksum = Checksum(tables[i], sizes[i], checksum);
+    return checksum;
+  }
 
   // HMM and state information
   int num_hmms_;
@@ -591,27 +839,30 @@ class HMMTransitionModel {
   int num_bakis_;
   int num_ergodic_;
   int total_num_states_;
-  float acoustic_scale_;
-
-  set<int> state_labels_set_;
-  set<int> eps_labels_set_;
-
-  // HMM information
-  vector<int> types_;
-
-  vector<int> weight_offsets_;
-  vector<int> state_offsets_;
-
-  vector<float> weights_;  // Arc transition probs
-  vector<int> next_states_;  // Destination states
-  vector<int> state_labels_;  // HMM states labels, normally would a label per
-                              // arc but we use a Moore machine with the
-                              // labels on the states because the transitions
-                              //  leaving a state all have the same labels
-
+  int num_weights_;
+  int num_state_slots_;
+  int num_state_labels_;
+  int num_eps_labels_;
+  float trans_scale_;
+
+  // HMM information, indexed by ilabel
+  const int* types_;
+  const int* weight_offsets_;
+  const int* state_offsets_;
+  const int* num_states_;
+
+  const float* weights_;  // Arc transition probs
+  const int* next_states_;  // Destination states
+  const int* state_labels_;  // HMM states labels, normally would a label per
+                             // arc but we use a Moore machine with the
+                             // labels on the states because the transitions
+                             //  leaving a state all have the same labels
+  const int* arc_counts_;  // Number of arcs leaving each labelled state
+
+  Tables* tables_;  // Storage of a model built in memory
+  MappedFile* file_;  // Storage of a mapped binary model
+  vector<char> buffer_;  // Storage of a binary model read from a stream
   SymbolTable hmm_syms_;
-  vector<int> num_states_;
-  vector<const Fst<StdArc>*> fsts_;
 
  private:
   DISALLOW_COPY_AND_ASSIGN(HMMTransitionModel);
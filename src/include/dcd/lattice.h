@@ -14,15 +14,50 @@
 // Copyright 2013-2014 Yandex LLC
 // Author : Paul R. Dixon
 // \file Simple and generic lattice that support one-best or lattice generation
-// and partial hypothesis output (one-best-only), backpointers are raw c++
-// pointers
+// and partial hypothesis output (one-best-only). The states and arcs live in
+// chunked arenas and refer to each other by 32-bit indices, index 0 is the
+// null state and the null arc. The arcs of a state form a linked list in the
+// shared arc arena. Garbage collection copies the arcs of the surviving
+// states to a spare arena, so the arcs of each state end up contiguous.
+//
+// Garbage collection can also be generational. Back pointers always lead to
+// older states, and once a collection has run no new arcs arrive in the
+// states that existed before it. A minor collection therefore only marks
+// and sweeps the states created since the previous collection. Marking
+// stops at the older states, which are kept until the next full collection.
+//
+// With the early mission a full collection also commits the prefix shared
+// by every surviving hypothesis. Unless a lattice is being generated the
+// committed state then becomes the new root, the states behind it are
+// freed and only the labels of the committed path are kept
+//
+// With incremental_lattice a full collection also settles the part of the
+// lattice behind the newest state every surviving path passes through. No
+// arc can jump over such a cut state in the creation order, and it can't
+// be newer than the oldest token. The chunk up to the cut is projected on
+// the words, determinized with the lattice beam and appended to the output
+// lattice, and the cut state becomes the new root. At the end only the last
+// chunk is left to determinize. The output is a word lattice.
+//
+// With a rescoring LM in the options every state keeps the LM history of its
+// best arc and the words are rescored as their arcs are added. The histories
+// of the other paths merged into a state are lost, as in the search.
 
 #ifndef DCD_LATTICE_H__
 #define DCD_LATTICE_H__
 
+#include <algorithm>
+#include <vector>
+
+#include <fst/concat.h>
+#include <fst/determinize.h>
+#include <fst/project.h>
+#include <fst/rmepsilon.h>
 #include <fst/vector-fst.h>
 #include <dcd/kaldi-lattice-arc.h>
+#include <dcd/lm-rescorer.h>
 #include <dcd/log.h>
+#include <dcd/partial-result.h>
 #include <dcd/search-opts.h>
 #include <dcd/search-statistics.h>
 #include <dcd/stl.h>
@@ -31,54 +66,86 @@
 using fst::VectorFst;
 
 namespace dcd {
+
+// Array of T that grows one chunk at a time, elements never move once they
+// have been added
+template<class T>
+class ChunkedArray {
+ public:
+  ChunkedArray() : size_(0) { }
+
+  ~ChunkedArray() {
+    for (int i = 0; i != chunks_.size(); ++i)
+      delete[] chunks_[i];
+  }
+
+  inline T& operator[](int i) {
+    return chunks_[i >> kLatticeChunkBits][i & kChunkMask];
+  }
+
+  inline const T& operator[](int i) const {
+    return chunks_[i >> kLatticeChunkBits][i & kChunkMask];
+  }
+
+  // Append a default element and return its index
+  inline int Add() {
+    if (size_ == chunks_.size() << kLatticeChunkBits)
+      chunks_.push_back(new T[1 << kLatticeChunkBits]);
+    (*this)[size_] = T();
+    return size_++;
+  }
+
+  // Drop the elements from n onwards, the chunks are kept for reuse
+  void Truncate(int n) { size_ = n; }
+
+  int Size() const { return size_; }
+
+  // Memory held by the chunks in bytes
+  size_t Capacity() const {
+    return chunks_.size() * (1 << kLatticeChunkBits) * sizeof(T);
+  }
+
+  void Swap(ChunkedArray* other) {
+    chunks_.swap(other->chunks_);
+    std::swap(size_, other->size_);
+  }
+
+ private:
+  static const int kChunkMask = (1 << kLatticeChunkBits) - 1;
+  std::vector<T*> chunks_;
+  int size_;
+  DISALLOW_COPY_AND_ASSIGN(ChunkedArray);
+};
+
 class Lattice {
  public:
   struct State;
-  typedef State* LatticeState;
+  typedef int LatticeState;  // Index into the state arena, 0 is null
   struct LatticeArc {
     LatticeArc() { Clear(); }
 
-    LatticeArc(const LatticeArc& other)
-      : prevstate_(other.prevstate_), ilabel_(other.ilabel_),
-      olabel_(other.olabel_), dur_(other.dur_), am_weight_(other.am_weight_),
-      lm_weight_(other.lm_weight_), dur_weight_(other.dur_weight_) { }
-
-    LatticeArc(State* prevstate, int ilabel, int olabel, float am_weight,
-        float lm_weight, float dur_weight)
+    LatticeArc(int prevstate, int ilabel, int olabel, float am_weight,
+        float lm_weight)
       : prevstate_(prevstate), ilabel_(ilabel), olabel_(olabel),
-      am_weight_(am_weight), lm_weight_(lm_weight),
-      dur_weight_(dur_weight) { }
+      am_weight_(am_weight), lm_weight_(lm_weight), next_(0) { }
 
-    State* prevstate_;
+    int prevstate_;
     int ilabel_;
     int olabel_;
-    int dur_;
     float am_weight_;
     float lm_weight_;
-    float dur_weight_;
+    int next_;  // Next arc of the same state in the arc arena, 0 ends the list
 
     void Clear() {
       prevstate_ = 0;
       ilabel_ = kNoLabel;
       olabel_ = kNoLabel;
-      dur_ = kNoLabel;
       am_weight_ = kMaxCost;
       lm_weight_ = kMaxCost;
-      dur_weight_ = kMaxCost;
+      next_ = 0;
     }
 
-    LatticeArc& operator= (const LatticeArc& other) {
-      prevstate_ = other.prevstate_;
-      ilabel_ = other.ilabel_;
-      olabel_ = other.olabel_;
-      dur_ = other.dur_;
-      am_weight_ = other.am_weight_;
-      lm_weight_ = other.lm_weight_;
-      dur_weight_ = other.dur_weight_;
-      return *this;
-    }
-
-    State* PrevState() const { return prevstate_; }
+    int PrevState() const { return prevstate_; }
 
     int ILabel() const { return ilabel_; }
 
@@ -97,118 +164,54 @@ class Lattice {
     }
   };
 
+  // Conversions of the weights of the settled chunks to the output lattice
+  static void ConvertWeight(const KaldiLatticeWeight& w,
+                            StdArc::Weight* out) {
+    *out = w.Value1() + w.Value2();
+  }
+
+  static void ConvertWeight(const KaldiLatticeWeight& w,
+                            KaldiLatticeWeight* out) {
+    *out = w;
+  }
+
   struct State {
    public:
-    void Init(int time, int state, int id, int index,
-        float forwards_cost = kMaxCost) {
+    State() { Clear(); }
+
+    void Init(int time, int state, int id, float forwards_cost = kMaxCost) {
       Clear();
       time_ = time;
       state_ = state;
       id_ = id;
-      index_ = index;
       forwards_cost_ = forwards_cost;
     }
 
-    // Create an OpenFst version of the best sequence from this state
-    template<class Arc>
-    int GetBestSequence(VectorFst<Arc>* ofst) const {
-      // PROFILE_FUNC();  // Commented out because this is slow
-      assert(index_ != -1);
-      int d = -1;
-      if (PrevState()) {
-        int s = PrevState()->GetBestSequence(ofst);
-        d = ofst->AddState();
-        ofst->AddArc(s, Arc(best_arc_.ilabel_, best_arc_.olabel_,
-              Arc::Weight::One(), d));
-      } else {
-        d = ofst->AddState();
-        ofst->SetStart(d);
-      }
-      return d;
-    }
-
-    State* PrevState() const {
-      return best_arc_.prevstate_;
-    }
-
-    int PrevStateId() const {
-      return  best_arc_.prevstate_ ? best_arc_.prevstate_->Id() : -1;
-    }
-
-    int PrevStateIndex() const {
-      return  best_arc_.prevstate_ ? best_arc_.prevstate_->index_ : -1;
-    }
-    // Add a new arc to lattice state, returns a pair that of the cost of the
-    // arc arriving in the state the forward (best) cost of arriving in the
-    // state
-    template<class T>
-    pair<float, float> AddArc(State* src, float cost, const T& arc,
-                              float threshold, const SearchOptions& opts) {
-      // TODO(Paul) add rescoring here.
-      // Total LM/AM/Trn costs accumulated in the arc
-      float arc_cost = cost - src->ForwardsCost();
-      float am_cost = arc_cost - arc.Weight();
-      LatticeArc lattice_arc(src, arc.ILabel(), arc.OLabel(), am_cost,
-          arc.Weight(), 0.0f);
-      if (cost < forwards_cost_) {
-        // New best token arriving
-        best_arc_ = lattice_arc;
-        forwards_cost_ = cost;
-      }
-
-      // Generating a lattice, here we can use a potentially tigher beam
-      if (opts.gen_lattice && best_arc_.prevstate_) {
-        float lat_threshold = forwards_cost_ + opts.lattice_beam;
-        if (cost < lat_threshold) {
-          // TODO(Paul) check that another arc with  same label and worse cost
-          // doesn't already exist  different cost
-          arcs_.push_back(lattice_arc);
-        }
-      }
-      return pair<float, float>(cost, forwards_cost_);
-    }
+    int PrevState() const { return best_arc_.prevstate_; }
 
     //Here we assume the start state has a null best_previous_ pointer
     bool IsStart() const { return !best_arc_.prevstate_; }
 
-    void GcClearMark() { marked_ = false; }
+    // Free slots in the state arena have no id
+    bool InUse() const { return id_ != -1; }
 
     bool GcMarked() const { return marked_; }
 
-    void GcMark() {
-      if (marked_) {
-        ++marked_;
-        return;
-      }
-      if (best_arc_.prevstate_)
-        best_arc_.prevstate_->GcMark();
-      for (int i = 0; i != arcs_.size(); ++i) {
-        State* prev = arcs_[i].prevstate_;
-        prev->GcMark();
-      }
-      marked_ = true;
-    }
-
     void Clear() {
       state_ = kNoStateId;
       time_ = -1;
       id_ = -1;
-      marked_ = false;
+      marked_ = 0;
       index_ = -1;
       forwards_cost_ = kMaxCost;
       backwards_cost_ = kMaxCost;
       best_arc_.Clear();
-      if (arcs_.size())
-        ClearVector(&arcs_);
-    }
-
-    void Check() {
+      arcs_ = 0;
+      lm_state_ = 0;
     }
 
     int Index() const { return index_; }
 
-    void SetIndex(int index) { index_ = index; }
-
     float ForwardsCost() const { return forwards_cost_; }
 
     float BackwardsCost() const { return backwards_cost_; }
@@ -222,77 +225,66 @@ class Lattice {
    protected:
     int state_;  // The state in the search fst
     int time_;  // Time the lattice state was created
-    int id_;  // Unique id assigned to this state
+    int id_;  // Unique id assigned to this state, -1 if the slot is free
     int marked_;  // Integer useful for storing other values, e.g. refs count
                   // GC marks, id for value into VectorFsts when generating
-    int index_;  // Where the lattice state is in the vector of lattice states
+    int index_;  // Position among the states in use after the last sweep
     float forwards_cost_;
     float backwards_cost_;
 
     LatticeArc best_arc_;  // The best lattice arc arriving in this state
 
-    typedef  VectorHelper<LatticeArc>::Vector LatticeArcVector;
-    LatticeArcVector arcs_;  // lattice arcs within the lattice_beam poining
-                            //  back from this state
+    int arcs_;  // First of the lattice arcs within the lattice_beam pointing
+                // back from this state, 0 if there are none
+    int lm_state_;  // History of the best arc in the rescoring LM
     friend class Lattice;
   };
 
 
   explicit Lattice(const SearchOptions& opts, ostream* logstream = &std::cerr)
     : logger_("Lattice", *logstream),
-    next_id_(0), num_allocs_(0), num_frees_(0),
-    use_pool_(opts.use_lattice_pool) { }
+    next_id_(0), num_allocs_(0), num_frees_(0), num_states_(0),
+    gc_full_(true), gc_first_id_(0), committed_(0),
+    truncate_committed_(!opts.gen_lattice),
+    incremental_(opts.gen_lattice && opts.incremental_lattice),
+    lattice_beam_(opts.lattice_beam), rescorer_(0) {
+    if (opts.rescoring_lm)
+      rescorer_ = new LmRescorer(*opts.rescoring_lm, opts.lm_rescore_scale,
+          static_cast<size_t>(max(opts.lm_rescore_cache_size, 0)) *
+          kMegaByte);
+    Reset();
+  }
 
   virtual ~Lattice() {
     Clear();
-    for (int i = 0; i != free_list_.size(); ++i)
-      DeleteState(free_list_[i]);
-    free_list_.clear();
+    if (rescorer_)
+      delete rescorer_;
     if (num_frees_ != num_allocs_)
       logger_(ERROR) << "Mismatch number of lattice state allocations";
   }
 
   void Check() {
-    unordered_set<State*> lss;
-    for (int i = 0; i < used_list_.size(); ++i) {
-      State* ls = used_list_[i];
-      lss.insert(ls);
-      if (ls->Index() != i)
-        LOG(FATAL) << "Lattice::Check : Index problem in lattice ls->Index() "
-                   << ls->Index() << " i " << i;
-    }
-
-    unordered_set<State*> fss;
-    for (int i = 0; i < free_list_.size(); ++i) {
-      State* ls = free_list_[i];
-      fss.insert(ls);
-    }
-
-    for (int i = 0; i < used_list_.size(); ++i) {
-      const State& ls = *used_list_[i];
-      const State::LatticeArcVector& arcs = ls.arcs_;
-      for (int j = 0; j != arcs.size(); ++j) {
-        const LatticeArc& arc = arcs[j];
-        if (lss.find(arc.prevstate_) == lss.end()) {
-          if (fss.find(arc.prevstate_) == fss.end()) {
-            LOG(ERROR) << "Lattice::Check : bad arc back pointer int lattice " <<
-              arc.prevstate_->Index();
-          } else {
-            LOG(ERROR) << "Lattice::Check : arc back pointer into freelist ";
-          }
+    for (int s = 1; s != states_.Size(); ++s) {
+      const State& ls = states_[s];
+      if (!ls.InUse())
+        continue;
+      for (int a = ls.arcs_; a; a = arcs_[a].next_) {
+        const LatticeArc& arc = arcs_[a];
+        if (arc.prevstate_ <= 0 || arc.prevstate_ >= states_.Size()) {
+          LOG(ERROR) << "Lattice::Check : bad arc back pointer int lattice " <<
+            arc.prevstate_;
+        } else if (!states_[arc.prevstate_].InUse()) {
+          LOG(ERROR) << "Lattice::Check : arc back pointer into freelist ";
         }
       }
     }
-
-    for (int i = 0; i != free_list_.size(); ++i ) {
-      State* lattice_state = free_list_[i];
-      lattice_state->Check();
-    }
   }
 
-  State* CreateStartState(int state) {
-    State* ls =  NewState(-1, state);
-    ls->forwards_cost_ = 0.0f;
+  LatticeState CreateStartState(int state) {
+    LatticeState ls = NewState(-1, state);
+    states_[ls].forwards_cost_ = 0.0f;
+    if (rescorer_)
+      states_[ls].lm_state_ = rescorer_->Start();
     return ls;
   }
 
@@ -302,63 +294,173 @@ class Lattice {
         << "\tNext Id " << next_id_ << endl
         << "\t# of allocs " << num_allocs_ << endl
         << "\t# of frees " << num_frees_ << endl
-        << "\t# in used list " << used_list_.size() << endl
-        << "\t# in free list " << free_list_.size();
+        << "\t# of states in use " << num_states_ << endl
+        << "\t# in free list " << free_list_.size() << endl
+        << "\t# of arcs " << arcs_.Size() - 1 << endl
+        << "\tMemory " << (states_.Capacity() + arcs_.Capacity() +
+                           gc_arcs_.Capacity()) / kKiloByte << "KB";
+    if (rescorer_)
+      VLOG(1) << "LM rescoring # of LM states " << rescorer_->NumStates()
+        << " cache hits " << rescorer_->NumHits()
+        << " misses " << rescorer_->NumMisses();
   }
 
-  State* NewState(int time, int state) {
+  LatticeState NewState(int time, int state) {
     PROFILE_FUNC();
-    State* lattice_state = 0;
-    if (use_pool_ && free_list_.size()) {
-      lattice_state = free_list_.back();
+    int s;
+    if (free_list_.size()) {
+      s = free_list_.back();
       free_list_.pop_back();
     } else {
-      lattice_state = new State;
+      s = states_.Add();
     }
-    lattice_state->Init(time, state, next_id_++, used_list_.size());
-    used_list_.push_back(lattice_state);
+    states_[s].Init(time, state, next_id_++);
+    young_.push_back(s);
     ++num_allocs_;
-    return lattice_state;
+    ++num_states_;
+    return s;
   }
 
-  void FreeState(State* lattice_state) {
+  // The arcs of the state are dropped by the next sweep
+  void FreeState(LatticeState s) {
     PROFILE_FUNC();
-    if (use_pool_)
-      free_list_.push_back(lattice_state);
-    else
-      delete lattice_state;
+    states_[s].Clear();
+    free_list_.push_back(s);
     ++num_frees_;
+    --num_states_;
   }
 
-  State* AddState(int time, int state) {
+  LatticeState AddState(int time, int state) {
     return NewState(time, state);
   }
 
-  void DeleteState(State* ls) {
-    if (ls->Index())
-      used_list_[ls->Index()] = 0;
-    delete ls;
-  }
-
-  //First field is the best cost arriving in the lattice state (forward cost)
-  //Second field is the the cost of the SearchArc arrvining in the lattice state
+  //First field is the cost of the SearchArc arriving in the lattice state,
+  //including the rescoring of its word. Second field is the best cost
+  //arriving in the lattice state (forward cost)
   template<class SearchArc>
-  pair<float, float> AddArc(State* src, State* dest, float cost,
+  pair<float, float> AddArc(LatticeState src, LatticeState dest, float cost,
       const SearchArc& arc, float threshold,
       const SearchOptions & opts) {
-    //Add the lattice arc in the reverse direction
-    return dest->AddArc(src, cost, arc, threshold, opts);
+    // Total LM/AM/Trn costs accumulated in the arc. The arc is added in the
+    // reverse direction
+    State& ds = states_[dest];
+    float lm_cost = arc.Weight();
+    int lm_state = states_[src].lm_state_;
+    if (rescorer_ && arc.OLabel() > 0) {
+      float delta = rescorer_->Delta(arc.OLabel(), &lm_state);
+      cost += delta;
+      lm_cost += delta;
+    }
+    float arc_cost = cost - states_[src].ForwardsCost();
+    float am_cost = arc_cost - lm_cost;
+    LatticeArc lattice_arc(src, arc.ILabel(), arc.OLabel(), am_cost,
+        lm_cost);
+    if (cost < ds.forwards_cost_) {
+      // New best token arriving
+      ds.best_arc_ = lattice_arc;
+      ds.forwards_cost_ = cost;
+      ds.lm_state_ = lm_state;
+    }
+
+    // Generating a lattice, here we can use a potentially tigher beam
+    if (opts.gen_lattice && ds.best_arc_.prevstate_) {
+      float lat_threshold = ds.forwards_cost_ + opts.lattice_beam;
+      if (cost < lat_threshold) {
+        // TODO(Paul) check that another arc with  same label and worse cost
+        // doesn't already exist  different cost
+        int a = arcs_.Add();
+        lattice_arc.next_ = ds.arcs_;
+        arcs_[a] = lattice_arc;
+        ds.arcs_ = a;
+      }
+    }
+    return pair<float, float>(cost, ds.forwards_cost_);
   }
 
-  int NumStates() const { return used_list_.size(); }
+  // Mark the state and every state reachable through the back pointers. A
+  // minor collection doesn't follow the pointers into the older states.
+  // Every extra visit of a marked state increments the mark, so a mark
+  // greater than one means the state is shared by several paths. The best
+  // arc is one of the lattice arcs when a lattice is generated, so it is
+  // only followed when the state has no lattice arcs
+  void GcMark(LatticeState s) {
+    if (!gc_oldest_root_ || states_[s].id_ < states_[gc_oldest_root_].id_)
+      gc_oldest_root_ = s;
+    gc_stack_.push_back(s);
+    while (!gc_stack_.empty()) {
+      State& ls = states_[gc_stack_.back()];
+      gc_stack_.pop_back();
+      if (!gc_full_ && ls.id_ < gc_first_id_)
+        continue;
+      if (ls.marked_) {
+        ++ls.marked_;
+        continue;
+      }
+      ls.marked_ = 1;
+      if (ls.best_arc_.prevstate_ && !ls.arcs_)
+        gc_stack_.push_back(ls.best_arc_.prevstate_);
+      for (int a = ls.arcs_; a; a = arcs_[a].next_)
+        gc_stack_.push_back(arcs_[a].prevstate_);
+    }
+  }
+
+  // Create an OpenFst version of the best sequence ending in state s, the
+  // sequence starts with the committed labels
+  template<class Arc>
+  int GetBestSequence(LatticeState s, MutableFst<Arc>* ofst) const {
+    // PROFILE_FUNC();  // Commented out because this is slow
+    vector<LatticeState> path;
+    for (; s; s = states_[s].PrevState())
+      path.push_back(s);
+    int d = ofst->AddState();
+    ofst->SetStart(d);
+    for (int i = 0; i != settled_arcs_.size(); ++i) {
+      const LatticeArc& arc = settled_arcs_[i];
+      int n = ofst->AddState();
+      ofst->AddArc(d, Arc(arc.ilabel_, arc.olabel_, Arc::Weight::One(), n));
+      d = n;
+    }
+    if (path.back() == committed_) {
+      for (int i = 0; i != committed_arcs_.size(); ++i) {
+        const LatticeArc& arc = committed_arcs_[i];
+        int n = ofst->AddState();
+        ofst->AddArc(d, Arc(arc.ilabel_, arc.olabel_, Arc::Weight::One(), n));
+        d = n;
+      }
+    }
+    for (int i = path.size() - 2; i >= 0; --i) {
+      const LatticeArc& arc = states_[path[i]].best_arc_;
+      int n = ofst->AddState();
+      ofst->AddArc(d, Arc(arc.ilabel_, arc.olabel_, Arc::Weight::One(), n));
+      d = n;
+    }
+    return d;
+  }
+
+  // Rescoring cost of ending the utterance in state s
+  float FinalCost(LatticeState s) const {
+    return rescorer_ ? rescorer_->FinalDelta(states_[s].lm_state_) : 0.0f;
+  }
+
+  // Final weight of the output lattice for a FinalCost, an LM weight
+  template<class W>
+  static void FinalWeight(float cost, W* w) {
+    LatticeArc(0, 0, 0, 0.0f, cost).ConvertWeight(w);
+  }
+
+  int NumStates() const { return num_states_; }
 
   int FreeListSize() const { return free_list_.size(); }
 
+  // Drop every state at once, the chunks are kept for the next utterance
   void Clear() {
     next_id_ = 0;
-    GcClearMarks();
-    GcSweep();
+    num_frees_ += num_states_;
+    Reset();
     DumpInfo();
+    // The LM state ids of the utterance are gone with the lattice states
+    if (rescorer_)
+      rescorer_->Clear();
     if (num_frees_ != num_allocs_)
       LOG(FATAL) << "Lattice state allocator mismatch detected " << endl
         << " # Allocs " << num_allocs_ << endl
@@ -367,95 +469,120 @@ class Lattice {
     num_allocs_ = 0;
   }
 
-  //Go through all the lattice states in the used_list_ and
-  //unmark them. In the next phase we mark the reachable states
-  void GcClearMarks() {
+  //Start a collection by unmarking the lattice states, in the next phase we
+  //mark the reachable states. A full collection unmarks every state in use,
+  //a minor one only the states created since the previous collection
+  void GcClearMarks(bool full = true) {
     PROFILE_FUNC();
-    for (int i = 0; i != used_list_.size(); ++i)
-      used_list_[i]->GcClearMark();
+    gc_full_ = full;
+    gc_oldest_root_ = 0;
+    if (full) {
+      for (int s = 1; s != states_.Size(); ++s)
+        states_[s].marked_ = 0;
+    } else {
+      for (int i = 0; i != young_.size(); ++i)
+        states_[young_[i]].marked_ = 0;
+    }
   }
 
-  //Free all the lattice states that are not used
-  int GcSweep(vector<int>* early_mission = 0) {
+  //Free all the lattice states that are not used. A full sweep is a single
+  //pass over the state arena that frees the unmarked states, numbers the
+  //survivors and copies their arcs to the spare arc arena. Free slots at
+  //the end of the state arena are trimmed and the lowest free slots are
+  //reused first. The words committed by the early mission are appended to
+  //early_mission, it needs the marks of a full collection
+  int GcSweep(vector<CommittedWord>* early_mission = 0) {
     PROFILE_FUNC();
-    int j = 0;
-    for (int i = 0; i != used_list_.size(); ++i) {
-      State* lattice_state = used_list_[i];
-      if (used_list_[i]->GcMarked()) {
-        //Check j is null or the same as i
-        lattice_state->SetIndex(j);
-        used_list_[j++] = lattice_state;
+    if (!gc_full_)
+      return GcSweepYoung();
+    if (incremental_)
+      SettleChunk(early_mission);
+    int num_reclaimed = 0;
+    int num_used = 0;
+    int end = 1;
+    LatticeState frontier = 0;
+    gc_arcs_.Truncate(0);
+    gc_arcs_.Add();
+    for (int s = 1; s != states_.Size(); ++s) {
+      State& ls = states_[s];
+      if (!ls.InUse())
+        continue;
+      if (ls.marked_) {
+        ls.index_ = num_used++;
+        int head = 0;
+        for (int a = ls.arcs_; a; a = arcs_[a].next_) {
+          int b = gc_arcs_.Add();
+          gc_arcs_[b] = arcs_[a];
+          gc_arcs_[b].next_ = head;
+          head = b;
+        }
+        ls.arcs_ = head;
+        if (!frontier || ls.id_ > states_[frontier].id_)
+          frontier = s;
+        end = s + 1;
       } else {
-        lattice_state->SetIndex(-1);
-        FreeState(used_list_[i]);
-        used_list_[i] = 0;
+        ls.Clear();
+        ++num_frees_;
+        --num_states_;
+        ++num_reclaimed;
       }
     }
-
-    //Sanity check to make sure all the end of the used_list is all
-    //null probably can be removed at the end
-    for (int i = 0; i < j; ++i) {
-      assert(used_list_[i]);
-      assert(used_list_[i]->Index() == i);
+    arcs_.Swap(&gc_arcs_);
+    young_.clear();
+    gc_first_id_ = next_id_;
+    states_.Truncate(end);
+    free_list_.clear();
+    for (int s = end - 1; s > 0; --s)
+      if (!states_[s].InUse())
+        free_list_.push_back(s);
+    if (committed_ && (committed_ >= end || !states_[committed_].InUse())) {
+      committed_ = 0;
+      committed_arcs_.clear();
     }
-    //Resize down the end of the used_list
-    int num_reclaimed = used_list_.size() - j;
-    used_list_.resize(j);
+
     VLOG(1) << "Lattice Gc reclaimed " << num_reclaimed
-      << " states # in used_list "
-      << used_list_.size() << " # in free_list " << free_list_.size();
-
-    if (early_mission) {
-      //Work backward from a frontier node.
-      vector<State*> stack;
-      for (State* ls = used_list_.back(); !ls->IsStart();
-          ls = ls->PrevState())
-        stack.push_back(ls);
-
-      while (!stack.empty()) {
-        State *ls = stack.back();
-        stack.pop_back();
-        if (ls->OLabel())
-          early_mission->push_back(ls->OLabel());
-        if (ls->marked_ > 1) {
-          VLOG(2) << "Common prefix found index = " << ls->Index()
-            << " id = " << ls->Id();
-          break;
-        }
-      }
-    }
+      << " states # in use "
+      << num_states_ << " # in free_list " << free_list_.size();
+
+    if (early_mission && frontier)
+      Commit(frontier, early_mission);
     return num_reclaimed;
   }
 
   template<class Arc>
-  int GetLattice(State* state, MutableFst<Arc>* ofst) {
+  int GetLattice(LatticeState state, MutableFst<Arc>* ofst) {
+    if (incremental_)
+      return GetSettledLattice(state, ofst);
     GcClearMarks();
-    state->GcMark();
-    //After GcSweep the used_list indexes should be contigous
-    //therefore we don't need to do any relabelling or convert
-    //pointer to indexes
+    GcMark(state);
+    //After GcSweep the indexes of the states in use are contiguous
+    //therefore they can be used as the output state ids
     GcSweep();
 
-    while (ofst->NumStates() < used_list_.size())
+    while (ofst->NumStates() < num_states_)
       ofst->AddState();
     int numarcs = 0;
-    for (int i = 0; i != used_list_.size(); ++i) {
-      const State& ls = *used_list_[i];
+    for (int s = 1; s != states_.Size(); ++s) {
+      const State& ls = states_[s];
+      if (!ls.InUse())
+        continue;
       if (ls.IsStart()) {
         ofst->SetStart(ls.index_);
       } else {
-        for (int j = 0; j != ls.arcs_.size(); ++j) {
-          const LatticeArc& arc = ls.arcs_[j];
+        for (int a = ls.arcs_; a; a = arcs_[a].next_) {
+          const LatticeArc& arc = arcs_[a];
           typename Arc::Weight w;
           arc.ConvertWeight(&w);
-          int s = arc.prevstate_->Index();
+          int p = states_[arc.prevstate_].Index();
           int d = ls.Index();
-          ofst->AddArc(s, Arc(arc.ilabel_, arc.olabel_, w, d));
+          ofst->AddArc(p, Arc(arc.ilabel_, arc.olabel_, w, d));
           ++numarcs;
         }
       }
     }
-    ofst->SetFinal(state->Index(), Arc::Weight::One());
+    typename Arc::Weight w;
+    FinalWeight(FinalCost(state), &w);
+    ofst->SetFinal(states_[state].Index(), w);
     return numarcs;
   }
 
@@ -467,15 +594,23 @@ class Lattice {
     return ss.str();
   }
 
-  //Debug function to build a tranducers from the partial traceback
+  //Debug function to build a tranducers from the partial traceback, the
+  //states are numbered in the order of the arena
   template<class Arc>
   void DumpToFst(VectorFst<Arc>* ofst, fst::SymbolTable* ssyms = 0) {
     typedef typename Arc::Weight W;
-    while(ofst->NumStates() < used_list_.size())
-      ofst->AddState();
-    ofst->SetStart(0);
-    for (int i = 0; i != used_list_.size(); ++i) {
-      const State &state = *used_list_[i];
+    vector<int> ids(states_.Size(), -1);
+    for (int s = 1; s != states_.Size(); ++s)
+      if (states_[s].InUse()) {
+        ids[s] = ofst->AddState();
+      }
+    if (ofst->NumStates())
+      ofst->SetStart(0);
+    for (int s = 1; s != states_.Size(); ++s) {
+      const State &state = states_[s];
+      if (!state.InUse())
+        continue;
+      int i = ids[s];
       if (!state.marked_)
         ofst->SetFinal(i, W::One());
       if (ssyms) {
@@ -485,19 +620,19 @@ class Lattice {
       }
       if (!i)
         continue;
-      if (state.arcs_.size()) {
-        for (int j = 0; j != state.arcs_.size(); ++j) {
-          const LatticeArc &arc = state.arcs_[j];
+      if (state.arcs_) {
+        for (int a = state.arcs_; a; a = arcs_[a].next_) {
+          const LatticeArc &arc = arcs_[a];
           W w;
           arc.ConvertWeight(&w);
-          ofst->AddArc(arc.PrevState()->Index(),
+          ofst->AddArc(ids[arc.prevstate_],
               StdArc(arc.ilabel_, arc.olabel_, w, i));
         }
-      } else {
-        const LatticeArc &arc = used_list_[i]->best_arc_;
+      } else if (state.best_arc_.prevstate_) {
+        const LatticeArc &arc = state.best_arc_;
         W w;
         arc.ConvertWeight(&w);
-        ofst->AddArc(used_list_[i]->PrevStateIndex(), StdArc(arc.ilabel_,
+        ofst->AddArc(ids[arc.prevstate_], StdArc(arc.ilabel_,
               arc.olabel_, w, i));
       }
     }
@@ -510,32 +645,261 @@ class Lattice {
     static string type = "GenericLattice";
     return type;
   }
-  //Debugging and check functions
-  void SortLists() {
-    if (!use_pool_)
-      LOG(FATAL) << "Lattice allocator pooling must be enable "
-        "to check the lattice consistency";
-    std::sort(used_list_.begin(), used_list_.end());
-    std::sort(free_list_.begin(), free_list_.end());
-  }
 
-  bool IsActive(State* state) const {
-    return std::binary_search(used_list_.begin(), used_list_.end(), state);
+  // Supports rescoring_lm and incremental_lattice
+  static bool CanRescore() { return true; }
+
+  static bool CanSettle() { return true; }
+
+  const State& GetState(LatticeState s) const { return states_[s]; }
+
+  //Debugging and check functions, the arena can be checked directly so the
+  //lists no longer need to be sorted
+  void SortLists() { }
+
+  bool IsActive(LatticeState state) const {
+    return state > 0 && state < states_.Size() && states_[state].InUse();
   }
 
-  bool IsFree(State* state) const {
-    return std::binary_search(free_list_.begin(), free_list_.end(), state);
+  bool IsFree(LatticeState state) const {
+    return state > 0 && state < states_.Size() && !states_[state].InUse();
   }
 
  protected:
-  vector<State*> used_list_;
-  vector<State*> free_list_;
+  // Empty the arenas, slot 0 is reserved as the null state and arc
+  void Reset() {
+    states_.Truncate(0);
+    states_.Add();
+    arcs_.Truncate(0);
+    arcs_.Add();
+    free_list_.clear();
+    young_.clear();
+    num_states_ = 0;
+    gc_first_id_ = 0;
+    committed_ = 0;
+    committed_arcs_.clear();
+    gc_oldest_root_ = 0;
+    settled_.DeleteStates();
+    settled_arcs_.clear();
+  }
+
+  // Live states ordered by creation, the root first. Each state's index is
+  // set to its position
+  void SortLiveStates(vector<LatticeState>* order) {
+    order->clear();
+    for (int s = 1; s != states_.Size(); ++s)
+      if (states_[s].InUse() && states_[s].marked_)
+        order->push_back(s);
+    sort(order->begin(), order->end(), IdLess(states_));
+    for (int i = 0; i != order->size(); ++i)
+      states_[(*order)[i]].index_ = i;
+  }
+
+  // Determinize the lattice of the first n states of order, which ends in
+  // the last of them with final_cost, and append it to the settled lattice
+  void Settle(const vector<LatticeState>& order, int n,
+              float final_cost = 0.0f) {
+    typedef KaldiLatticeArc::Weight W;
+    VectorFst<KaldiLatticeArc> chunk;
+    for (int i = 0; i != n; ++i)
+      chunk.AddState();
+    chunk.SetStart(0);
+    W final_weight;
+    FinalWeight(final_cost, &final_weight);
+    chunk.SetFinal(n - 1, final_weight);
+    for (int i = 1; i != n; ++i) {
+      const State& ls = states_[order[i]];
+      // The best arc is only one of the arcs when there are lattice arcs
+      int a = ls.arcs_;
+      const LatticeArc* arc = a ? &arcs_[a] : &ls.best_arc_;
+      while (arc) {
+        W w;
+        arc->ConvertWeight(&w);
+        chunk.AddArc(states_[arc->prevstate_].index_,
+                     KaldiLatticeArc(arc->ilabel_, arc->olabel_, w, i));
+        a = a ? arcs_[a].next_ : 0;
+        arc = a ? &arcs_[a] : 0;
+      }
+    }
+    fst::Project(&chunk, fst::PROJECT_OUTPUT);
+    fst::RmEpsilon(&chunk);
+    VectorFst<KaldiLatticeArc> det;
+    fst::DeterminizeOptions<KaldiLatticeArc> opts(fst::kDelta,
+                                                  W(lattice_beam_, 0));
+    fst::Determinize(chunk, &det, opts);
+    if (settled_.Start() == kNoStateId)
+      settled_ = det;
+    else
+      fst::Concat(&settled_, det);
+  }
+
+  // Settle the lattice behind the newest cut state. Each arc covers the
+  // positions between its states and the oldest token covers every later
+  // position, an uncovered position is a cut. The states behind the cut
+  // are unmarked and freed by the sweep, the words of its best path go to
+  // early_mission
+  void SettleChunk(vector<CommittedWord>* early_mission) {
+    if (!gc_oldest_root_)
+      return;
+    vector<LatticeState> order;
+    SortLiveStates(&order);
+    int last = states_[gc_oldest_root_].index_;
+    vector<int> cover(order.size() + 1, 0);
+    for (int i = 1; i != order.size(); ++i) {
+      const State& ls = states_[order[i]];
+      if (!ls.arcs_ && ls.best_arc_.prevstate_) {
+        ++cover[states_[ls.best_arc_.prevstate_].index_ + 1];
+        --cover[i];
+      }
+      for (int a = ls.arcs_; a; a = arcs_[a].next_) {
+        ++cover[states_[arcs_[a].prevstate_].index_ + 1];
+        --cover[i];
+      }
+    }
+    int cut = 0;
+    for (int i = 1, covered = cover[0]; i <= last; ++i) {
+      covered += cover[i];
+      if (!covered)
+        cut = i;
+    }
+    if (cut) {
+      Settle(order, cut + 1);
+      LatticeState c = order[cut];
+      vector<LatticeState> path;
+      for (LatticeState s = c; !states_[s].IsStart();
+           s = states_[s].PrevState())
+        path.push_back(s);
+      // The words up to the committed state have already been reported
+      int committed_id = committed_ ? states_[committed_].id_ : -1;
+      for (int i = path.size() - 1; i >= 0; --i) {
+        const State& ls = states_[path[i]];
+        settled_arcs_.push_back(ls.best_arc_);
+        if (early_mission && ls.OLabel() && ls.id_ > committed_id)
+          early_mission->push_back(CommittedWord(ls.OLabel(), ls.Time()));
+      }
+      for (int i = 0; i != cut; ++i)
+        states_[order[i]].marked_ = 0;
+      states_[c].best_arc_.prevstate_ = 0;
+      states_[c].arcs_ = 0;
+      VLOG(1) << "Settled " << cut << " lattice states, cut at time "
+        << states_[c].Time();
+    }
+  }
+
+  // The settled chunks followed by the determinized last chunk, which ends
+  // in state
+  template<class Arc>
+  int GetSettledLattice(LatticeState state, MutableFst<Arc>* ofst) {
+    vector<LatticeState> order;
+    GcClearMarks();
+    GcMark(state);
+    SortLiveStates(&order);
+    Settle(order, order.size(), FinalCost(state));
+    ofst->DeleteStates();
+    for (int s = 0; s != settled_.NumStates(); ++s)
+      ofst->AddState();
+    ofst->SetStart(settled_.Start());
+    int numarcs = 0;
+    for (int s = 0; s != settled_.NumStates(); ++s) {
+      typename Arc::Weight w;
+      ConvertWeight(settled_.Final(s), &w);
+      ofst->SetFinal(s, w);
+      for (fst::ArcIterator<VectorFst<KaldiLatticeArc> > aiter(settled_, s);
+           !aiter.Done(); aiter.Next()) {
+        const KaldiLatticeArc& arc = aiter.Value();
+        ConvertWeight(arc.weight, &w);
+        ofst->AddArc(s, Arc(arc.ilabel, arc.olabel, w, arc.nextstate));
+        ++numarcs;
+      }
+    }
+    settled_.DeleteStates();
+    return numarcs;
+  }
+
+  struct IdLess {
+    explicit IdLess(const ChunkedArray<State>& states) : states(states) { }
+    bool operator()(LatticeState a, LatticeState b) const {
+      return states[a].id_ < states[b].id_;
+    }
+    const ChunkedArray<State>& states;
+  };
+
+  // Extend the committed prefix along the best path of the frontier state.
+  // A state every hypothesis passes through that is referenced only once
+  // passes that on to its referrer, so starting from the previous committed
+  // state (or the start) the prefix grows until a state with several
+  // referrers is reached
+  void Commit(LatticeState frontier, vector<CommittedWord>* words) {
+    vector<LatticeState> stack;
+    LatticeState s = frontier;
+    for (; s != committed_ && !states_[s].IsStart();
+         s = states_[s].PrevState())
+      stack.push_back(s);
+    LatticeState root = s;
+    while (!stack.empty() && states_[s].marked_ == 1) {
+      s = stack.back();
+      stack.pop_back();
+      const State& ls = states_[s];
+      if (ls.OLabel())
+        words->push_back(CommittedWord(ls.OLabel(), ls.Time()));
+      if (truncate_committed_)
+        committed_arcs_.push_back(ls.best_arc_);
+    }
+    if (s == root)
+      return;
+    VLOG(2) << "Common prefix found index = " << states_[s].Index()
+      << " id = " << states_[s].Id();
+    committed_ = s;
+    if (truncate_committed_) {
+      // The states behind the new root are freed by the next full sweep
+      states_[s].best_arc_.prevstate_ = 0;
+      states_[s].arcs_ = 0;
+    }
+  }
+
+  // Minor sweep, frees the unmarked states created since the previous
+  // collection. Their arcs stay in the arc arena until the next full sweep
+  int GcSweepYoung() {
+    int num_reclaimed = 0;
+    for (int i = 0; i != young_.size(); ++i) {
+      LatticeState s = young_[i];
+      State& ls = states_[s];
+      if (ls.InUse() && !ls.marked_) {
+        FreeState(s);
+        ++num_reclaimed;
+      }
+    }
+    young_.clear();
+    gc_first_id_ = next_id_;
+    VLOG(1) << "Lattice minor Gc reclaimed " << num_reclaimed
+      << " states # in use "
+      << num_states_ << " # in free_list " << free_list_.size();
+    return num_reclaimed;
+  }
+
+  ChunkedArray<State> states_;
+  ChunkedArray<LatticeArc> arcs_;
+  ChunkedArray<LatticeArc> gc_arcs_;  // Arcs of the survivors during a sweep
+  vector<LatticeState> free_list_;  // Free slots, reused from the back
+  vector<LatticeState> young_;  // Created since the previous collection
+  vector<LatticeState> gc_stack_;  // Pending states of GcMark
   Logger logger_;
   int next_id_;
   //Sanity check, num_allocs_ should equal num_frees_ after decoding
   int num_allocs_;
   int num_frees_;
-  bool use_pool_;
+  int num_states_;  // Number of states in use
+  bool gc_full_;  // Whether the current collection is a full one
+  int gc_first_id_;  // First id given out after the previous collection
+  LatticeState committed_;  // End of the committed prefix, 0 if none
+  bool truncate_committed_;  // Free the states behind the committed state
+  vector<LatticeArc> committed_arcs_;  // Best arcs of the freed prefix
+  bool incremental_;  // Settle the lattice chunk by chunk
+  float lattice_beam_;
+  LatticeState gc_oldest_root_;  // Oldest state marked from a token
+  VectorFst<KaldiLatticeArc> settled_;  // Determinized settled chunks
+  vector<LatticeArc> settled_arcs_;  // Best arcs of the settled chunks
+  LmRescorer* rescorer_;  // Null unless rescoring on the fly
  private:
   DISALLOW_COPY_AND_ASSIGN(Lattice);
 };
@@ -0,0 +1,279 @@
+// lm-rescorer.h
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// On-the-fly language model rescoring. The search graph is built with a
+// small LM and every word the lattice adds is rescored with the difference
+// between a big LM and the small one, so the big LM is never composed into
+// the graph.
+//
+// Both LMs are backoff n-gram acceptors, words on the input labels and the
+// backoff arcs on epsilon. A word missing from a state is looked up in the
+// backoff states. Without the small LM the big one is taken to already hold
+// the big minus small costs. Words missing from either LM are not rescored.
+
+#ifndef DCD_LM_RESCORER_H__
+#define DCD_LM_RESCORER_H__
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fst/fst.h>
+
+#include <dcd/constants.h>
+#include <dcd/log.h>
+#include <dcd/stl.h>
+
+namespace dcd {
+
+// The LMs shared by the rescorers of every decoder, only read during search
+class RescoringLm {
+ public:
+  ~RescoringLm() {
+    delete big_;
+    if (small_)
+      delete small_;
+  }
+
+  // Returns null if an LM can't be read or can't be searched, small may be
+  // empty
+  static RescoringLm* Read(const string& big, const string& small) {
+    StdFst* big_fst = ReadLm(big);
+    if (!big_fst)
+      return 0;
+    StdFst* small_fst = 0;
+    if (!small.empty()) {
+      small_fst = ReadLm(small);
+      if (!small_fst) {
+        delete big_fst;
+        return 0;
+      }
+    }
+    return new RescoringLm(big_fst, small_fst);
+  }
+
+  // LM state of the big and the small LM at the start of an utterance
+  pair<int, int> Start() const {
+    return pair<int, int>(big_->Start(), small_ ? small_->Start() : 0);
+  }
+
+  // Big minus small cost of the word from state, state is moved past the
+  // word. Returns false and leaves the state if either LM lacks the word
+  bool Delta(int word, pair<int, int>* state, float* delta) const {
+    float big_cost;
+    float small_cost = 0;
+    int big_next;
+    int small_next = 0;
+    if (!Lookup(*big_, state->first, word, &big_next, &big_cost))
+      return false;
+    if (small_ &&
+        !Lookup(*small_, state->second, word, &small_next, &small_cost))
+      return false;
+    *state = pair<int, int>(big_next, small_next);
+    *delta = big_cost - small_cost;
+    return true;
+  }
+
+  // Big minus small cost of ending the utterance in state
+  float FinalDelta(const pair<int, int>& state) const {
+    float big_cost = FinalCost(*big_, state.first);
+    float small_cost = small_ ? FinalCost(*small_, state.second) : 0;
+    if (big_cost == kMaxCost || small_cost == kMaxCost)
+      return 0;
+    return big_cost - small_cost;
+  }
+
+ private:
+  RescoringLm(StdFst* big, StdFst* small) : big_(big), small_(small) { }
+
+  // The arcs are binary searched with a plain arc iterator, so the Fst must
+  // be expanded and sorted on the input labels
+  static StdFst* ReadLm(const string& filename) {
+    StdFst* fst = StdFst::Read(filename);
+    if (!fst) {
+      LOG(ERROR) << "Failed to read rescoring LM : " << filename;
+      return 0;
+    }
+    if (fst->Start() == kNoStateId ||
+        !fst->Properties(fst::kExpanded, false) ||
+        !fst->Properties(fst::kILabelSorted, true)) {
+      LOG(ERROR) << "Rescoring LM must be an expanded Fst with a start state"
+                 << " sorted on the input labels : " << filename;
+      delete fst;
+      return 0;
+    }
+    return fst;
+  }
+
+  // Position of the first arc with an input label of at least label
+  static size_t LowerBound(fst::ArcIterator<StdFst>* aiter, size_t num_arcs,
+                           int label) {
+    size_t low = 0;
+    size_t high = num_arcs;
+    while (low < high) {
+      size_t mid = (low + high) / 2;
+      aiter->Seek(mid);
+      if (aiter->Value().ilabel < label)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    return low;
+  }
+
+  // Cost of the word from state, including the backoff arcs taken
+  static bool Lookup(const StdFst& fst, int state, int word, int* next,
+                     float* cost) {
+    float backoff = 0;
+    for (;;) {
+      size_t num_arcs = fst.NumArcs(state);
+      fst::ArcIterator<StdFst> aiter(fst, state);
+      size_t i = LowerBound(&aiter, num_arcs, word);
+      if (i != num_arcs) {
+        aiter.Seek(i);
+        if (aiter.Value().ilabel == word) {
+          *next = aiter.Value().nextstate;
+          *cost = backoff + aiter.Value().weight.Value();
+          return true;
+        }
+      }
+      // The backoff arc sorts first
+      if (!num_arcs)
+        return false;
+      aiter.Seek(0);
+      if (aiter.Value().ilabel != 0)
+        return false;
+      backoff += aiter.Value().weight.Value();
+      state = aiter.Value().nextstate;
+    }
+  }
+
+  static float FinalCost(const StdFst& fst, int state) {
+    float backoff = 0;
+    for (;;) {
+      float final_cost = fst.Final(state).Value();
+      if (final_cost != StdArc::Weight::Zero().Value())
+        return backoff + final_cost;
+      fst::ArcIterator<StdFst> aiter(fst, state);
+      if (aiter.Done() || aiter.Value().ilabel != 0)
+        return kMaxCost;
+      backoff += aiter.Value().weight.Value();
+      state = aiter.Value().nextstate;
+    }
+  }
+
+  StdFst* big_;
+  StdFst* small_;  // Null if big_ holds the differences
+  DISALLOW_COPY_AND_ASSIGN(RescoringLm);
+};
+
+// The rescoring state of one decoder. The pairs of big and small LM states
+// are numbered and the deltas are cached by LM state and word, the cache is
+// emptied when it grows over its limit. The numbering only has to last for
+// an utterance, Clear drops it with the cache between utterances
+class LmRescorer {
+ public:
+  LmRescorer(const RescoringLm& lm, float scale, size_t max_bytes)
+      : lm_(lm), scale_(scale), max_bytes_(max_bytes), num_hits_(0),
+        num_misses_(0) {
+    start_ = FindState(lm.Start());
+  }
+
+  int Start() const { return start_; }
+
+  // Forget the LM states and the deltas, no lattice state may still hold
+  // one of the ids
+  void Clear() {
+    states_.clear();
+    ids_.clear();
+    cache_.clear();
+    num_hits_ = 0;
+    num_misses_ = 0;
+    start_ = FindState(lm_.Start());
+  }
+
+  // Scaled delta of the word from the LM state, state is moved past the
+  // word. Words that can't be rescored leave the state and cost nothing
+  float Delta(int word, int* state) {
+    uint64 key = static_cast<uint64>(*state) << 32 | static_cast<uint32>(word);
+    unordered_map<uint64, Entry>::const_iterator it = cache_.find(key);
+    if (it != cache_.end()) {
+      ++num_hits_;
+      *state = it->second.next;
+      return it->second.delta;
+    }
+    ++num_misses_;
+    if (max_bytes_ && cache_.size() * kBytesPerEntry > max_bytes_)
+      cache_.clear();
+    pair<int, int> lm_state = states_[*state];
+    float delta = 0;
+    Entry& entry = cache_[key];
+    entry.next = *state;
+    entry.delta = 0;
+    if (lm_.Delta(word, &lm_state, &delta)) {
+      entry.next = FindState(lm_state);
+      entry.delta = scale_ * delta;
+    }
+    *state = entry.next;
+    return entry.delta;
+  }
+
+  float FinalDelta(int state) const {
+    return scale_ * lm_.FinalDelta(states_[state]);
+  }
+
+  int NumStates() const { return states_.size(); }
+
+  int64 NumHits() const { return num_hits_; }
+
+  int64 NumMisses() const { return num_misses_; }
+
+ private:
+  struct Entry {
+    int next;
+    float delta;
+  };
+
+  // Rough cost of a cache entry including the hash node
+  static const size_t kBytesPerEntry = 4 * sizeof(void*) + sizeof(Entry);
+
+  int FindState(const pair<int, int>& lm_state) {
+    uint64 key = static_cast<uint64>(lm_state.first) << 32 |
+      static_cast<uint32>(lm_state.second);
+    unordered_map<uint64, int>::const_iterator it = ids_.find(key);
+    if (it != ids_.end())
+      return it->second;
+    int id = states_.size();
+    states_.push_back(lm_state);
+    ids_[key] = id;
+    return id;
+  }
+
+  const RescoringLm& lm_;
+  float scale_;
+  size_t max_bytes_;  // 0 for no limit
+  int start_;
+  std::vector<pair<int, int> > states_;  // Big and small LM state by id
+  unordered_map<uint64, int> ids_;  // Id of a pair of LM states
+  unordered_map<uint64, Entry> cache_;  // Keyed by LM state and word
+  int64 num_hits_;
+  int64 num_misses_;
+  DISALLOW_COPY_AND_ASSIGN(LmRescorer);
+};
+
+}  // namespace dcd
+
+#endif  // DCD_LM_RESCORER_H__
@@ -0,0 +1,98 @@
+// mapped-file.h
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// Read-only memory mapping of a whole file and the helpers shared by the
+// mapped model formats. The pages are shared with every other process that
+// maps the same file.
+
+#ifndef DCD_MAPPED_FILE_H__
+#define DCD_MAPPED_FILE_H__
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <string>
+
+#include <fst/compat.h>
+
+#include <dcd/log.h>
+
+namespace dcd {
+
+class MappedFile {
+ public:
+  ~MappedFile() { munmap(data_, size_); }
+
+  // Returns null if the file can't be opened or mapped or is smaller than
+  // min_size bytes
+  static MappedFile* Map(const std::string& filename, size_t min_size = 0) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      LOG(ERROR) << "Failed to open : " << filename;
+      return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+        st.st_size < static_cast<off_t>(min_size)) {
+      LOG(ERROR) << "File is empty or truncated : " << filename;
+      close(fd);
+      return 0;
+    }
+    void* data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);  // The mapping keeps the file open
+    if (data == MAP_FAILED) {
+      LOG(ERROR) << "Failed to map : " << filename;
+      return 0;
+    }
+    return new MappedFile(data, st.st_size);
+  }
+
+  const char* Data() const { return static_cast<const char*>(data_); }
+
+  size_t Size() const { return size_; }
+
+ private:
+  MappedFile(void* data, size_t size) : data_(data), size_(size) { }
+
+  void* data_;
+  size_t size_;
+  DISALLOW_COPY_AND_ASSIGN(MappedFile);
+};
+
+// True if the file starts with the 32 bit magic number
+inline bool HasMagicNumber(const std::string& filename, int32 magic) {
+  std::ifstream ifs(filename.c_str(), std::ifstream::binary);
+  int32 value = 0;
+  ifs.read(reinterpret_cast<char*>(&value), sizeof(value));
+  return ifs.good() && value == magic;
+}
+
+// FNV-1a hash of a block, used to detect corrupt model files
+inline uint32 Checksum(const char* data, size_t size,
+                       uint32 hash = 2166136261u) {
+  for (size_t i = 0; i != size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+}  // namespace dcd
+
+#endif  // DCD_MAPPED_FILE_H__
@@ -0,0 +1,35 @@
+// partial-result.h
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// Words of the stable partial result. With the early_mission option the
+// lattice commits the prefix shared by every surviving hypothesis during
+// garbage collection, the words of that prefix will not change anymore.
+
+#ifndef DCD_PARTIAL_RESULT_H__
+#define DCD_PARTIAL_RESULT_H__
+
+namespace dcd {
+
+struct CommittedWord {
+  CommittedWord(int olabel, int time) : olabel(olabel), time(time) { }
+
+  int olabel;  // Output label of the search Fst
+  int time;  // Frame in which the word was left
+};
+
+}  // namespace dcd
+
+#endif  // DCD_PARTIAL_RESULT_H__
@@ -0,0 +1,505 @@
+// search-graph-cache.h
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// Static part of the search states. For each Fst state the emitting arcs,
+// the epsilon like arcs (or the cached epsilon closure) and the final cost
+// are compiled once into a SearchStateInfo record that never changes. The
+// decoders keep only the tokens and the activation bookkeeping in their own
+// search states and point at these records.
+//
+// Over an expanded Fst the records live in a table indexed by state id and
+// are published with an atomic compare and swap, so one cache can be shared
+// by every decoder thread of a process. Lazy Fsts use a hash map and the
+// cache must then stay private to one decoder. The hashed cache can be
+// bounded with graph_cache_size, Trim then evicts the least recently used
+// records that no search state refers to. States near the start and the
+// destinations of the backoff arcs can be pinned in the cache. The records
+// of an expanded Fst can also be written once with Write and later mapped
+// read-only from a CompiledSearchGraph, the cache is then only a view of
+// the mapping.
+
+#ifndef DCD_SEARCH_GRAPH_CACHE_H__
+#define DCD_SEARCH_GRAPH_CACHE_H__
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <new>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fst/compat.h>
+#include <fst/expanded-fst.h>
+#include <fst/fst.h>
+
+#include <dcd/compiled-search-graph.h>
+#include <dcd/constants.h>
+#include <dcd/kaldi-lattice-arc.h>
+#include <dcd/log.h>
+#include <dcd/search-opts.h>
+#include <dcd/stl.h>
+
+namespace dcd {
+
+// Function to convert a weight to scale value sot the decoder is able
+// to operate on any weight semiring, optional time paramter allow certain
+// weigths and arcs to be controlled at specific times.
+template<class Weight>
+inline float Value(const Weight& w, int time = -1) {
+  return w.Value();
+}
+
+inline float Value(const KaldiLatticeWeight& w, int time = -1) {
+  return w.Value1() + w.Value2();
+}
+
+// Fields of a search arc that only depend on the Fst
+struct SearchArcInfo {
+  int ilabel;  // input label of the search transducer
+  int olabel;  // output label of the search transducer
+  float weight;  // The weight from the Fst plus the insertion penalty
+  int nextstate;  // next state of the search transducer
+  float exit_weight;  // Weight for the final transition in the HMM
+  int num_states;  // number of states in the underlying transition model
+};
+
+// The emitting arcs followed by the epsilon like arcs are stored directly
+// after the record. With a cached epsilon closure the first num_closed_eps
+// epsilon arcs lead to states whose own closure is already included
+struct SearchStateInfo {
+  float final_cost;
+  int num_arcs;
+  int num_eps_arcs;
+  int num_closed_eps_arcs;
+
+  const SearchArcInfo* Arcs() const {
+    return reinterpret_cast<const SearchArcInfo*>(this + 1);
+  }
+
+  const SearchArcInfo* EpsArcs() const { return Arcs() + num_arcs; }
+
+  int NumArcSlots() const { return num_arcs + num_eps_arcs; }
+};
+
+template<class F, class TM>
+class SearchGraphCache {
+ public:
+  typedef F FST;
+  typedef TM TransModel;
+  typedef typename F::Arc Arc;
+  // A record of the hashed cache and the last trim it was used in
+  struct CacheEntry {
+    CacheEntry() : info(0), stamp(0) { }
+    const SearchStateInfo* info;
+    int stamp;
+  };
+
+  typedef typename HashMapHelper<int, CacheEntry>::HashMap InfoHash;
+
+  SearchGraphCache(const F& fst, const TM& trans_model,
+                   const SearchOptions& opts)
+      : fst_(&fst), trans_model_(trans_model), opts_(opts), compiled_(0),
+        num_table_states_(0), table_(0), num_states_(0), num_bytes_(0),
+        max_bytes_(static_cast<size_t>(opts.graph_cache_size) * kMegaByte),
+        stamp_(0), num_hits_(0), num_misses_(0), num_evictions_(0) {
+    if (fst.Properties(fst::kExpanded, false)) {
+      num_table_states_ = fst::CountStates(fst);
+      table_ = new std::atomic<const SearchStateInfo*>[num_table_states_];
+      for (int i = 0; i != num_table_states_; ++i)
+        table_[i].store(0, std::memory_order_relaxed);
+    } else if (opts.graph_cache_pin_depth > 0) {
+      PinStart(opts.graph_cache_pin_depth);
+    }
+  }
+
+  // View of a compiled graph, the records were compiled with the options
+  // and the transition model of the graph which must match opts and
+  // trans_model
+  SearchGraphCache(const CompiledSearchGraph& compiled, const TM& trans_model,
+                   const SearchOptions& opts)
+      : fst_(0), trans_model_(trans_model), opts_(opts), compiled_(&compiled),
+        num_table_states_(0), table_(0), num_states_(0), num_bytes_(0),
+        max_bytes_(0), stamp_(0), num_hits_(0), num_misses_(0),
+        num_evictions_(0) {
+    if (!compiled.Compatible(opts, trans_model))
+      LOG(FATAL) << "Search options or transition model don't match the "
+                 << "compiled search graph";
+  }
+
+  ~SearchGraphCache() {
+    for (int i = 0; i != num_table_states_; ++i)
+      Delete(table_[i].load(std::memory_order_relaxed));
+    delete[] table_;
+    for (typename InfoHash::iterator it = hash_.begin(); it != hash_.end();
+         ++it)
+      Delete(it->second.info);
+  }
+
+  // Returns the record of state, compiling it on the first request. Returns
+  // null if an arc leaving the state has a label the transition model
+  // doesn't know
+  const SearchStateInfo* Find(int state) {
+    if (compiled_)
+      return compiled_->State(state);
+    if (table_) {
+      const SearchStateInfo* info =
+        table_[state].load(std::memory_order_acquire);
+      if (info)
+        return info;
+      SearchStateInfo* compiled = Compile(state);
+      if (!compiled)
+        return 0;
+      const SearchStateInfo* expected = 0;
+      if (!table_[state].compare_exchange_strong(expected, compiled,
+                                                 std::memory_order_acq_rel)) {
+        // Another thread compiled the same state first
+        Delete(compiled);
+        return expected;
+      }
+      num_states_.fetch_add(1, std::memory_order_relaxed);
+      num_bytes_.fetch_add(Bytes(compiled->NumArcSlots()),
+                           std::memory_order_relaxed);
+      return compiled;
+    }
+    typename InfoHash::iterator it = hash_.find(state);
+    if (it != hash_.end()) {
+      ++num_hits_;
+      it->second.stamp = stamp_;
+      return it->second.info;
+    }
+    ++num_misses_;
+    SearchStateInfo* compiled = Compile(state);
+    if (compiled) {
+      CacheEntry& entry = hash_[state];
+      entry.info = compiled;
+      entry.stamp = stamp_;
+      num_states_.fetch_add(1, std::memory_order_relaxed);
+      num_bytes_.fetch_add(Bytes(compiled->NumArcSlots()),
+                           std::memory_order_relaxed);
+    }
+    return compiled;
+  }
+
+  // Bring a bounded hashed cache back under its limit. The records for
+  // which in_use returns true are referenced by search states and count
+  // as used now, the least recently used of the others are evicted until
+  // the cache is kGraphCacheLowWater of its limit. Returns the number of
+  // evicted records. The expanded and the compiled graphs are shared by
+  // the decoding threads and never trimmed, so return before the stamp
+  template<class P>
+  int Trim(P in_use) {
+    if (table_ || compiled_ || !max_bytes_)
+      return 0;
+    ++stamp_;
+    if (Size() <= max_bytes_)
+      return 0;
+    std::vector<std::pair<int, int> > lru;  // Stamp and state
+    lru.reserve(hash_.size());
+    for (typename InfoHash::iterator it = hash_.begin(); it != hash_.end();
+         ++it) {
+      if (in_use(it->first))
+        it->second.stamp = stamp_;
+      else if (!pinned_.count(it->first))
+        lru.push_back(std::make_pair(it->second.stamp, it->first));
+    }
+    std::sort(lru.begin(), lru.end());
+    size_t target = max_bytes_ * kGraphCacheLowWater;
+    int num_evicted = 0;
+    for (int i = 0; i != lru.size() && Size() > target; ++i) {
+      typename InfoHash::iterator it = hash_.find(lru[i].second);
+      const SearchStateInfo* info = it->second.info;
+      num_states_.fetch_sub(1, std::memory_order_relaxed);
+      num_bytes_.fetch_sub(Bytes(info->NumArcSlots()),
+                           std::memory_order_relaxed);
+      Delete(info);
+      hash_.erase(it);
+      ++num_evicted;
+    }
+    num_evictions_ += num_evicted;
+    return num_evicted;
+  }
+
+  // Compiles every state of the expanded Fst and writes the records in the
+  // format mapped by CompiledSearchGraph
+  bool Write(const std::string& filename) {
+    if (!table_) {
+      LOG(ERROR) << "Only an expanded Fst can be compiled";
+      return false;
+    }
+    std::vector<int64> offsets(num_table_states_);
+    int64 num_arcs = 0;
+    int64 pos = 0;
+    for (int i = 0; i != num_table_states_; ++i) {
+      const SearchStateInfo* info = Find(i);
+      if (!info) {
+        LOG(ERROR) << "Invalid input label on an arc leaving state " << i;
+        return false;
+      }
+      offsets[i] = pos;
+      pos += Bytes(info->NumArcSlots());
+      num_arcs += info->NumArcSlots();
+    }
+    CompiledSearchGraphHeader header;
+    header.magic = kCompiledSearchGraphMagic;
+    header.version = kCompiledSearchGraphVersion;
+    header.num_states = num_table_states_;
+    header.start = fst_->Start();
+    header.num_arcs = num_arcs;
+    header.records_size = pos;
+    header.insertion_penalty = opts_.insertion_penalty;
+    header.trans_scale = opts_.trans_scale;
+    header.eps_closure = opts_.eps_closure;
+    header.num_hmms = trans_model_.NumHmms();
+    header.trans_model_checksum = TransModelChecksum(trans_model_);
+    header.reserved = 0;
+    std::ofstream ofs(filename.c_str(), std::ofstream::binary);
+    if (!ofs.is_open()) {
+      LOG(ERROR) << "Failed to open " << filename;
+      return false;
+    }
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (num_table_states_)
+      ofs.write(reinterpret_cast<const char*>(&offsets[0]),
+                num_table_states_ * sizeof(int64));
+    for (int i = 0; i != num_table_states_; ++i) {
+      const SearchStateInfo* info = Find(i);
+      ofs.write(reinterpret_cast<const char*>(info),
+                Bytes(info->NumArcSlots()));
+    }
+    return !ofs.fail();
+  }
+
+  // Only a cache over an expanded Fst or a compiled graph can be used by
+  // several threads
+  bool Shareable() const { return table_ != 0 || compiled_ != 0; }
+
+  int Start() const { return compiled_ ? compiled_->Start() : fst_->Start(); }
+
+  // Number of states of the search graph, -1 for a lazy Fst
+  int NumGraphStates() const {
+    if (compiled_)
+      return compiled_->NumStates();
+    return table_ ? num_table_states_ : -1;
+  }
+
+  // Number of compiled records
+  int NumStates() const {
+    if (compiled_)
+      return compiled_->NumStates();
+    return num_states_.load(std::memory_order_relaxed);
+  }
+
+  // Memory held by the compiled records in bytes, a compiled graph is mapped
+  // and only uses the pages touched during search
+  size_t Size() const {
+    if (compiled_)
+      return compiled_->Size();
+    return num_bytes_.load(std::memory_order_relaxed);
+  }
+
+  // Counters of the hashed cache, the other storages never miss or evict
+  int64 NumHits() const { return num_hits_; }
+
+  int64 NumMisses() const { return num_misses_; }
+
+  int64 NumEvictions() const { return num_evictions_; }
+
+  int NumPinned() const { return pinned_.size(); }
+
+ private:
+  static size_t Bytes(int num_arcs) {
+    return sizeof(SearchStateInfo) + num_arcs * sizeof(SearchArcInfo);
+  }
+
+  static void Delete(const SearchStateInfo* info) {
+    delete[] reinterpret_cast<const char*>(info);
+  }
+
+  // Pin the states less than depth arcs away from the start state, they
+  // are the entry of every utterance and are compiled straight away
+  void PinStart(int depth) {
+    std::vector<int> level(1, fst_->Start());
+    pinned_.insert(fst_->Start());
+    for (int d = 1; d < depth && !level.empty(); ++d) {
+      std::vector<int> next;
+      for (int i = 0; i != level.size(); ++i) {
+        const SearchStateInfo* info = Find(level[i]);
+        if (!info)
+          continue;
+        const SearchArcInfo* arcs = info->Arcs();
+        for (int j = 0; j != info->NumArcSlots(); ++j) {
+          if (pinned_.insert(arcs[j].nextstate).second)
+            next.push_back(arcs[j].nextstate);
+        }
+      }
+      level.swap(next);
+    }
+  }
+
+  SearchStateInfo* Compile(int state) {
+    int num_arcs = 0;
+    int num_eps_arcs = 0;
+    for (fst::ArcIterator<F> aiter(*fst_, state); !aiter.Done();
+         aiter.Next()) {
+      const Arc& arc = aiter.Value();
+      //  There are three cases
+      //  label > 0 standard transition arc
+      //  label = 0 epsilon arc
+      //  label < 0 disambiguation symbol to be treats
+      //  the same as an epsilon transition
+
+      //  verify the transition label is valid, can crash
+      //  if aux symbols are left in the CLG, or logical to
+      //  physical mapping is forgotten
+      if (!trans_model_.IsValidILabel(arc.ilabel))
+        return 0;
+      bool iseps = trans_model_.IsNonEmitting(arc.ilabel);
+      //  TODO what about emitting negative costs loops
+      if (iseps && state == arc.nextstate && Value(arc.weight) < 0)
+        LOG(FATAL) << "Negative epsilon cycle detected!";
+      if (iseps)
+        ++num_eps_arcs;
+      else
+        ++num_arcs;
+    }
+
+    std::vector<SearchArcInfo> closure;
+    int num_closed = 0;
+    bool use_closure = opts_.eps_closure && num_eps_arcs &&
+      ComputeEpsilonClosure(state, &closure, &num_closed);
+    int num_slots = num_arcs + (use_closure ? closure.size() : num_eps_arcs);
+
+    char* block = new char[Bytes(num_slots)];
+    SearchStateInfo* info = new (block) SearchStateInfo;
+    info->final_cost = Value(fst_->Final(state));
+    info->num_arcs = num_arcs;
+    info->num_eps_arcs = num_slots - num_arcs;
+    info->num_closed_eps_arcs = use_closure ? num_closed : 0;
+    SearchArcInfo* arcs = reinterpret_cast<SearchArcInfo*>(info + 1);
+    SearchArcInfo* eps_arcs = arcs + num_arcs;
+    if (use_closure)
+      std::copy(closure.begin(), closure.end(), eps_arcs);
+    for (fst::ArcIterator<F> aiter(*fst_, state); !aiter.Done();
+         aiter.Next()) {
+      const Arc& arc = aiter.Value();
+      bool iseps = trans_model_.IsNonEmitting(arc.ilabel);
+      // The backoff arcs of a language model are epsilon arcs without an
+      // output label and lead to the states most histories back off to
+      if (iseps && !arc.olabel && opts_.graph_cache_pin_backoff && !table_)
+        pinned_.insert(arc.nextstate);
+      if (iseps && use_closure)
+        continue;
+      SearchArcInfo& dest = iseps ? *eps_arcs++ : *arcs++;
+      dest.ilabel = arc.ilabel;
+      dest.olabel = arc.olabel;
+      dest.weight = Value(arc.weight) + opts_.insertion_penalty;
+      dest.nextstate = arc.nextstate;
+      //  Idea: If we always have to add the cost of the last transition
+      //  of the HMM then add it to the arc weight and prune with it before
+      //  we enter the state. Answer: Doesn't seem to work well
+      dest.exit_weight = trans_model_.GetExitWeight(arc.ilabel);
+      //  TODO is there any reason to allow epsilon transition to have
+      //  more than one token state?
+      dest.num_states = iseps ? 0 : trans_model_.NumStates(arc.ilabel);
+    }
+    return info;
+  }
+
+  // Label correcting pass over the epsilon like arcs leaving state. Every
+  // state reachable with at most one non-epsilon output label becomes an
+  // arc carrying the accumulated cost and that output label. A path stops
+  // before a second output label, the state where it stopped is flagged as
+  // open and still has its own epsilons expanded during search. Returns
+  // false if the closure is too large to be worth caching
+  bool ComputeEpsilonClosure(int state, std::vector<SearchArcInfo>* closure,
+                             int* num_closed) const {
+    typedef std::pair<int, int> Key;  // State and output label on the path
+    std::map<Key, float> dist;
+    std::set<Key> open;
+    std::set<Key> queued;
+    std::deque<Key> q;
+    Key start(state, 0);
+    dist[start] = 0.0f;
+    q.push_back(start);
+    queued.insert(start);
+    while (!q.empty()) {
+      Key key = q.front();
+      q.pop_front();
+      queued.erase(key);
+      float cost = dist[key];
+      for (fst::ArcIterator<F> aiter(*fst_, key.first); !aiter.Done();
+           aiter.Next()) {
+        const Arc& arc = aiter.Value();
+        if (!trans_model_.IsNonEmitting(arc.ilabel))
+          continue;
+        if (key.second && arc.olabel) {
+          open.insert(key);
+          continue;
+        }
+        Key next(arc.nextstate, arc.olabel ? arc.olabel : key.second);
+        float w = cost + Value(arc.weight) + opts_.insertion_penalty +
+          trans_model_.GetExitWeight(arc.ilabel);
+        typename std::map<Key, float>::iterator it = dist.find(next);
+        if (it == dist.end() || w < it->second) {
+          dist[next] = w;
+          if (dist.size() > kMaxEpsilonClosureSize)
+            return false;
+          if (queued.insert(next).second)
+            q.push_back(next);
+        }
+      }
+    }
+    // Closed arcs first
+    for (int pass = 0; pass != 2; ++pass) {
+      for (typename std::map<Key, float>::const_iterator it = dist.begin();
+           it != dist.end(); ++it) {
+        const Key& key = it->first;
+        if (key == start || (open.count(key) != 0) != (pass == 1))
+          continue;
+        SearchArcInfo arc = { 0, key.second, it->second, key.first, 0.0f, 0 };
+        closure->push_back(arc);
+      }
+      if (pass == 0)
+        *num_closed = closure->size();
+    }
+    return true;
+  }
+
+  const F* fst_;  // Null for a compiled graph
+  const TM& trans_model_;
+  const SearchOptions& opts_;
+  const CompiledSearchGraph* compiled_;
+  int num_table_states_;
+  std::atomic<const SearchStateInfo*>* table_;  // Indexed by state id
+  InfoHash hash_;  // Used instead of the table for lazy Fsts
+  std::atomic<int> num_states_;
+  std::atomic<size_t> num_bytes_;
+  size_t max_bytes_;  // Limit of the hashed cache, 0 for no limit
+  int stamp_;  // Incremented by every Trim
+  unordered_set<int> pinned_;  // Never evicted from the hashed cache
+  int64 num_hits_;
+  int64 num_misses_;
+  int64 num_evictions_;
+  DISALLOW_COPY_AND_ASSIGN(SearchGraphCache);
+};
+
+}  // namespace dcd
+
+#endif  // DCD_SEARCH_GRAPH_CACHE_H__
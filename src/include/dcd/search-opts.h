@@ -34,6 +34,8 @@ class SymbolTable;
 
 namespace dcd {
 
+class RescoringLm;
+
 struct Variant {
   Variant() : type(kNone) { }
 
@@ -77,51 +79,114 @@ struct SearchOptions {
     Variant value;
   };
 
-  SearchOptions() {
+  SearchOptions() : rescoring_lm(0) {
     Init(&beam, kDefaultBeam, "beam");
+    // The beam adapts to keep the number of active arcs between min_arcs
+    // and max_arcs, beam_delta is added to the beam implied by the cutoff
     Init(&band, kMaxArcs, "max_arcs");
+    Init(&min_band, 0, "min_arcs");
+    Init(&beam_delta, kDefaultBeamDelta, "beam_delta");
     Init(&acoustic_scale, kDefaultAcousticScale, "acoustic_scale");
     Init(&trans_scale, kDefaultTranScale, "trans_scale");
     Init(&use_lattice_pool, false, "use_lattice_pool");
     Init(&cache_destinatation_states, true, "cache_dest_states");
     Init(&gc_period, kDefaultGcPeriod, "gc_period");
+    // Every gc_full_period-th collection is a full one, the others only
+    // collect the lattice states created since the previous collection
+    Init(&gc_full_period, kDefaultGcFullPeriod, "gc_full_period");
     Init(&gc_check, false, "gc_check");
     // "Peform checking of the allocated states. "
     // "(Will cause substantial slow downs)"
     Init(&gen_lattice, false, "gen_lattice");  // Generate recognition lattices"
     Init(&lattice_beam, kDefaultBeam, "lattice_beam");
+    // Determinize the settled part of the lattice with the lattice beam
+    // during decoding, the lattice is then a word lattice
+    Init(&incremental_lattice, false, "incremental_lattice");
     Init(&use_search_pool, false, "use_search_pool");
-    Init(&fst_reset_period, 32, "fst_reset_period");
+    // Utterances between rebuilds of the cascade and the decoder, 0 never
+    // rebuilds and relies on the bounded caches below
+    Init(&fst_reset_period, 0, "fst_reset_period");
+    // Memory limits in MB of the composition cache of a lazy cascade and of
+    // the search graph cache built over it, 0 for no limit
+    Init(&compose_cache_size, kDefaultComposeCacheSize, "compose_cache_size");
+    Init(&graph_cache_size, kDefaultGraphCacheSize, "graph_cache_size");
+    // States less than graph_cache_pin_depth arcs from the start state and
+    // with graph_cache_pin_backoff the destinations of the backoff arcs are
+    // never evicted from the search graph cache
+    Init(&graph_cache_pin_depth, 0, "graph_cache_pin_depth");
+    Init(&graph_cache_pin_backoff, false, "graph_cache_pin_backoff");
+    // Weight of the big minus small LM costs added to the words by the
+    // rescoring LM and the memory limit in MB of the cache of the costs
+    Init(&lm_rescore_scale, 1.0f, "lm_rescore_scale");
+    Init(&lm_rescore_cache_size, kDefaultRescoreCacheSize,
+         "lm_rescore_cache_size");
     Init(&early_mission, false, "early_mission");
     Init(&dump_traceback, false, "dump_traceback");
+    // Weight of the fast match lookahead, the best score of the pdf group
+    // over the next lookahead_frames frames. Arcs whose cost plus the
+    // lookahead is outside lookahead_beam are pruned, 0 disables it
     Init(&acoustic_lookahead, 0.0f, "acoustic_lookahead");
+    Init(&lookahead_frames, kDefaultLookaheadFrames, "lookahead_frames");
+    Init(&lookahead_beam, kDefaultBeam, "lookahead_beam");
     Init(&colorize, true, "colorize");
     Init(&prune_eps, true, "prune_eps");
     Init(&nbest, 0, "nbest");
     Init(&insertion_penalty, 0.0f, "insertion_penalty");
+    Init(&batch_expand, false, "batch_expand");
+    Init(&eps_closure, false, "eps_closure");
+    // 0 no cache, 1 prescale every frame, 2 fill on demand
+    Init(&score_cache, 0, "score_cache");
+    Init(&arc_threads, 1, "arc_threads");
+    Init(&min_arcs_per_thread, kDefaultMinArcsPerThread,
+         "min_arcs_per_thread");
+    // 0 activation order, 1 sorted by ilabel, 2 sorted by address
+    Init(&arc_order, 0, "arc_order");
+    Init(&arc_order_period, kDefaultArcOrderPeriod, "arc_order_period");
+    Init(&arc_prefetch, 0, "arc_prefetch");
   }
 
   float beam;
-  int band;
+  int band;  // Maximum number of active arcs
+  int min_band;  // Minimum number of active arcs
+  float beam_delta;
   int nbest;
   float insertion_penalty;
   float acoustic_lookahead;
+  int lookahead_frames;
+  float lookahead_beam;
   float acoustic_scale;
   float trans_scale;
   float lattice_beam;
   const fst::SymbolTable* wordsyms;
   const fst::SymbolTable* phonesyms;
+  const RescoringLm* rescoring_lm;  // Null unless rescoring on the fly
   bool use_lattice_pool;
   bool cache_destinatation_states;
   int gc_period;
+  int gc_full_period;  // Collections between full lattice collections
   int fst_reset_period;
+  int compose_cache_size;  // MB
+  int graph_cache_size;  // MB
+  int graph_cache_pin_depth;
+  bool graph_cache_pin_backoff;
+  float lm_rescore_scale;
+  int lm_rescore_cache_size;  // MB
+  int arc_threads;  // Threads used to expand the active arcs of a frame
+  int min_arcs_per_thread;  // Smallest chunk of arcs given to a thread
+  int arc_order;  // Order of the active arcs during the expansion
+  int arc_order_period;  // Frames between sorts of the active arcs
+  int arc_prefetch;  // Arcs to prefetch ahead of the expansion, 0 for none
   bool gc_check;
   bool gen_lattice;
-  bool use_search_pool;
+  bool incremental_lattice;
+  bool use_search_pool;  // Keep the search state arena between utterances
   bool early_mission;
   bool dump_traceback;
   bool colorize;
   bool prune_eps;
+  bool batch_expand;  // Expand the active arcs of a frame in one batch
+  bool eps_closure;  // Use cached epsilon closures of the Fst states
+  int score_cache;  // Caching of the acoustic scores of the current frame
   string source; //File name of input
   std::map<std::string, Variant> params;
 
@@ -136,6 +201,7 @@ struct SearchOptions {
 
   void Check() {
     lattice_beam = min(lattice_beam, beam);
+    lookahead_beam = min(lookahead_beam, beam);
   }
 
   void Register(ParseOptions* po) {
@@ -0,0 +1,152 @@
+// search-state-arena.h
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// Slab allocator for the search states. A state and the storage for its arcs
+// are one contiguous block, the arcs directly follow the state header. Blocks
+// are carved out of large slabs and recycled through one free list per arc
+// count. States with too many arcs to fit in a slab get a block of their own.
+// Both the state and the arc types must be trivially destructible, no
+// destructors are run when blocks are recycled or reset.
+
+#ifndef DCD_SEARCH_STATE_ARENA_H__
+#define DCD_SEARCH_STATE_ARENA_H__
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include <fst/compat.h>
+
+#include <dcd/constants.h>
+#include <dcd/stl.h>
+
+namespace dcd {
+
+template<class S, class A>
+class SearchStateArena {
+ public:
+  typedef S State;
+  typedef A Arc;
+
+  explicit SearchStateArena(int slab_size = kDefaultSearchArenaSlabSize)
+      : slab_size_(slab_size), slab_(0), pos_(0), num_allocated_(0) { }
+
+  ~SearchStateArena() { Release(); }
+
+  // Returns a default constructed state followed by uninitialized storage
+  // for n arcs, see Arcs
+  inline State* Alloc(int n) {
+    char* block;
+    if (n < free_lists_.size() && !free_lists_[n].empty()) {
+      block = free_lists_[n].back();
+      free_lists_[n].pop_back();
+    } else {
+      size_t size = BlockSize(n);
+      if (size > slab_size_) {
+        block = new char[size];
+        large_blocks_.insert(block);
+      } else {
+        if (slab_ == slabs_.size() || pos_ + size > slab_size_) {
+          if (slab_ != slabs_.size())
+            ++slab_;
+          if (slab_ == slabs_.size())
+            slabs_.push_back(new char[slab_size_]);
+          pos_ = 0;
+        }
+        block = slabs_[slab_] + pos_;
+        pos_ += size;
+      }
+    }
+    ++num_allocated_;
+    return new (block) State;
+  }
+
+  // Return a state and its n arcs previously obtained from Alloc
+  inline void Free(State* state, int n) {
+    char* block = reinterpret_cast<char*>(state);
+    --num_allocated_;
+    if (BlockSize(n) > slab_size_) {
+      large_blocks_.erase(block);
+      delete[] block;
+      return;
+    }
+    if (n >= free_lists_.size())
+      free_lists_.resize(n + 1);
+    free_lists_[n].push_back(block);
+  }
+
+  // Reclaim every block at once, the slabs are kept for the next utterance
+  void Reset() {
+    slab_ = 0;
+    pos_ = 0;
+    for (int i = 0; i != free_lists_.size(); ++i)
+      free_lists_[i].clear();
+    ReleaseLargeBlocks();
+    num_allocated_ = 0;
+  }
+
+  // Reclaim every block and return the slabs to the system
+  void Release() {
+    Reset();
+    for (int i = 0; i != slabs_.size(); ++i)
+      delete[] slabs_[i];
+    slabs_.clear();
+  }
+
+  // Storage for the arcs that follows a state
+  static inline Arc* Arcs(State* state) {
+    return reinterpret_cast<Arc*>(reinterpret_cast<char*>(state) +
+                                  HeaderSize());
+  }
+
+  // Number of states currently handed out
+  int NumAllocated() const { return num_allocated_; }
+
+  // Memory held in the slabs in bytes
+  size_t Size() const { return slabs_.size() * slab_size_; }
+
+ private:
+  static inline size_t Align(size_t size) {
+    return (size + kSearchArenaAlignment - 1) &
+      ~static_cast<size_t>(kSearchArenaAlignment - 1);
+  }
+
+  static inline size_t HeaderSize() { return Align(sizeof(State)); }
+
+  static inline size_t BlockSize(int n) {
+    return HeaderSize() + Align(n * sizeof(Arc));
+  }
+
+  void ReleaseLargeBlocks() {
+    for (typename unordered_set<char*>::iterator it = large_blocks_.begin();
+         it != large_blocks_.end(); ++it)
+      delete[] *it;
+    large_blocks_.clear();
+  }
+
+  size_t slab_size_;  // Number of bytes in a slab
+  int slab_;  // Slab currently being carved up
+  size_t pos_;  // Next free byte in the current slab
+  std::vector<char*> slabs_;
+  std::vector<std::vector<char*> > free_lists_;  // Indexed by arc count
+  unordered_set<char*> large_blocks_;  // Blocks larger than a slab
+  int num_allocated_;
+  DISALLOW_COPY_AND_ASSIGN(SearchStateArena);
+};
+
+}  // namespace dcd
+
+#endif  // DCD_SEARCH_STATE_ARENA_H__
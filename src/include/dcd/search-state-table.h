@@ -0,0 +1,186 @@
+// search-state-table.h
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// Map from Fst state ids to cached search states. When the number of states
+// in the search Fst is known (and not too large) the ids index a table
+// directly, otherwise a compact open addressing table with linear probing is
+// used. The entries are also kept in a dense array, so iterating and
+// clearing cost is proportional to the number of cached states, not the size
+// of the table.
+
+#ifndef DCD_SEARCH_STATE_TABLE_H__
+#define DCD_SEARCH_STATE_TABLE_H__
+
+#include <vector>
+
+#include <fst/compat.h>
+
+#include <dcd/constants.h>
+
+namespace dcd {
+
+// V is a pointer type, a null value means the state is not in the table
+template<class V>
+class SearchStateTable {
+  struct Slot {
+    Slot() : key(-1), pos(0), gen(0) { }
+    int key;
+    int pos;  // Position in the dense arrays
+    unsigned int gen;  // Slot is only valid when equal to gen_
+  };
+
+ public:
+  SearchStateTable() : direct_(false), gen_(1), mask_(0) {
+    Init(-1);
+  }
+
+  // Prepare the table for an Fst with num_states states, -1 if unknown. Fsts
+  // up to kMaxDirectSearchStates get a directly indexed table, 4 bytes per
+  // Fst state
+  void Init(int num_states) {
+    Clear();
+    direct_ = num_states >= 0 && num_states <= kMaxDirectSearchStates;
+    if (direct_) {
+      index_.assign(num_states, -1);
+      slots_.clear();
+      mask_ = 0;
+    } else {
+      index_.clear();
+      slots_.assign(kDefaultSearchTableSize, Slot());
+      mask_ = kDefaultSearchTableSize - 1;
+      gen_ = 1;
+    }
+  }
+
+  // Returns the value stored for state or null
+  inline V Find(int state) const {
+    if (direct_) {
+      int pos = index_[state];
+      return pos < 0 ? 0 : values_[pos];
+    }
+    for (int i = Hash(state); ; i = (i + 1) & mask_) {
+      const Slot& slot = slots_[i];
+      if (slot.gen != gen_)
+        return 0;
+      if (slot.key == state)
+        return values_[slot.pos];
+    }
+  }
+
+  // Returns a reference to the value stored for state, inserting a null value
+  // if the state is not in the table. Only a single probe sequence is needed
+  // to look up and fill a missing entry
+  inline V& FindOrInsert(int state) {
+    if (direct_) {
+      int& pos = index_[state];
+      if (pos < 0) {
+        pos = keys_.size();
+        keys_.push_back(state);
+        values_.push_back(0);
+      }
+      return values_[pos];
+    }
+    if (2 * (keys_.size() + 1) > slots_.size())
+      Grow();
+    for (int i = Hash(state); ; i = (i + 1) & mask_) {
+      Slot& slot = slots_[i];
+      if (slot.gen != gen_) {
+        slot.key = state;
+        slot.pos = keys_.size();
+        slot.gen = gen_;
+        keys_.push_back(state);
+        values_.push_back(0);
+        return values_.back();
+      }
+      if (slot.key == state)
+        return values_[slot.pos];
+    }
+  }
+
+  // Remove every entry, costs O(size) for the direct table and O(1) for the
+  // hashed one
+  void Clear() {
+    if (direct_) {
+      for (int i = 0; i != keys_.size(); ++i)
+        index_[keys_[i]] = -1;
+    } else if (++gen_ == 0) {
+      // Stamp wrapped around, invalidate the slots the slow way
+      for (int i = 0; i != slots_.size(); ++i)
+        slots_[i].gen = 0;
+      gen_ = 1;
+    }
+    keys_.clear();
+    values_.clear();
+  }
+
+  // Remove the entries for which the predicate returns true, the order of
+  // the remaining entries is preserved
+  template<class P>
+  int EraseIf(P pred) {
+    std::vector<int> keys(keys_);
+    std::vector<V> values(values_);
+    Clear();
+    int num_erased = 0;
+    for (int i = 0; i != keys.size(); ++i) {
+      if (pred(values[i]))
+        ++num_erased;
+      else
+        FindOrInsert(keys[i]) = values[i];
+    }
+    return num_erased;
+  }
+
+  int Size() const { return keys_.size(); }
+
+  // Access the entries in insertion order
+  int Key(int i) const { return keys_[i]; }
+
+  V Value(int i) const { return values_[i]; }
+
+  bool IsDirect() const { return direct_; }
+
+ private:
+  inline int Hash(int state) const {
+    return (static_cast<unsigned int>(state) * 2654435761u) & mask_;
+  }
+
+  void Grow() {
+    slots_.assign(slots_.size() * 2, Slot());
+    mask_ = slots_.size() - 1;
+    gen_ = 1;
+    for (int pos = 0; pos != keys_.size(); ++pos) {
+      int i = Hash(keys_[pos]);
+      while (slots_[i].gen == gen_)
+        i = (i + 1) & mask_;
+      slots_[i].key = keys_[pos];
+      slots_[i].pos = pos;
+      slots_[i].gen = gen_;
+    }
+  }
+
+  bool direct_;
+  std::vector<int> index_;  // Direct table, position or -1
+  std::vector<Slot> slots_;  // Open addressing table
+  unsigned int gen_;
+  int mask_;
+  std::vector<int> keys_;
+  std::vector<V> values_;
+  DISALLOW_COPY_AND_ASSIGN(SearchStateTable);
+};
+
+}  // namespace dcd
+
+#endif  // DCD_SEARCH_STATE_TABLE_H__
@@ -19,51 +19,106 @@
 // will not t perform anything and will be optimized
 // out. Faster, neater and safer than using ifdef-else macros
 //
+// SimpleStatistics counts the expansions of every Fst state and input label
+// and keeps running distributions of the per-frame search sizes and costs.
+// The counts build up over the utterances a decoder searches, the statistics
+// of several decoders are merged with Push and saved as a search profile.
+//
+// The profile layout is in host byte order
+//   SearchProfileHeader
+//   RunnningStatistic stats[num_stats]
+//   int64 state_counts[num_states], emitting expansions of each Fst state
+//   int64 eps_counts[num_states], epsilon expansions of each Fst state
+//   int64 ilabel_counts[num_ilabels], arc expansions of each input label
+//
 #ifndef DCD_SEARCH_STATISTICS_H__
 #define DCD_SEARCH_STATISTICS_H__
 
+#include <algorithm>
+#include <fstream>
 #include <limits>
+#include <string>
 #include <vector>
-#include <dcd/utils.h>
+
+#include <fst/compat.h>
+
+#include <dcd/constants.h>
+#include <dcd/log.h>
 
 namespace dcd {
+
+// Count, range, mean and variance of a stream of values, the mean and the
+// variance are updated with Welford's method
 struct RunnningStatistic {
+  RunnningStatistic() { Clear(); }
+
   void Clear() {
     num_ = 0;
-    max_ = kMaxCost;
-    min_ = kMinCost;
+    max_ = -std::numeric_limits<float>::max();
+    min_ = std::numeric_limits<float>::max();
+    ave_ = 0.0;
+    m2_ = 0.0;
   }
 
   void Push(float value) {
+    ++num_;
+    max_ = std::max(max_, value);
+    min_ = std::min(min_, value);
+    double delta = value - ave_;
+    ave_ += delta / num_;
+    m2_ += delta * (value - ave_);
   }
 
+  // Merge the values pushed to other
+  void Push(const RunnningStatistic& other) {
+    if (!other.num_)
+      return;
+    int64 num = num_ + other.num_;
+    double delta = other.ave_ - ave_;
+    ave_ += delta * other.num_ / num;
+    m2_ += other.m2_ + delta * delta * num_ * other.num_ / num;
+    max_ = std::max(max_, other.max_);
+    min_ = std::min(min_, other.min_);
+    num_ = num;
+  }
+
+  int64 Num() const { return num_; }
   float Max() const { return max_; }
   float Min() const { return min_; }
   float Ave() const { return ave_; }
-  float Variance() const { return var_; }
+  float Variance() const { return num_ ? m2_ / num_ : 0.0; }
 
-  int num_;
+  int64 num_;
   float max_;
   float min_;
-  float ave_;
-  float var_;
+  double ave_;
+  double m2_;  // Sum of the squared differences from the mean
 };
 
+// The per-frame values collected by the statistics
 enum Statistic {
-    kActiveArcCosts = 0,
-    kNumActiveArcs,
-    kNumActiveState,
-    kNumArcsPruned,
-    kNumArcsHistogramPruned,
-    kActiveStateCosts,
-    kNumActiveArc,
+    kActiveArcCosts = 0,  // Best arc cost after the arc expansion
+    kNumActiveArcs,  // Before the arc expansion
+    kNumActiveStates,  // Before the epsilon expansion
+    kNumArcsPruned,  // Beam and lookahead pruned during the arc expansion
+    kNumArcsHistogramPruned,  // Band pruned after the arc expansion
+    kActiveStateCosts,  // Best state cost after the epsilon expansion
     kNumOfStats
 };
 
 struct UtteranceSearchStatstics {
 };
 
-
+struct SearchProfileHeader {
+  int32 magic;
+  int32 version;
+  int32 num_stats;
+  int32 reserved;
+  int64 num_utterances;
+  int64 num_frames;
+  int64 num_states;
+  int64 num_ilabels;
+};
 
 class NullStatistics {
  public:
@@ -73,33 +128,46 @@ class NullStatistics {
 
   void ArcExpanded(int ilabel) { }
 
+  void UtteranceDone(int num_frames) { }
+
   void Clear() { }
 
-  void Push(const NullStatistics) { }
+  void Push(const NullStatistics&) { }
 
-  void PushStatistic(int statistic) { }
+  void PushStatistic(int statistic, float value) { }
 
-  const RunnningStatistic& GetStatistic(int stat) {
+  const RunnningStatistic& GetStatistic(int stat) const {
     return running_stat_;
   }
 
+  // Nothing is collected, so there is no profile to write
+  bool Write(const std::string& filename) const {
+    LOG(ERROR) << "No search statistics were collected";
+    return false;
+  }
+
   RunnningStatistic running_stat_;
 };
 
 class SimpleStatistics {
  public:
+  SimpleStatistics() { Clear(); }
+
   void EpsilonExpanded(int state) {
-    eps_hits_.Insert(state);
+    Count(state, &eps_hits_);
   }
 
   void StateExpanded(int state) {
-    state_hits_.Insert(state);
+    Count(state, &state_hits_);
   }
 
   void ArcExpanded(int ilabel) {
-    if (ilabel_hits_.size() < ilabel)
-      ilabel_hits_.resize(ilabel);
-    ++ilabel_hits_[ilabel];
+    Count(ilabel, &ilabel_hits_);
+  }
+
+  void UtteranceDone(int num_frames) {
+    ++num_utterances_;
+    num_frames_ += num_frames;
   }
 
   void PushStatistic(int statistic, float value) {
@@ -107,26 +175,158 @@ class SimpleStatistics {
   }
 
   void Clear() {
-    eps_hits_.Clear();
-    state_hits_.Clear();
+    eps_hits_.clear();
+    state_hits_.clear();
     ilabel_hits_.clear();
-    num_ = 1;
-  }
-  /*
-  void PrintEpsHits(const string& path) {
-     ofstream ofs(path.c_str());
-     for (CountSet<int>::const_iterator it = eps_hits_.Begin();
-         it != eps_hits_.End(); ++it) {
-       ofs << it->first << " " << it->second << endl;
-     }
-   }
-*/
+    for (int i = 0; i != kNumOfStats; ++i)
+      running_stats_[i].Clear();
+    num_utterances_ = 0;
+    num_frames_ = 0;
+  }
+
+  // Add the statistics of another decoder, for example one per thread
+  void Push(const SimpleStatistics& other) {
+    Add(other.eps_hits_, &eps_hits_);
+    Add(other.state_hits_, &state_hits_);
+    Add(other.ilabel_hits_, &ilabel_hits_);
+    for (int i = 0; i != kNumOfStats; ++i)
+      running_stats_[i].Push(other.running_stats_[i]);
+    num_utterances_ += other.num_utterances_;
+    num_frames_ += other.num_frames_;
+  }
+
+  const RunnningStatistic& GetStatistic(int stat) const {
+    return running_stats_[stat];
+  }
+
+  int64 NumUtterances() const { return num_utterances_; }
+
+  int64 NumFrames() const { return num_frames_; }
+
+  // One past the largest state expanded
+  int NumStates() const {
+    return std::max(state_hits_.size(), eps_hits_.size());
+  }
+
+  int NumILabels() const { return ilabel_hits_.size(); }
+
+  int64 StateCount(int state) const { return Get(state_hits_, state); }
+
+  int64 EpsilonCount(int state) const { return Get(eps_hits_, state); }
+
+  int64 ILabelCount(int ilabel) const { return Get(ilabel_hits_, ilabel); }
+
+  bool Write(const std::string& filename) const {
+    std::ofstream ofs(filename.c_str(), std::ofstream::binary);
+    if (!ofs.is_open()) {
+      LOG(ERROR) << "Failed to open " << filename;
+      return false;
+    }
+    SearchProfileHeader header;
+    header.magic = kSearchProfileMagic;
+    header.version = kSearchProfileVersion;
+    header.num_stats = kNumOfStats;
+    header.reserved = 0;
+    header.num_utterances = num_utterances_;
+    header.num_frames = num_frames_;
+    header.num_states = NumStates();
+    header.num_ilabels = NumILabels();
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.write(reinterpret_cast<const char*>(running_stats_),
+              sizeof(running_stats_));
+    // The state counts are padded to the same length
+    std::vector<int64> counts(header.num_states, 0);
+    std::copy(state_hits_.begin(), state_hits_.end(), counts.begin());
+    WriteCounts(counts, &ofs);
+    std::fill(counts.begin(), counts.end(), 0);
+    std::copy(eps_hits_.begin(), eps_hits_.end(), counts.begin());
+    WriteCounts(counts, &ofs);
+    WriteCounts(ilabel_hits_, &ofs);
+    return !ofs.fail();
+  }
+
+  // Returns null if the file can't be read or is not a search profile
+  static SimpleStatistics* Read(const std::string& filename) {
+    std::ifstream ifs(filename.c_str(), std::ifstream::binary);
+    if (!ifs.is_open()) {
+      LOG(ERROR) << "Failed to open " << filename;
+      return 0;
+    }
+    SearchProfileHeader header;
+    ifs.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!ifs || header.magic != kSearchProfileMagic) {
+      LOG(ERROR) << "Not a search profile : " << filename;
+      return 0;
+    }
+    if (header.version != kSearchProfileVersion ||
+        header.num_stats != kNumOfStats) {
+      LOG(ERROR) << "Search profile version " << header.version
+                 << " with " << header.num_stats << " statistics is not "
+                 << "supported : " << filename;
+      return 0;
+    }
+    ifs.seekg(0, std::ios_base::end);
+    int64 size = ifs.tellg();
+    ifs.seekg(sizeof(header));
+    if (header.num_states < 0 || header.num_ilabels < 0 ||
+        size != sizeof(header) + kNumOfStats * sizeof(RunnningStatistic) +
+        (2 * header.num_states + header.num_ilabels) * sizeof(int64)) {
+      LOG(ERROR) << "Search profile is corrupt : " << filename;
+      return 0;
+    }
+    SimpleStatistics* stats = new SimpleStatistics;
+    stats->num_utterances_ = header.num_utterances;
+    stats->num_frames_ = header.num_frames;
+    ifs.read(reinterpret_cast<char*>(stats->running_stats_),
+             sizeof(stats->running_stats_));
+    ReadCounts(header.num_states, &ifs, &stats->state_hits_);
+    ReadCounts(header.num_states, &ifs, &stats->eps_hits_);
+    ReadCounts(header.num_ilabels, &ifs, &stats->ilabel_hits_);
+    if (!ifs) {
+      LOG(ERROR) << "Failed to read search profile : " << filename;
+      delete stats;
+      return 0;
+    }
+    return stats;
+  }
 
  private:
-  CountSet<int> eps_hits_;
-  CountSet<int> state_hits_;
-  vector<int> ilabel_hits_;
-  int num_;
+  static void Count(int i, std::vector<int64>* counts) {
+    if (counts->size() <= i)
+      counts->resize(i + 1, 0);
+    ++(*counts)[i];
+  }
+
+  static void Add(const std::vector<int64>& src, std::vector<int64>* dest) {
+    if (dest->size() < src.size())
+      dest->resize(src.size(), 0);
+    for (int i = 0; i != src.size(); ++i)
+      (*dest)[i] += src[i];
+  }
+
+  static int64 Get(const std::vector<int64>& counts, int i) {
+    return i < counts.size() ? counts[i] : 0;
+  }
+
+  static void WriteCounts(const std::vector<int64>& counts,
+                          std::ofstream* ofs) {
+    if (!counts.empty())
+      ofs->write(reinterpret_cast<const char*>(&counts[0]),
+                 counts.size() * sizeof(int64));
+  }
+
+  static void ReadCounts(int64 num, std::ifstream* ifs,
+                         std::vector<int64>* counts) {
+    counts->resize(num);
+    if (num)
+      ifs->read(reinterpret_cast<char*>(&(*counts)[0]), num * sizeof(int64));
+  }
+
+  std::vector<int64> eps_hits_;  // Indexed by Fst state
+  std::vector<int64> state_hits_;  // Indexed by Fst state
+  std::vector<int64> ilabel_hits_;  // Indexed by input label
+  int64 num_utterances_;
+  int64 num_frames_;
   RunnningStatistic running_stats_[kNumOfStats];
 };
 
@@ -0,0 +1,320 @@
+// search-trace.h
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// Machine readable per-frame trace of the search. The decoder fills in a
+// FrameTrace at the end of every frame and the trace writes it out as a CSV
+// row, a JSON line or Chrome trace events, the last can be loaded into
+// chrome://tracing or Perfetto. The decoder only collects the records when
+// built with HAVE_SEARCH_TRACE, otherwise the tracing compiles to nothing.
+
+#ifndef DCD_SEARCH_TRACE_H__
+#define DCD_SEARCH_TRACE_H__
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <string>
+
+#include <fst/compat.h>
+
+#include <dcd/config.h>
+#include <dcd/log.h>
+
+namespace dcd {
+
+// Search trace formats, selected with --search_trace_format
+enum SearchTraceFormat { kCsvTrace, kJsonTrace, kChromeTrace };
+
+// Search counters of one frame, value initialize to zero
+struct FrameTrace {
+  int frame;
+  int active_arcs;  // Before the expansion
+  int arcs_pruned;  // Beam and lookahead pruned during the expansion
+  int arcs_histogram_pruned;  // Pruned by the band after the expansion
+  int active_arcs_after_prune;
+  float best_arc_cost;
+  float worst_arc_cost;
+  float threshold;
+  float beam;
+  int states_expanded;
+  int states_pruned;
+  int active_states;  // Before the epsilon expansion
+  int epsilon_states_activated;
+  int epsilon_cycles;
+  float best_state_cost;
+  float worst_state_cost;
+  int search_state_requests;
+  int search_state_hits;
+  int search_state_misses;
+  int lattice_states;
+  int64 rss;  // Bytes
+  // Wall time of the phases in seconds
+  double expand_states_time;
+  double gc_time;
+  double expand_arcs_time;
+  double expand_eps_time;
+  double next_frame_time;
+
+  // The decoder keeps some of the counters and the timers as totals over
+  // the utterance, prev holds the totals after the previous frame
+  void SubtractTotals(const FrameTrace& prev) {
+    arcs_histogram_pruned -= prev.arcs_histogram_pruned;
+    states_expanded -= prev.states_expanded;
+    states_pruned -= prev.states_pruned;
+    search_state_requests -= prev.search_state_requests;
+    search_state_hits -= prev.search_state_hits;
+    search_state_misses -= prev.search_state_misses;
+    expand_states_time -= prev.expand_states_time;
+    gc_time -= prev.gc_time;
+    expand_arcs_time -= prev.expand_arcs_time;
+    expand_eps_time -= prev.expand_eps_time;
+    next_frame_time -= prev.next_frame_time;
+  }
+
+  // Calls (*visitor)(name, value) for each counter in column order
+  template<class V>
+  void VisitCounters(V* visitor) const {
+    (*visitor)("frame", frame);
+    (*visitor)("active_arcs", active_arcs);
+    (*visitor)("arcs_pruned", arcs_pruned);
+    (*visitor)("arcs_histogram_pruned", arcs_histogram_pruned);
+    (*visitor)("active_arcs_after_prune", active_arcs_after_prune);
+    (*visitor)("best_arc_cost", best_arc_cost);
+    (*visitor)("worst_arc_cost", worst_arc_cost);
+    (*visitor)("threshold", threshold);
+    (*visitor)("beam", beam);
+    (*visitor)("states_expanded", states_expanded);
+    (*visitor)("states_pruned", states_pruned);
+    (*visitor)("active_states", active_states);
+    (*visitor)("epsilon_states_activated", epsilon_states_activated);
+    (*visitor)("epsilon_cycles", epsilon_cycles);
+    (*visitor)("best_state_cost", best_state_cost);
+    (*visitor)("worst_state_cost", worst_state_cost);
+    (*visitor)("search_state_requests", search_state_requests);
+    (*visitor)("search_state_hits", search_state_hits);
+    (*visitor)("search_state_misses", search_state_misses);
+    (*visitor)("lattice_states", lattice_states);
+    (*visitor)("rss", rss);
+  }
+
+  // Calls (*visitor)(name, seconds) for each phase in the order they run
+  template<class V>
+  void VisitPhases(V* visitor) const {
+    (*visitor)("expand_states", expand_states_time);
+    (*visitor)("gc", gc_time);
+    (*visitor)("expand_arcs", expand_arcs_time);
+    (*visitor)("expand_eps", expand_eps_time);
+    (*visitor)("next_frame", next_frame_time);
+  }
+};
+
+// Writes the frames of every decoder to one file, Write may be called from
+// several decoding threads
+class SearchTrace {
+ public:
+  ~SearchTrace() {
+    if (format_ == kChromeTrace)
+      os_ << "\n]\n";
+  }
+
+  // Returns null if the file can't be opened or the format is not one of
+  // csv, jsonl or chrome
+  static SearchTrace* Open(const std::string& filename,
+                           const std::string& format) {
+    SearchTraceFormat f;
+    if (format == "csv") {
+      f = kCsvTrace;
+    } else if (format == "jsonl") {
+      f = kJsonTrace;
+    } else if (format == "chrome") {
+      f = kChromeTrace;
+    } else {
+      LOG(ERROR) << "Unknown search trace format : " << format;
+      return 0;
+    }
+    SearchTrace* trace = new SearchTrace(filename, f);
+    if (!trace->os_) {
+      LOG(ERROR) << "Failed to open search trace : " << filename;
+      delete trace;
+      return 0;
+    }
+    return trace;
+  }
+
+  // Write the frame of the utterance decoded by the decoder thread, the
+  // frame is taken to have finished now
+  void Write(const std::string& utterance, int thread,
+             const FrameTrace& frame) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    switch (format_) {
+      case kCsvTrace: WriteCsv(utterance, thread, frame); break;
+      case kJsonTrace: WriteJson(utterance, thread, frame); break;
+      case kChromeTrace: WriteChrome(utterance, thread, frame); break;
+    }
+  }
+
+ private:
+  SearchTrace(const std::string& filename, SearchTraceFormat format)
+      : os_(filename.c_str()), format_(format), num_events_(0) {
+    if (format_ == kCsvTrace) {
+      os_ << "utterance,thread";
+      HeaderVisitor visitor(&os_);
+      FrameTrace().VisitCounters(&visitor);
+      FrameTrace().VisitPhases(&visitor);
+      os_ << "\n";
+    } else if (format_ == kChromeTrace) {
+      os_ << "[";
+    }
+  }
+
+  struct HeaderVisitor {
+    explicit HeaderVisitor(std::ostream* os) : os(os) { }
+
+    template<class T>
+    void operator()(const char* name, T value) { *os << "," << name; }
+
+    std::ostream* os;
+  };
+
+  // Writes name : value pairs, each preceded by a comma
+  struct JsonVisitor {
+    explicit JsonVisitor(std::ostream* os) : os(os) { }
+
+    template<class T>
+    void operator()(const char* name, T value) {
+      *os << ",\"" << name << "\":" << value;
+    }
+
+    std::ostream* os;
+  };
+
+  struct CsvVisitor {
+    explicit CsvVisitor(std::ostream* os) : os(os) { }
+
+    template<class T>
+    void operator()(const char* name, T value) { *os << "," << value; }
+
+    std::ostream* os;
+  };
+
+  // Lays the phases out as complete events ending at the end of the frame
+  struct ChromePhaseVisitor {
+    ChromePhaseVisitor(SearchTrace* trace, int thread, double start)
+        : trace(trace), thread(thread), start(start) { }
+
+    void operator()(const char* name, double seconds) {
+      double duration = seconds * 1e6;
+      trace->BeginEvent();
+      trace->os_ << "{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":0"
+                 << ",\"tid\":" << thread << ",\"ts\":";
+      trace->WriteMicros(start);
+      trace->os_ << ",\"dur\":";
+      trace->WriteMicros(duration);
+      trace->os_ << "}";
+      start += duration;
+    }
+
+    SearchTrace* trace;
+    int thread;
+    double start;  // Microseconds
+  };
+
+  // Keys come from the feature archives, escape them for JSON
+  void WriteString(const std::string& s) {
+    os_ << '"';
+    for (size_t i = 0; i != s.size(); ++i) {
+      if (s[i] == '"' || s[i] == '\\')
+        os_ << '\\';
+      if (static_cast<unsigned char>(s[i]) >= 0x20)
+        os_ << s[i];
+    }
+    os_ << '"';
+  }
+
+  // The time line runs for hours, so the default precision isn't enough
+  void WriteMicros(double micros) {
+    std::streamsize precision = os_.precision();
+    os_ << std::fixed << std::setprecision(3) << micros;
+    os_.unsetf(std::ios_base::floatfield);
+    os_.precision(precision);
+  }
+
+  void BeginEvent() {
+    os_ << (num_events_++ ? ",\n" : "\n");
+  }
+
+  void WriteCsv(const std::string& utterance, int thread,
+                const FrameTrace& frame) {
+    os_ << utterance << "," << thread;
+    CsvVisitor visitor(&os_);
+    frame.VisitCounters(&visitor);
+    frame.VisitPhases(&visitor);
+    os_ << "\n";
+  }
+
+  void WriteJson(const std::string& utterance, int thread,
+                 const FrameTrace& frame) {
+    os_ << "{\"utterance\":";
+    WriteString(utterance);
+    os_ << ",\"thread\":" << thread;
+    JsonVisitor visitor(&os_);
+    frame.VisitCounters(&visitor);
+    frame.VisitPhases(&visitor);
+    os_ << "}\n";
+  }
+
+  // A frame event holding the counters and an event for each phase
+  // nested in it, plus counter events to plot the size of the search
+  void WriteChrome(const std::string& utterance, int thread,
+                   const FrameTrace& frame) {
+    double duration = (frame.expand_states_time + frame.gc_time +
+                       frame.expand_arcs_time + frame.expand_eps_time +
+                       frame.next_frame_time) * 1e6;
+    double start = std::max(timer_.Elapsed() * 1e6 - duration, 0.0);
+    BeginEvent();
+    os_ << "{\"name\":\"frame\",\"ph\":\"X\",\"pid\":0,\"tid\":" << thread
+        << ",\"ts\":";
+    WriteMicros(start);
+    os_ << ",\"dur\":";
+    WriteMicros(duration);
+    os_ << ",\"args\":{\"utterance\":";
+    WriteString(utterance);
+    JsonVisitor visitor(&os_);
+    frame.VisitCounters(&visitor);
+    os_ << "}}";
+    ChromePhaseVisitor phases(this, thread, start);
+    frame.VisitPhases(&phases);
+    BeginEvent();
+    os_ << "{\"name\":\"search\",\"ph\":\"C\",\"pid\":0,\"id\":" << thread
+        << ",\"ts\":";
+    WriteMicros(start + duration);
+    os_ << ",\"args\":{\"active_arcs\":" << frame.active_arcs
+        << ",\"active_states\":" << frame.active_states
+        << ",\"lattice_states\":" << frame.lattice_states << "}}";
+  }
+
+  std::ofstream os_;
+  SearchTraceFormat format_;
+  int64 num_events_;  // Chrome events written
+  Timer timer_;  // Time line of the Chrome trace
+  std::mutex mutex_;
+  DISALLOW_COPY_AND_ASSIGN(SearchTrace);
+};
+
+}  // namespace dcd
+
+#endif  // DCD_SEARCH_TRACE_H__
@@ -30,6 +30,7 @@
 #include <dcd/constants.h>
 #include <dcd/kaldi-lattice-arc.h>
 #include <dcd/log.h>
+#include <dcd/partial-result.h>
 #include <dcd/search-opts.h>
 
 using fst::VectorFst;
@@ -111,15 +112,16 @@ class SimpleLattice {
     int GetBestSequence(MutableFst<Arc>* ofst) const {
       // PROFILE_FUNC();
       assert(index_ != -1);
-      int d = -1;
-      if (PrevState()) {
-        int s = PrevState()->GetBestSequence(ofst);
-        d = ofst->AddState();
-        ofst->AddArc(s, Arc(best_arc_.ilabel_, best_arc_.olabel_,
-                            Arc::Weight::One(), d));
-      } else {
-        d = ofst->AddState();
-        ofst->SetStart(d);
+      vector<const State*> path;
+      for (const State* ls = this; ls; ls = ls->PrevState())
+        path.push_back(ls);
+      int d = ofst->AddState();
+      ofst->SetStart(d);
+      for (int i = path.size() - 2; i >= 0; --i) {
+        const LatticeArc& arc = path[i]->best_arc_;
+        int n = ofst->AddState();
+        ofst->AddArc(d, Arc(arc.ilabel_, arc.olabel_, Arc::Weight::One(), n));
+        d = n;
       }
       return d;
     }
@@ -236,6 +238,13 @@ class SimpleLattice {
     return NewState(time, state);
   }
 
+  void GcMark(State* ls) { ls->GcMark(); }
+
+  template<class Arc>
+  int GetBestSequence(State* ls, MutableFst<Arc>* ofst) const {
+    return ls->GetBestSequence(ofst);
+  }
+
   void DeleteState(State* ls) {
     delete ls;
   }
@@ -253,15 +262,18 @@ class SimpleLattice {
 
   int NumStates() const { return num_allocs_ - num_frees_; }
 
+  // No on-the-fly rescoring, see Lattice
+  float FinalCost(State* state) const { return 0.0f; }
+
   void Clear() {
     for (int i = 0; i != used_list_.size(); ++i)
       delete used_list_[i];
     used_list_.clear();
   }
 
-  void GcClearMarks() { }
+  void GcClearMarks(bool full = true) { }
 
-  int GcSweep(vector<int>* early_mission = 0) { return 0; }
+  int GcSweep(vector<CommittedWord>* early_mission = 0) { return 0; }
 
   void GetUsageStatistics(UtteranceSearchStatstics *search_statistics) { }
 
@@ -294,6 +306,12 @@ class SimpleLattice {
     return "SimpleLattice";
   }
 
+  // Only the best path is kept, there are no LM states to rescore and no
+  // lattice to settle
+  static bool CanRescore() { return false; }
+
+  static bool CanSettle() { return false; }
+
  protected:
   vector<State*> used_list_;
   int next_id_;
@@ -0,0 +1,115 @@
+// thread-pool.h
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// Simple fixed size pool of worker threads. Tasks are passed the index of the
+// worker running them so callers can keep per-thread state (decoders,
+// lattices, scratch buffers) in a plain vector indexed by the worker id.
+
+#ifndef DCD_THREAD_POOL_H__
+#define DCD_THREAD_POOL_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fst/compat.h>
+
+namespace dcd {
+
+class ThreadPool {
+ public:
+  typedef std::function<void(int)> Task;
+
+  explicit ThreadPool(int num_threads)
+      : num_pending_(0), done_(false) {
+    for (int i = 0; i < num_threads; ++i)
+      threads_.push_back(std::thread(&ThreadPool::Run, this, i));
+  }
+
+  ~ThreadPool() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    task_cond_.notify_all();
+    for (int i = 0; i != threads_.size(); ++i)
+      threads_[i].join();
+  }
+
+  // Queue a task, it will be run by the first free worker
+  void Schedule(const Task& task) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      tasks_.push_back(task);
+      ++num_pending_;
+    }
+    task_cond_.notify_one();
+  }
+
+  // Block until all the scheduled tasks have finished
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (num_pending_)
+      done_cond_.wait(lock);
+  }
+
+  // Block until no more than n tasks are queued or running
+  void WaitUntilPending(int n) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (num_pending_ > n)
+      done_cond_.wait(lock);
+  }
+
+  int NumThreads() const { return threads_.size(); }
+
+ private:
+  void Run(int id) {
+    for (;;) {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!done_ && tasks_.empty())
+          task_cond_.wait(lock);
+        if (tasks_.empty())
+          return;
+        task = tasks_.front();
+        tasks_.pop_front();
+      }
+      task(id);
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        --num_pending_;
+      }
+      done_cond_.notify_all();
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::deque<Task> tasks_;
+  std::mutex mutex_;
+  std::condition_variable task_cond_;
+  std::condition_variable done_cond_;
+  int num_pending_;  // Number of tasks queued or running
+  bool done_;
+  DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
+
+}  // namespace dcd
+
+#endif  // DCD_THREAD_POOL_H__
@@ -0,0 +1,106 @@
+// token-pool.h
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2014 Paul R. Dixon
+// Author : Paul R. Dixon
+// \file
+// Pool of token arrays for the active search arcs. Arrays are carved out of
+// large blocks and recycled through one free list per array length, so an
+// arc only holds storage for the tokens of its transition model while it is
+// active.
+
+#ifndef DCD_TOKEN_POOL_H__
+#define DCD_TOKEN_POOL_H__
+
+#include <vector>
+
+#include <fst/compat.h>
+
+#include <dcd/constants.h>
+
+namespace dcd {
+
+const int kDefaultTokenPoolBlockSize = 64 * 1024;
+
+template<class T>
+class TokenPool {
+ public:
+  typedef T Token;
+
+  explicit TokenPool(int block_size = kDefaultTokenPoolBlockSize)
+      : block_size_(block_size), block_(0), pos_(0),
+        free_lists_(kMaxTokensPerArc + 1), num_allocated_(0) { }
+
+  ~TokenPool() {
+    for (int i = 0; i != blocks_.size(); ++i)
+      delete[] blocks_[i];
+  }
+
+  // Returns an array of n cleared tokens
+  inline Token* Alloc(int n) {
+    Token* tokens;
+    std::vector<Token*>& free_list = free_lists_[n];
+    if (!free_list.empty()) {
+      tokens = free_list.back();
+      free_list.pop_back();
+    } else {
+      if (block_ == blocks_.size() || pos_ + n > block_size_) {
+        if (block_ != blocks_.size())
+          ++block_;
+        if (block_ == blocks_.size())
+          blocks_.push_back(new Token[block_size_]);
+        pos_ = 0;
+      }
+      tokens = blocks_[block_] + pos_;
+      pos_ += n;
+    }
+    for (int i = 0; i != n; ++i)
+      tokens[i].Clear();
+    ++num_allocated_;
+    return tokens;
+  }
+
+  // Return an array of n tokens previously obtained from Alloc
+  inline void Free(Token* tokens, int n) {
+    free_lists_[n].push_back(tokens);
+    --num_allocated_;
+  }
+
+  // Reclaim every array at once, the blocks are kept for the next utterance
+  void Reset() {
+    block_ = 0;
+    pos_ = 0;
+    for (int i = 0; i != free_lists_.size(); ++i)
+      free_lists_[i].clear();
+    num_allocated_ = 0;
+  }
+
+  // Number of arrays currently handed out
+  int NumAllocated() const { return num_allocated_; }
+
+  // Memory held by the pool in bytes
+  size_t Size() const { return blocks_.size() * block_size_ * sizeof(Token); }
+
+ private:
+  int block_size_;  // Number of tokens in a block
+  int block_;  // Block currently being carved up
+  int pos_;  // Next free token in the current block
+  std::vector<Token*> blocks_;
+  std::vector<std::vector<Token*> > free_lists_;  // Indexed by array length
+  int num_allocated_;
+  DISALLOW_COPY_AND_ASSIGN(TokenPool);
+};
+
+}  // namespace dcd
+
+#endif  // DCD_TOKEN_POOL_H__
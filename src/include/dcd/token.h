@@ -28,7 +28,9 @@ namespace dcd {
 
 // L is the type of the lattice, L must expose a member LatticeState that is
 // expected to be a simple type such as an integer or a pointer or have very
-// cheap copy costs
+// cheap copy costs. With an index based lattice such as Lattice the token is
+// a 32-bit index and the cost, 8 bytes, a pointer based lattice such as
+// SimpleLattice pads it to 16 bytes
 template<class L>
 class TokenTpl {
  public:
@@ -61,9 +63,9 @@ class TokenTpl {
 
   // Combine with token, arriving from search arc f this Token is not active
   // allocate a new lattice state Add new lattice arc for search arc, AddArc
-  // could perform on-the-fly rescoring and return a better cost than
-  // token.Cost() Return a pair giving the cost of the arc arriving in the state
-  // and the best score of the state
+  // performs the on-the-fly rescoring of the word of the arc and may return
+  // a different cost than token.Cost() Return a pair giving the cost of the
+  // arc arriving in the state and the best score of the state
   // TODO(Paul) are the extract parameters slowing things down
   template<class SearchArc>
   inline pair<float, float> Combine(const TokenTpl& token,
@@ -103,9 +105,10 @@ class TokenTpl {
     return cost_;
   }
 
+  // The lattice resolves the back pointers, LatticeState may be an index
   template<class Arc>
-  int GetBestSequence(VectorFst<Arc>* ofst) const {
-    return tb_->GetBestSequence(ofst);
+  int GetBestSequence(VectorFst<Arc>* ofst, const Lattice& lattice) const {
+    return lattice.GetBestSequence(tb_, ofst);
   }
 
   template<class T>
@@ -117,13 +120,11 @@ class TokenTpl {
 
   inline LatticeState GetLatticeState() const { return tb_; }
 
-  inline void GcMark() { if (tb_) tb_->GcMark(); }
+  inline void GcMark(Lattice* lattice) { if (tb_) lattice->GcMark(tb_); }
 
   LatticeState tb_;
 
   float cost_;
-
-  unsigned int alignment_;
 };
 
 // Extends the token cost by cost F
@@ -15,6 +15,7 @@
 // \file
 // Memory debugging and statistics functions
 
+#include <atomic>
 #include <cstdlib>
 #include <iostream> 
 #include <new>
@@ -29,13 +30,13 @@
 using namespace std;
 using namespace dcd;
 
-unsigned long long g_dcd_num_bytes_allocated = 0;
-unsigned long long g_dcd_num_bytes_freed = 0;
-size_t g_dcd_current_num_allocated = 0;
-size_t g_dcd_peak_bytes_allocated = 0;
-size_t g_dcd_num_allocs = 0;
-size_t g_dcd_num_frees = 0;
-size_t g_dcd_global_allocated = 0;
+std::atomic<unsigned long long> g_dcd_num_bytes_allocated(0);
+std::atomic<unsigned long long> g_dcd_num_bytes_freed(0);
+std::atomic<size_t> g_dcd_current_num_allocated(0);
+std::atomic<size_t> g_dcd_peak_bytes_allocated(0);
+std::atomic<size_t> g_dcd_num_allocs(0);
+std::atomic<size_t> g_dcd_num_frees(0);
+std::atomic<size_t> g_dcd_global_allocated(0);
 bool g_dcd_memdebug_enabled = false;
 
 /*
@@ -54,46 +55,48 @@ class MembugSetup {
 };
 MembugSetup membug_setup;
 
-void* operator new(size_t size) throw(bad_alloc) {
+// The decoding threads allocate concurrently, the counters are only
+// statistics so relaxed updates are enough
+static void* CountedAlloc(size_t size) {
   size_t* ret = (size_t*)malloc(size + sizeof(size));
-  g_dcd_num_bytes_allocated += size;
-  g_dcd_current_num_allocated += size;
-  g_dcd_peak_bytes_allocated = 
-    max(g_dcd_peak_bytes_allocated, g_dcd_current_num_allocated);
-  ret[0] = size;
   if (!ret)
     throw bad_alloc();
-  ++g_dcd_num_allocs;
+  ret[0] = size;
+  g_dcd_num_bytes_allocated.fetch_add(size, memory_order_relaxed);
+  size_t current =
+    g_dcd_current_num_allocated.fetch_add(size, memory_order_relaxed) + size;
+  size_t peak = g_dcd_peak_bytes_allocated.load(memory_order_relaxed);
+  while (peak < current &&
+         !g_dcd_peak_bytes_allocated.compare_exchange_weak(
+             peak, current, memory_order_relaxed)) { }
+  g_dcd_num_allocs.fetch_add(1, memory_order_relaxed);
   return (void*)(ret + 1);
 }
 
+static void CountedFree(void* data) {
+  if (!data)
+    return;
+  size_t* size = (size_t*)(data) - 1;
+  g_dcd_num_bytes_freed.fetch_add(*size, memory_order_relaxed);
+  g_dcd_current_num_allocated.fetch_sub(*size, memory_order_relaxed);
+  g_dcd_num_frees.fetch_add(1, memory_order_relaxed);
+  free(size);
+}
+
+void* operator new(size_t size) throw(bad_alloc) {
+  return CountedAlloc(size);
+}
+
 void* operator new[] (size_t size) throw(bad_alloc) {
-  size_t* ret = (size_t*)malloc(size + sizeof(size));
-  g_dcd_num_bytes_allocated += size;
-  g_dcd_current_num_allocated += size;
-  g_dcd_peak_bytes_allocated = 
-    max(g_dcd_peak_bytes_allocated, g_dcd_current_num_allocated);
-  ret[0] = size;
-  if (!ret)
-    throw bad_alloc();
-  ++g_dcd_num_allocs;
-  return (void*)(ret + 1);
+  return CountedAlloc(size);
 }
 
 void operator delete (void* data) throw() {
-  size_t* size = (size_t*)(data) - 1;
-  g_dcd_num_bytes_freed += *size;
-  g_dcd_current_num_allocated -= *size;
-  free(size);
-  ++g_dcd_num_frees;
+  CountedFree(data);
 }
 
 void operator delete [] (void* data) throw() {
-  size_t* size = (size_t*)(data) - 1;
-  g_dcd_num_bytes_freed += *size;
-  g_dcd_current_num_allocated -= *size;
-  free(size);
-  ++g_dcd_num_frees;
+  CountedFree(data);
 }
 #endif
 
@@ -111,7 +114,8 @@ void PrintMemorySummary() {
          << " (" << g_dcd_peak_bytes_allocated / kMegaByte <<  "MB)" << endl;
     cerr << "\t\tGlobal # bytes allocated : " << g_dcd_global_allocated  
          << " (" << g_dcd_global_allocated / kKiloByte <<  "KB)" << endl;
-    size_t lost = g_dcd_current_num_allocated - g_dcd_global_allocated; 
+    size_t lost = g_dcd_current_num_allocated.load() -
+      g_dcd_global_allocated.load();
     cerr << "\t\tLost   # of bytes (potentially) : " <<  lost 
          << " (" << lost / kKiloByte <<  "KB)" << endl;
     cerr << "\t\tTotal  # of allocs " << g_dcd_num_allocs << endl;
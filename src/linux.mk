@@ -12,3 +12,9 @@ CXXFLAGS+=-I../include/ -I../../3rdparty/local/include/ \
 					-Wno-deprecated-writable-strings -DOS_LINUX  -std=c++0x -g -O2
 CXXFLAGS+=-DMEMDEBUG
 
+#Uncomment to build the vectorized token expansion kernels (--batch_expand)
+#for the host CPU, otherwise the scalar fallback is used
+#CXXFLAGS+=-march=native
+
+#Uncomment to collect the per-frame search trace written with --search_trace
+#CXXFLAGS+=-DHAVE_SEARCH_TRACE